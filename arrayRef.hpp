@@ -0,0 +1,48 @@
+// 本文件实现 只读的数组视图
+
+// 索引快照通过 mmap 映射之后 一直保持映射(见 index.hpp), 文档内容、词典 和倒排拉链 直接指向映射的内存, 不需要复制
+// arrayRef 只记录 起始地址和元素个数, 不拥有内存, 被引用的内存 必须比 arrayRef 存活得更久
+// 建立索引时 数据保存在索引自己的 string 和 vector 中, arrayRef 也可以指向它们, 使用者不需要区分数据来自哪里
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+
+namespace ns_index {
+	template <class T>
+	class arrayRef {
+	public:
+		arrayRef()
+			: _data(nullptr)
+			, _size(0) {}
+		arrayRef(const T* data, std::size_t size)
+			: _data(data)
+			, _size(size) {}
+		// 指向 std::string 或 std::vector 的内容, 容器修改后失效
+		template <class Container, class = decltype(std::declval<const Container&>().data())>
+		arrayRef(const Container& container)
+			: _data(container.data())
+			, _size(container.size()) {}
+
+		const T* data() const { return _data; }
+		std::size_t size() const { return _size; }
+		bool empty() const { return _size == 0; }
+
+		const T& operator[](std::size_t i) const { return _data[i]; }
+		const T& back() const { return _data[_size - 1]; }
+		const T* begin() const { return _data; }
+		const T* end() const { return _data + _size; }
+
+		// 复制为 std::string, 只用于 arrayRef<char>
+		std::string str() const { return std::string(_data, _size); }
+
+	private:
+		const T* _data;
+		std::size_t _size;
+	};
+
+	// 文本的视图, 不以 '\0' 结尾, 格式化输出时使用 %.*s
+	typedef arrayRef<char> textRef;
+} // namespace ns_index
@@ -0,0 +1,269 @@
+#ifndef CPPJIEBA_COMPILED_DICT_HPP
+#define CPPJIEBA_COMPILED_DICT_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "limonp/Logging.hpp"
+#include "limonp/StringUtil.hpp"
+
+namespace cppjieba {
+
+using namespace std;
+
+// A dictionary and HMM model compiled into one binary file.
+//
+// The file is a header followed by sections of fixed-size records: the
+// arrays of the double-array trie, the DictUnits, the tag strings and the
+// HMM tables, each in its in-memory layout. Loading is a single read-only
+// mmap. Nothing is parsed or copied, and every process that loads the same
+// file shares its physical pages.
+//
+// The header records the byte order and the size of every record type, so
+// a file written by an incompatible build is rejected instead of misread.
+// It also records a hash of the text files it was compiled from, so that a
+// stale file can be detected after the dictionary is edited.
+enum CompiledDictSection {
+  SECTION_DA_UNITS = 0,
+  SECTION_DA_BMP_CODES,
+  SECTION_DA_OTHER_CODES,
+  SECTION_DA_CODE_RUNES,
+  SECTION_DICT_UNITS,
+  SECTION_DICT_TAGS,
+  SECTION_DICT_WEIGHTS,
+  SECTION_DICT_USER_SINGLE_RUNES,
+  SECTION_HMM_PROBS,
+  SECTION_HMM_EMIT_RUNES, // one section per HMM state
+  SECTION_HMM_EMIT_PROBS = SECTION_HMM_EMIT_RUNES + 4,
+  SECTION_COUNT = SECTION_HMM_EMIT_PROBS + 4
+}; // enum CompiledDictSection
+
+const char COMPILED_DICT_MAGIC[8] = {'J', 'I', 'E', 'B', 'A', 'B', 'I', 'N'};
+const uint32_t COMPILED_DICT_VERSION = 1;
+const uint32_t COMPILED_DICT_BYTE_ORDER = 0x01020304;
+// Sections start at multiples of this, so that every record is aligned in the mapping.
+const size_t COMPILED_DICT_ALIGN = 8;
+
+struct CompiledDictHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t file_size;
+  uint64_t source_hash; // of the text files the dictionary was compiled from
+  uint64_t checksum;    // of everything after the header
+  struct Section {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t record_size;
+  } sections[SECTION_COUNT];
+}; // struct CompiledDictHeader
+
+inline uint64_t HashBytes(const char* data, size_t len, uint64_t seed = 0xcbf29ce484222325ULL) {
+  const uint64_t prime = 0x100000001b3ULL;
+  uint64_t h = seed;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    h = (h ^ word) * prime;
+    h ^= h >> 29;
+  }
+  for (; i < len; i++) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * prime;
+  }
+  return h;
+}
+
+// Collects the sections and writes them out as a compiled dictionary.
+class CompiledDictBuilder {
+ public:
+  CompiledDictBuilder()
+    : sections_(SECTION_COUNT) {
+    memset(&header_, 0, sizeof(header_));
+  }
+
+  template <class T>
+  void SetSection(CompiledDictSection id, const T* records, size_t count) {
+    sections_[id].assign(reinterpret_cast<const char*>(records), sizeof(T) * count);
+    header_.sections[id].count = count;
+    header_.sections[id].record_size = sizeof(T);
+  }
+
+  // Writes to a temporary file first and renames it over path, so a process
+  // that maps the old file at the same time never sees a half-written one.
+  bool Write(const string& path, uint64_t source_hash) {
+    memcpy(header_.magic, COMPILED_DICT_MAGIC, sizeof(header_.magic));
+    header_.version = COMPILED_DICT_VERSION;
+    header_.byte_order = COMPILED_DICT_BYTE_ORDER;
+    header_.source_hash = source_hash;
+
+    string body;
+    for (size_t i = 0; i < sections_.size(); i++) {
+      body.resize(AlignUp(sizeof(header_) + body.size()) - sizeof(header_), '\0');
+      header_.sections[i].offset = sizeof(header_) + body.size();
+      body += sections_[i];
+    }
+    header_.file_size = sizeof(header_) + body.size();
+    header_.checksum = HashBytes(body.data(), body.size());
+
+    string tmp_path = path + ".tmp";
+    ofstream ofs(tmp_path.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!ofs.is_open()) {
+      XLOG(ERROR) << "open " << tmp_path << " failed.";
+      return false;
+    }
+    ofs.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    ofs.write(body.data(), body.size());
+    ofs.close();
+    if (!ofs) {
+      XLOG(ERROR) << "write " << tmp_path << " failed.";
+      remove(tmp_path.c_str());
+      return false;
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+      XLOG(ERROR) << "rename " << tmp_path << " to " << path << " failed.";
+      remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  static size_t AlignUp(size_t offset) {
+    return (offset + COMPILED_DICT_ALIGN - 1) / COMPILED_DICT_ALIGN * COMPILED_DICT_ALIGN;
+  }
+
+  CompiledDictHeader header_;
+  vector<string> sections_;
+}; // class CompiledDictBuilder
+
+// A compiled dictionary mapped into memory. DictTrie and HMMModel loaded
+// from it point into the mapping, so it must outlive them.
+class CompiledDict {
+ public:
+  CompiledDict()
+    : data_(NULL), size_(0) {
+  }
+  ~CompiledDict() {
+    Close();
+  }
+
+  // Hashes the text files a dictionary is compiled from. user_dict_paths may
+  // list several files separated by '|' or ';', as for DictTrie. Returns
+  // false if any of them cannot be read.
+  static bool HashSources(const string& dict_path,
+        const string& user_dict_paths,
+        const string& model_path,
+        uint64_t* hash) {
+    vector<string> paths = limonp::Split(user_dict_paths, "|;");
+    paths.insert(paths.begin(), dict_path);
+    paths.push_back(model_path);
+    uint64_t h = HashBytes(NULL, 0);
+    for (size_t i = 0; i < paths.size(); i++) {
+      ifstream ifs(paths[i].c_str(), ios::in | ios::binary);
+      if (!ifs.is_open()) {
+        return false;
+      }
+      string content((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+      // The length goes in too, so moving bytes from one file to the next changes the hash.
+      uint64_t len = content.size();
+      h = HashBytes(reinterpret_cast<const char*>(&len), sizeof(len), h);
+      h = HashBytes(content.data(), content.size(), h);
+    }
+    *hash = h;
+    return true;
+  }
+
+  // Maps a compiled dictionary. A source_hash of 0 skips the staleness check.
+  // Returns false if the file is missing, was written by an incompatible
+  // build, is corrupt, or was compiled from different text files.
+  bool Load(const string& path, uint64_t source_hash) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(CompiledDictHeader)) {
+      close(fd);
+      return false;
+    }
+    size_t size = st.st_size;
+    void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<const char*>(addr);
+    size_ = size;
+    if (!Validate(source_hash)) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  bool IsLoaded() const {
+    return data_ != NULL;
+  }
+
+  template <class T>
+  const T* GetSection(CompiledDictSection id, size_t* count) const {
+    const CompiledDictHeader::Section& section = Header().sections[id];
+    XCHECK(section.record_size == sizeof(T)) << "compiled dict section " << id << " has records of "
+      << section.record_size << " bytes, expected " << sizeof(T);
+    *count = section.count;
+    return reinterpret_cast<const T*>(data_ + section.offset);
+  }
+
+ private:
+  const CompiledDictHeader& Header() const {
+    return *reinterpret_cast<const CompiledDictHeader*>(data_);
+  }
+
+  bool Validate(uint64_t source_hash) const {
+    const CompiledDictHeader& header = Header();
+    if (memcmp(header.magic, COMPILED_DICT_MAGIC, sizeof(header.magic)) != 0
+          || header.version != COMPILED_DICT_VERSION
+          || header.byte_order != COMPILED_DICT_BYTE_ORDER
+          || header.file_size != size_) {
+      return false;
+    }
+    for (size_t i = 0; i < SECTION_COUNT; i++) {
+      const CompiledDictHeader::Section& section = header.sections[i];
+      if (section.offset % COMPILED_DICT_ALIGN != 0 || section.offset < sizeof(header) || section.offset > size_
+            || (section.record_size != 0 && section.count > (size_ - section.offset) / section.record_size)) {
+        return false;
+      }
+    }
+    if (source_hash != 0 && header.source_hash != source_hash) {
+      return false;
+    }
+    return header.checksum == HashBytes(data_ + sizeof(header), size_ - sizeof(header));
+  }
+
+  void Close() {
+    if (data_ != NULL) {
+      munmap(const_cast<char*>(data_), size_);
+      data_ = NULL;
+      size_ = 0;
+    }
+  }
+
+  CompiledDict(const CompiledDict&);
+  CompiledDict& operator=(const CompiledDict&);
+
+  const char* data_;
+  size_t size_;
+}; // class CompiledDict
+
+} // namespace cppjieba
+
+#endif // CPPJIEBA_COMPILED_DICT_HPP
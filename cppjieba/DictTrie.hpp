@@ -14,6 +14,8 @@
 #include "limonp/Logging.hpp"
 #include "Unicode.hpp"
 #include "Trie.hpp"
+#include "DoubleArrayTrie.hpp"
+#include "CompiledDict.hpp"
 
 namespace cppjieba {
 
@@ -36,49 +38,66 @@ class DictTrie {
     Init(dict_path, user_dict_paths, user_word_weight_opt);
   }
 
+  // Uses the dictionary saved in a compiled dictionary in place, without
+  // reading the text files. compiled must outlive the DictTrie.
+  explicit DictTrie(const CompiledDict& compiled) {
+    Init(compiled);
+  }
+
   ~DictTrie() {
     delete trie_;
+    delete da_trie_;
   }
 
   bool InsertUserWord(const string& word, const string& tag = UNKNOWN_TAG) {
     DictUnit node_info;
-    if (!MakeNodeInfo(node_info, word, user_word_default_weight_, tag)) {
+    Unicode runes;
+    if (!MakeNodeInfo(node_info, runes, word, user_word_default_weight_, tag)) {
       return false;
     }
     active_node_infos_.push_back(node_info);
-    trie_->InsertNode(node_info.word, &active_node_infos_.back());
+    GetMutableTrie()->InsertNode(runes, &active_node_infos_.back());
     return true;
   }
 
   bool InsertUserWord(const string& word,int freq, const string& tag = UNKNOWN_TAG) {
     DictUnit node_info;
+    Unicode runes;
     double weight = freq ? log(1.0 * freq / freq_sum_) : user_word_default_weight_ ;
-    if (!MakeNodeInfo(node_info, word, weight , tag)) {
+    if (!MakeNodeInfo(node_info, runes, word, weight , tag)) {
       return false;
     }
     active_node_infos_.push_back(node_info);
-    trie_->InsertNode(node_info.word, &active_node_infos_.back());
+    GetMutableTrie()->InsertNode(runes, &active_node_infos_.back());
     return true;
   }
 
   bool DeleteUserWord(const string& word, const string& tag = UNKNOWN_TAG) {
     DictUnit node_info;
-    if (!MakeNodeInfo(node_info, word, user_word_default_weight_, tag)) {
+    Unicode runes;
+    if (!MakeNodeInfo(node_info, runes, word, user_word_default_weight_, tag)) {
       return false;
     }
-    trie_->DeleteNode(node_info.word, &node_info);
+    GetMutableTrie()->DeleteNode(runes, &node_info);
     return true;
   }
   
   const DictUnit* Find(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end) const {
-    return trie_->Find(begin, end);
+    if (trie_ != NULL) {
+      return trie_->Find(begin, end);
+    }
+    return da_trie_->Find(begin, end);
   }
 
   void Find(RuneStrArray::const_iterator begin, 
         RuneStrArray::const_iterator end, 
         vector<struct Dag>&res,
         size_t max_word_len = MAX_WORD_LENGTH) const {
-    trie_->Find(begin, end, res, max_word_len);
+    if (trie_ != NULL) {
+      trie_->Find(begin, end, res, max_word_len);
+      return;
+    }
+    da_trie_->Find(begin, end, res, max_word_len);
   }
 
   bool Find(const string& word)
@@ -108,17 +127,36 @@ class DictTrie {
     return min_weight_;
   }
 
+  const char* GetTag(const DictUnit& unit) const {
+    return tags_ + unit.tag;
+  }
+
+  // Saves the dictionary into a compiled dictionary, see CompiledDict.
+  void Save(CompiledDictBuilder& builder) const {
+    XCHECK(trie_ == NULL) << "words inserted or deleted at runtime are not saved";
+    da_trie_->Save(builder);
+    builder.SetSection(SECTION_DICT_UNITS, static_units_, static_unit_count_);
+    builder.SetSection(SECTION_DICT_TAGS, tags_, tags_size_);
+    double weights[DICT_WEIGHT_COUNT] = {freq_sum_, min_weight_, max_weight_, median_weight_, user_word_default_weight_};
+    builder.SetSection(SECTION_DICT_WEIGHTS, weights, DICT_WEIGHT_COUNT);
+    vector<Rune> single_runes(user_dict_single_chinese_word_.begin(), user_dict_single_chinese_word_.end());
+    builder.SetSection(SECTION_DICT_USER_SINGLE_RUNES, single_runes.data(), single_runes.size());
+  }
+
   void InserUserDictNode(const string& line) {
     vector<string> buf;
     DictUnit node_info;
+    Unicode runes;
     Split(line, buf, " ");
     if(buf.size() == 1){
           MakeNodeInfo(node_info, 
+                runes,
                 buf[0], 
                 user_word_default_weight_,
                 UNKNOWN_TAG);
         } else if (buf.size() == 2) {
           MakeNodeInfo(node_info, 
+                runes,
                 buf[0], 
                 user_word_default_weight_,
                 buf[1]);
@@ -126,11 +164,12 @@ class DictTrie {
           int freq = atoi(buf[1].c_str());
           assert(freq_sum_ > 0.0);
           double weight = log(1.0 * freq / freq_sum_);
-          MakeNodeInfo(node_info, buf[0], weight, buf[2]);
+          MakeNodeInfo(node_info, runes, buf[0], weight, buf[2]);
         }
         static_node_infos_.push_back(node_info);
-        if (node_info.word.size() == 1) {
-          user_dict_single_chinese_word_.insert(node_info.word[0]);
+        static_words_.push_back(runes);
+        if (runes.size() == 1) {
+          user_dict_single_chinese_word_.insert(runes[0]);
         }
   }
   
@@ -166,7 +205,12 @@ class DictTrie {
 
 
  private:
+  enum {DICT_WEIGHT_COUNT = 5};
+
   void Init(const string& dict_path, const string& user_dict_paths, UserWordWeightOption user_word_weight_opt) {
+    tag_storage_.assign(1, '\0'); // offset 0 is UNKNOWN_TAG
+    tags_ = tag_storage_.data();
+    tags_size_ = tag_storage_.size();
     LoadDict(dict_path);
     freq_sum_ = CalcFreqSum(static_node_infos_);
     CalculateWeight(static_node_infos_, freq_sum_);
@@ -176,34 +220,86 @@ class DictTrie {
       LoadUserDict(user_dict_paths);
     }
     Shrink(static_node_infos_);
-    CreateTrie(static_node_infos_);
+    static_units_ = static_node_infos_.data();
+    static_unit_count_ = static_node_infos_.size();
+    CreateTrie(static_words_);
+    // The words are in the trie now, GetKeys gives them back if needed.
+    vector<Unicode>().swap(static_words_);
   }
-  
-  void CreateTrie(const vector<DictUnit>& dictUnits) {
-    assert(dictUnits.size());
-    vector<Unicode> words;
-    vector<const DictUnit*> valuePointers;
-    for (size_t i = 0 ; i < dictUnits.size(); i ++) {
-      words.push_back(dictUnits[i].word);
-      valuePointers.push_back(&dictUnits[i]);
-    }
 
-    trie_ = new Trie(words, valuePointers);
+  void Init(const CompiledDict& compiled) {
+    size_t count = 0;
+    static_units_ = compiled.GetSection<DictUnit>(SECTION_DICT_UNITS, &static_unit_count_);
+    tags_ = compiled.GetSection<char>(SECTION_DICT_TAGS, &tags_size_);
+    const double* weights = compiled.GetSection<double>(SECTION_DICT_WEIGHTS, &count);
+    XCHECK(count == DICT_WEIGHT_COUNT && tags_size_ > 0 && tags_[tags_size_ - 1] == '\0')
+      << "invalid dictionary in compiled dict";
+    freq_sum_ = weights[0];
+    min_weight_ = weights[1];
+    max_weight_ = weights[2];
+    median_weight_ = weights[3];
+    user_word_default_weight_ = weights[4];
+    const Rune* single_runes = compiled.GetSection<Rune>(SECTION_DICT_USER_SINGLE_RUNES, &count);
+    user_dict_single_chinese_word_.insert(single_runes, single_runes + count);
+
+    trie_ = NULL;
+    da_trie_ = new DoubleArrayTrie(compiled, static_units_);
   }
-
   
+  // Lookups go to a static double-array trie. The node-based Trie is only
+  // built on the first runtime InsertUserWord/DeleteUserWord, and from then
+  // on it serves lookups instead.
+  void CreateTrie(const vector<Unicode>& words) {
+    assert(words.size());
+    trie_ = NULL;
+    da_trie_ = new DoubleArrayTrie(words, static_units_);
+  }
+
+  Trie* GetMutableTrie() {
+    if (trie_ == NULL) {
+      vector<Unicode> words;
+      vector<const DictUnit*> valuePointers;
+      da_trie_->GetKeys(words, valuePointers);
+      trie_ = new Trie(words, valuePointers);
+    }
+    return trie_;
+  }
 
+  // Returns the offset of tag in the tag pool, adding it if it is new.
+  uint32_t InternTag(const string& tag) {
+    if (tag_offsets_.empty()) {
+      for (size_t offset = 0; offset < tags_size_; offset += strlen(tags_ + offset) + 1) {
+        tag_offsets_[tags_ + offset] = uint32_t(offset);
+      }
+    }
+    unordered_map<string, uint32_t>::const_iterator it = tag_offsets_.find(tag);
+    if (it != tag_offsets_.end()) {
+      return it->second;
+    }
+    // A compiled tag pool is read-only, so new tags go to a copy of it.
+    if (tags_ != tag_storage_.data()) {
+      tag_storage_.assign(tags_, tags_size_);
+    }
+    uint32_t offset = uint32_t(tag_storage_.size());
+    tag_storage_.append(tag.c_str(), tag.size() + 1);
+    tags_ = tag_storage_.data();
+    tags_size_ = tag_storage_.size();
+    tag_offsets_[tag] = offset;
+    return offset;
+  }
 
   bool MakeNodeInfo(DictUnit& node_info,
+        Unicode& runes,
         const string& word, 
         double weight, 
         const string& tag) {
-    if (!DecodeRunesInString(word, node_info.word)) {
+    if (!DecodeRunesInString(word, runes)) {
       XLOG(ERROR) << "Decode " << word << " failed.";
       return false;
     }
     node_info.weight = weight;
-    node_info.tag = tag;
+    node_info.length = uint32_t(runes.size());
+    node_info.tag = InternTag(tag);
     return true;
   }
 
@@ -214,14 +310,17 @@ class DictTrie {
     vector<string> buf;
 
     DictUnit node_info;
+    Unicode runes;
     for (size_t lineno = 0; getline(ifs, line); lineno++) {
       Split(line, buf, " ");
       XCHECK(buf.size() == DICT_COLUMN_NUM) << "split result illegal, line:" << line;
       MakeNodeInfo(node_info, 
+            runes,
             buf[0], 
             atof(buf[1].c_str()), 
             buf[2]);
       static_node_infos_.push_back(node_info);
+      static_words_.push_back(runes);
     }
   }
 
@@ -271,8 +370,20 @@ class DictTrie {
   }
 
   vector<DictUnit> static_node_infos_;
+  vector<Unicode> static_words_; // the words of static_node_infos_, until the trie is built
+  // static_node_infos_, or the DictUnits of a compiled dictionary
+  const DictUnit* static_units_;
+  size_t static_unit_count_;
   deque<DictUnit> active_node_infos_; // must not be vector
   Trie * trie_;
+  DoubleArrayTrie * da_trie_;
+
+  // Tags are stored once each, as NUL-terminated strings in one pool, and
+  // DictUnit::tag is an offset into it.
+  const char* tags_;
+  size_t tags_size_;
+  string tag_storage_;
+  unordered_map<string, uint32_t> tag_offsets_;
 
   double freq_sum_;
   double min_weight_;
@@ -0,0 +1,402 @@
+#ifndef CPPJIEBA_DOUBLE_ARRAY_TRIE_HPP
+#define CPPJIEBA_DOUBLE_ARRAY_TRIE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "limonp/StdExtension.hpp"
+#include "CompiledDict.hpp"
+#include "Trie.hpp"
+#include "Unicode.hpp"
+
+namespace cppjieba {
+
+using namespace std;
+
+// A static double-array trie with the same lookup interface as Trie.
+//
+// Every node is a slot in one flat array. The child of node s reached by
+// code c lives in slot units_[s].base + c, and it is a real child only if
+// that slot's check equals s. A transition is two loads from one array
+// instead of a hash lookup plus a pointer chase per rune.
+//
+// Runes are remapped to dense codes (1 = most frequent rune in the
+// dictionary) before indexing, so the arrays stay compact even though
+// Chinese runes are spread over a wide range. Runes that never appear in
+// the dictionary map to code 0, which has no transitions.
+//
+// The trie cannot be modified after construction. DictTrie falls back to
+// the node-based Trie when words are inserted or deleted at runtime.
+//
+// The arrays are either built here or used in place from a compiled
+// dictionary, so lookups only go through the pointers below.
+class DoubleArrayTrie {
+ public:
+  struct Unit {
+    int32_t base;
+    int32_t check;  // parent slot, -1 if the slot is free
+    uint32_t value; // 1 + index into the DictUnit array, 0 means no word ends here
+  };
+
+  // The code of a rune outside the BMP, kept sorted by rune.
+  struct OtherCode {
+    Rune rune;
+    uint32_t code;
+  };
+
+  // keys[i] is the word of values[i]. For duplicate keys the later one wins,
+  // as with Trie::InsertNode. values must outlive the trie.
+  DoubleArrayTrie(const vector<Unicode>& keys, const DictUnit* values)
+    : values_(values) {
+    Build(keys);
+  }
+
+  // Uses the arrays of a compiled dictionary, which must outlive the trie.
+  DoubleArrayTrie(const CompiledDict& compiled, const DictUnit* values)
+    : values_(values) {
+    size_t bmp_code_count = 0;
+    units_ = compiled.GetSection<Unit>(SECTION_DA_UNITS, &unit_count_);
+    bmp_codes_ = compiled.GetSection<uint32_t>(SECTION_DA_BMP_CODES, &bmp_code_count);
+    other_codes_ = compiled.GetSection<OtherCode>(SECTION_DA_OTHER_CODES, &other_code_count_);
+    code_runes_ = compiled.GetSection<Rune>(SECTION_DA_CODE_RUNES, &code_count_);
+    XCHECK(unit_count_ > 0 && bmp_code_count == BMP_SIZE) << "invalid double-array trie in compiled dict";
+  }
+
+  void Save(CompiledDictBuilder& builder) const {
+    builder.SetSection(SECTION_DA_UNITS, units_, unit_count_);
+    builder.SetSection(SECTION_DA_BMP_CODES, bmp_codes_, size_t(BMP_SIZE));
+    builder.SetSection(SECTION_DA_OTHER_CODES, other_codes_, other_code_count_);
+    builder.SetSection(SECTION_DA_CODE_RUNES, code_runes_, code_count_);
+  }
+
+  const DictUnit* Find(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end) const {
+    if (begin == end) {
+      return NULL;
+    }
+
+    int32_t node = 0;
+    for (RuneStrArray::const_iterator it = begin; it != end; it++) {
+      node = Next(node, it->rune);
+      if (node < 0) {
+        return NULL;
+      }
+    }
+    return Value(node);
+  }
+
+  void Find(RuneStrArray::const_iterator begin,
+        RuneStrArray::const_iterator end,
+        vector<struct Dag>&res,
+        size_t max_word_len = MAX_WORD_LENGTH) const {
+    res.resize(end - begin);
+
+    // Each rune is remapped once here instead of once per prefix it appears in.
+    // Segmenters share one DictTrie across threads, so the buffer is per thread.
+    static thread_local vector<uint32_t> codes;
+    codes.resize(end - begin);
+    for (size_t i = 0; i < size_t(end - begin); i++) {
+      codes[i] = CodeOf((begin + i)->rune);
+    }
+
+    for (size_t i = 0; i < size_t(end - begin); i++) {
+      res[i].runestr = *(begin + i);
+
+      int32_t node = NextCode(0, codes[i]);
+      const DictUnit* value = node < 0 ? NULL : Value(node);
+      res[i].nexts.push_back(pair<size_t, const DictUnit*>(i, value));
+
+      for (size_t j = i + 1; j < size_t(end - begin) && (j - i + 1) <= max_word_len; j++) {
+        if (node < 0) {
+          break;
+        }
+        node = NextCode(node, codes[j]);
+        if (node < 0) {
+          break;
+        }
+        value = Value(node);
+        if (NULL != value) {
+          res[i].nexts.push_back(pair<size_t, const DictUnit*>(j, value));
+        }
+      }
+    }
+  }
+
+  // Recovers every word in the trie with its DictUnit, by walking up from
+  // each slot that holds a value. DictTrie uses it to build a mutable Trie.
+  void GetKeys(vector<Unicode>& keys, vector<const DictUnit*>& valuePointers) const {
+    for (size_t slot = 1; slot < unit_count_; slot++) {
+      if (units_[slot].check < 0 || units_[slot].value == 0) {
+        continue;
+      }
+      vector<Rune> reversed;
+      for (int32_t node = int32_t(slot); node != 0; node = units_[node].check) {
+        reversed.push_back(code_runes_[node - units_[units_[node].check].base]);
+      }
+      Unicode key;
+      for (size_t i = reversed.size(); i > 0; i--) {
+        key.push_back(reversed[i - 1]);
+      }
+      keys.push_back(key);
+      valuePointers.push_back(Value(int32_t(slot)));
+    }
+  }
+
+  size_t NodeCount() const {
+    size_t count = 0;
+    for (size_t slot = 0; slot < unit_count_; slot++) {
+      if (units_[slot].check >= 0) {
+        count++;
+      }
+    }
+    return count;
+  }
+  size_t ArraySize() const {
+    return unit_count_;
+  }
+
+ private:
+  // A node under construction: its slot and the range of sorted keys below it.
+  struct PendingNode {
+    int32_t slot;
+    size_t left;
+    size_t right;
+    size_t depth;
+  };
+
+  static const uint32_t BMP_SIZE = 0x10000;
+
+  const DictUnit* Value(int32_t node) const {
+    uint32_t value = units_[node].value;
+    return value == 0 ? NULL : values_ + (value - 1);
+  }
+
+  uint32_t CodeOf(Rune rune) const {
+    if (rune < BMP_SIZE) {
+      return bmp_codes_[rune];
+    }
+    const OtherCode* end = other_codes_ + other_code_count_;
+    const OtherCode* it = lower_bound(other_codes_, end, rune, OtherCodeLess);
+    return it == end || it->rune != rune ? 0 : it->code;
+  }
+
+  int32_t NextCode(int32_t node, uint32_t code) const {
+    if (code == 0) {
+      return -1;
+    }
+    size_t slot = size_t(units_[node].base) + code;
+    if (slot >= unit_count_ || units_[slot].check != node) {
+      return -1;
+    }
+    return int32_t(slot);
+  }
+
+  int32_t Next(int32_t node, Rune rune) const {
+    return NextCode(node, CodeOf(rune));
+  }
+
+  void BuildAlphabet(const vector<Unicode>& keys) {
+    unordered_map<Rune, size_t> freqs;
+    for (size_t i = 0; i < keys.size(); i++) {
+      for (size_t j = 0; j < keys[i].size(); j++) {
+        freqs[keys[i][j]]++;
+      }
+    }
+    vector<pair<size_t, Rune> > runes;
+    for (unordered_map<Rune, size_t>::const_iterator it = freqs.begin(); it != freqs.end(); ++it) {
+      runes.push_back(make_pair(it->second, it->first));
+    }
+    // Frequent runes get small codes, which keeps the children of busy nodes close together.
+    sort(runes.begin(), runes.end(), greater<pair<size_t, Rune> >());
+
+    bmp_code_storage_.assign(BMP_SIZE, 0);
+    code_rune_storage_.assign(1, 0);
+    for (size_t i = 0; i < runes.size(); i++) {
+      uint32_t code = uint32_t(i + 1);
+      if (runes[i].second < BMP_SIZE) {
+        bmp_code_storage_[runes[i].second] = code;
+      } else {
+        OtherCode other = {runes[i].second, code};
+        other_code_storage_.push_back(other);
+      }
+      code_rune_storage_.push_back(runes[i].second);
+    }
+    sort(other_code_storage_.begin(), other_code_storage_.end(), OtherCodeOrder);
+
+    bmp_codes_ = bmp_code_storage_.data();
+    other_codes_ = other_code_storage_.data();
+    other_code_count_ = other_code_storage_.size();
+    code_runes_ = code_rune_storage_.data();
+    code_count_ = code_rune_storage_.size();
+  }
+
+  void Build(const vector<Unicode>& keys) {
+    BuildAlphabet(keys);
+
+    // Sort the keys by their code sequences so the children of every node are contiguous.
+    vector<pair<vector<uint32_t>, uint32_t> > entries;
+    entries.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i].empty()) {
+        continue;
+      }
+      vector<uint32_t> codes(keys[i].size());
+      for (size_t j = 0; j < keys[i].size(); j++) {
+        codes[j] = CodeOf(keys[i][j]);
+      }
+      entries.push_back(make_pair(codes, uint32_t(i + 1)));
+    }
+    stable_sort(entries.begin(), entries.end(), KeyLess);
+
+    unit_storage_.clear();
+    used_bits_.clear();
+    Reserve(1024);
+    MarkUsed(0, 0); // the root is its own parent, only so that its slot counts as used
+    first_free_word_ = 0;
+
+    // Nodes are placed largest subtree first: nodes with many children are the
+    // hard ones to fit, so they go in while the array is still sparse, and the
+    // many single-child nodes fill the gaps afterwards.
+    vector<PendingNode> pending;
+    PendingNode root = {0, 0, entries.size(), 0};
+    pending.push_back(root);
+    vector<uint32_t> child_codes;
+    vector<size_t> child_starts;
+    while (!pending.empty()) {
+      pop_heap(pending.begin(), pending.end(), SmallerSubtree);
+      PendingNode node = pending.back();
+      pending.pop_back();
+
+      size_t i = node.left;
+      // A key that ends at this depth is the word stored in this node. For
+      // duplicate keys the later one wins, as with Trie::InsertNode.
+      for (; i < node.right && entries[i].first.size() == node.depth; i++) {
+        unit_storage_[node.slot].value = entries[i].second;
+      }
+
+      child_codes.clear();
+      child_starts.clear();
+      for (; i < node.right; i++) {
+        uint32_t code = entries[i].first[node.depth];
+        if (child_codes.empty() || child_codes.back() != code) {
+          child_codes.push_back(code);
+          child_starts.push_back(i);
+        }
+      }
+      if (child_codes.empty()) {
+        continue;
+      }
+      child_starts.push_back(node.right);
+
+      int32_t base = FindBase(child_codes);
+      unit_storage_[node.slot].base = base;
+      for (size_t k = 0; k < child_codes.size(); k++) {
+        int32_t slot = base + int32_t(child_codes[k]);
+        MarkUsed(slot, node.slot);
+        PendingNode child = {slot, child_starts[k], child_starts[k + 1], node.depth + 1};
+        pending.push_back(child);
+        push_heap(pending.begin(), pending.end(), SmallerSubtree);
+      }
+    }
+
+    // Drop the unused tail; transitions past the end fail on the bounds check.
+    size_t used = unit_storage_.size();
+    while (used > 1 && unit_storage_[used - 1].check < 0) {
+      used--;
+    }
+    unit_storage_.resize(used);
+    vector<Unit>(unit_storage_).swap(unit_storage_);
+    vector<uint64_t>().swap(used_bits_);
+
+    units_ = unit_storage_.data();
+    unit_count_ = unit_storage_.size();
+  }
+
+  static bool KeyLess(const pair<vector<uint32_t>, uint32_t>& lhs,
+        const pair<vector<uint32_t>, uint32_t>& rhs) {
+    return lhs.first < rhs.first;
+  }
+
+  static bool OtherCodeOrder(const OtherCode& lhs, const OtherCode& rhs) {
+    return lhs.rune < rhs.rune;
+  }
+
+  static bool OtherCodeLess(const OtherCode& other, Rune rune) {
+    return other.rune < rune;
+  }
+
+  static bool SmallerSubtree(const PendingNode& lhs, const PendingNode& rhs) {
+    return lhs.right - lhs.left < rhs.right - rhs.left;
+  }
+
+  // Finds the smallest base such that the slots base + code are free for all
+  // (ascending) codes. used_bits_ has one bit per slot, so 64 candidate bases
+  // are tested at once: OR-ing the occupancy words at base + code over all
+  // codes leaves a zero bit exactly at the bases where every child fits.
+  int32_t FindBase(const vector<uint32_t>& codes) {
+    while (used_bits_[first_free_word_] == ~uint64_t(0)) {
+      first_free_word_++;
+    }
+    // Every slot before the first free word is used, so base + codes[0] must lie after it.
+    size_t first_slot = first_free_word_ * 64;
+    size_t base = first_slot > codes[0] ? first_slot - codes[0] : 0;
+    for (;; base += 64) {
+      Reserve(base + codes.back() + 64);
+      uint64_t used = 0;
+      for (size_t k = 0; k < codes.size() && used != ~uint64_t(0); k++) {
+        used |= UsedBits(base + codes[k]);
+      }
+      if (used != ~uint64_t(0)) {
+        return int32_t(base + __builtin_ctzll(~used));
+      }
+    }
+  }
+
+  // Occupancy of the 64 slots starting at slot.
+  uint64_t UsedBits(size_t slot) const {
+    size_t word = slot / 64, shift = slot % 64;
+    if (shift == 0) {
+      return used_bits_[word];
+    }
+    return (used_bits_[word] >> shift) | (used_bits_[word + 1] << (64 - shift));
+  }
+
+  void MarkUsed(int32_t slot, int32_t parent) {
+    unit_storage_[slot].check = parent;
+    used_bits_[slot / 64] |= uint64_t(1) << (slot % 64);
+  }
+
+  void Reserve(size_t size) {
+    if (size > unit_storage_.size()) {
+      size = max(size, unit_storage_.size() * 2);
+      Unit free_unit = {0, -1, 0};
+      unit_storage_.resize(size, free_unit);
+      // One spare word so that UsedBits can always read word + 1.
+      used_bits_.resize(size / 64 + 2, 0);
+    }
+  }
+
+  const Unit* units_;
+  size_t unit_count_;
+  const uint32_t* bmp_codes_;
+  const OtherCode* other_codes_;
+  size_t other_code_count_;
+  const Rune* code_runes_; // the rune of every code, for GetKeys
+  size_t code_count_;
+  const DictUnit* values_;
+
+  // The arrays, when the trie is built here rather than loaded.
+  vector<Unit> unit_storage_;
+  vector<uint32_t> bmp_code_storage_;
+  vector<OtherCode> other_code_storage_;
+  vector<Rune> code_rune_storage_;
+
+  // Construction only.
+  vector<uint64_t> used_bits_;
+  size_t first_free_word_;
+}; // class DoubleArrayTrie
+
+} // namespace cppjieba
+
+#endif // CPPJIEBA_DOUBLE_ARRAY_TRIE_HPP
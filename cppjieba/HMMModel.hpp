@@ -1,13 +1,70 @@
 #ifndef CPPJIEBA_HMMMODEL_H
 #define CPPJIEBA_HMMMODEL_H
 
+#include <algorithm>
 #include "limonp/StringUtil.hpp"
+#include "CompiledDict.hpp"
 #include "Trie.hpp"
 
 namespace cppjieba {
 
 using namespace limonp;
-typedef unordered_map<Rune, double> EmitProbMap;
+
+// The emission probabilities of one state: the runes in ascending order and
+// their probabilities, in two parallel arrays. The arrays are either built
+// from the model file or used in place from a compiled dictionary.
+class EmitProbMap {
+ public:
+  EmitProbMap()
+    : runes_(NULL), probs_(NULL), size_(0) {
+  }
+
+  double Get(Rune rune, double defVal) const {
+    const Rune* it = lower_bound(runes_, runes_ + size_, rune);
+    if (it == runes_ + size_ || *it != rune) {
+      return defVal;
+    }
+    return probs_[it - runes_];
+  }
+
+  void Assign(const unordered_map<Rune, double>& probs) {
+    vector<pair<Rune, double> > sorted(probs.begin(), probs.end());
+    sort(sorted.begin(), sorted.end());
+    rune_storage_.clear();
+    prob_storage_.clear();
+    for (size_t i = 0; i < sorted.size(); i++) {
+      rune_storage_.push_back(sorted[i].first);
+      prob_storage_.push_back(sorted[i].second);
+    }
+    Attach(rune_storage_.data(), prob_storage_.data(), sorted.size());
+  }
+
+  void Attach(const Rune* runes, const double* probs, size_t size) {
+    runes_ = runes;
+    probs_ = probs;
+    size_ = size;
+  }
+
+  const Rune* Runes() const {
+    return runes_;
+  }
+  const double* Probs() const {
+    return probs_;
+  }
+  size_t Size() const {
+    return size_;
+  }
+
+ private:
+  EmitProbMap(const EmitProbMap&);
+  EmitProbMap& operator=(const EmitProbMap&);
+
+  const Rune* runes_;
+  const double* probs_;
+  size_t size_;
+  vector<Rune> rune_storage_;
+  vector<double> prob_storage_;
+}; // class EmitProbMap
 
 struct HMMModel {
   /*
@@ -15,8 +72,32 @@ struct HMMModel {
    * 0: HMMModel::B, 1: HMMModel::E, 2: HMMModel::M, 3:HMMModel::S
    * */
   enum {B = 0, E = 1, M = 2, S = 3, STATUS_SUM = 4};
+  // startProb followed by transProb
+  enum {PROB_COUNT = STATUS_SUM + STATUS_SUM * STATUS_SUM};
 
   HMMModel(const string& modelPath) {
+    Init();
+    LoadModel(modelPath);
+  }
+  // Uses the tables saved in a compiled dictionary, which must outlive the model.
+  explicit HMMModel(const CompiledDict& compiled) {
+    Init();
+    size_t count = 0;
+    const double* probs = compiled.GetSection<double>(SECTION_HMM_PROBS, &count);
+    XCHECK(count == PROB_COUNT) << "invalid HMM model in compiled dict";
+    memcpy(startProb, probs, sizeof(startProb));
+    memcpy(transProb, probs + STATUS_SUM, sizeof(transProb));
+    for (size_t i = 0; i < STATUS_SUM; i++) {
+      size_t prob_count = 0;
+      const Rune* runes = compiled.GetSection<Rune>(CompiledDictSection(SECTION_HMM_EMIT_RUNES + i), &count);
+      const double* emit_probs = compiled.GetSection<double>(CompiledDictSection(SECTION_HMM_EMIT_PROBS + i), &prob_count);
+      XCHECK(count == prob_count) << "invalid HMM model in compiled dict";
+      emitProbVec[i]->Attach(runes, emit_probs, count);
+    }
+  }
+  ~HMMModel() {
+  }
+  void Init() {
     memset(startProb, 0, sizeof(startProb));
     memset(transProb, 0, sizeof(transProb));
     statMap[0] = 'B';
@@ -27,9 +108,18 @@ struct HMMModel {
     emitProbVec.push_back(&emitProbE);
     emitProbVec.push_back(&emitProbM);
     emitProbVec.push_back(&emitProbS);
-    LoadModel(modelPath);
   }
-  ~HMMModel() {
+  // Saves the model into a compiled dictionary, see CompiledDict.
+  void Save(CompiledDictBuilder& builder) const {
+    double probs[PROB_COUNT];
+    memcpy(probs, startProb, sizeof(startProb));
+    memcpy(probs + STATUS_SUM, transProb, sizeof(transProb));
+    builder.SetSection(SECTION_HMM_PROBS, probs, size_t(PROB_COUNT));
+    for (size_t i = 0; i < STATUS_SUM; i++) {
+      const EmitProbMap* mp = emitProbVec[i];
+      builder.SetSection(CompiledDictSection(SECTION_HMM_EMIT_RUNES + i), mp->Runes(), mp->Size());
+      builder.SetSection(CompiledDictSection(SECTION_HMM_EMIT_PROBS + i), mp->Probs(), mp->Size());
+    }
   }
   void LoadModel(const string& filePath) {
     ifstream ifile(filePath.c_str());
@@ -73,11 +163,7 @@ struct HMMModel {
   }
   double GetEmitProb(const EmitProbMap* ptMp, Rune key, 
         double defVal)const {
-    EmitProbMap::const_iterator cit = ptMp->find(key);
-    if (cit == ptMp->end()) {
-      return defVal;
-    }
-    return cit->second;
+    return ptMp->Get(key, defVal);
   }
   bool GetLine(ifstream& ifile, string& line) {
     while (getline(ifile, line)) {
@@ -98,6 +184,7 @@ struct HMMModel {
     }
     vector<string> tmp, tmp2;
     Unicode unicode;
+    unordered_map<Rune, double> probs;
     Split(line, tmp, ",");
     for (size_t i = 0; i < tmp.size(); i++) {
       Split(tmp[i], tmp2, ":");
@@ -109,8 +196,9 @@ struct HMMModel {
         XLOG(ERROR) << "TransCode failed.";
         return false;
       }
-      mp[unicode[0]] = atof(tmp2[1].c_str());
+      probs[unicode[0]] = atof(tmp2[1].c_str());
     }
+    mp.Assign(probs);
     return true;
   }
 
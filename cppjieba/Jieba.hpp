@@ -22,6 +22,20 @@ class Jieba {
       query_seg_(&dict_trie_, &model_),
       extractor(&dict_trie_, &model_, idfPath, stopWordPath) {
   }
+  // Takes the dictionary and the HMM model from a compiled dictionary, which
+  // must outlive the Jieba. The user dictionary is compiled in as well.
+  Jieba(const CompiledDict& compiled,
+        const string& idfPath, 
+        const string& stopWordPath) 
+    : dict_trie_(compiled),
+      model_(compiled),
+      mp_seg_(&dict_trie_),
+      hmm_seg_(&model_),
+      mix_seg_(&dict_trie_, &model_),
+      full_seg_(&dict_trie_),
+      query_seg_(&dict_trie_, &model_),
+      extractor(&dict_trie_, &model_, idfPath, stopWordPath) {
+  }
   ~Jieba() {
   }
 
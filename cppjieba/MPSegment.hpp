@@ -114,10 +114,10 @@ class MPSegment: public SegmentTagged {
     while (i < dags.size()) {
       const DictUnit* p = dags[i].pInfo;
       if (p) {
-        assert(p->word.size() >= 1);
-        WordRange wr(begin + i, begin + i + p->word.size() - 1);
+        assert(p->length >= 1);
+        WordRange wr(begin + i, begin + i + p->length - 1);
         words.push_back(wr);
-        i += p->word.size();
+        i += p->length;
       } else { //single chinese word
         WordRange wr(begin + i, begin + i);
         words.push_back(wr);
@@ -12,19 +12,14 @@ using namespace std;
 
 const size_t MAX_WORD_LENGTH = 512;
 
+// Plain data, so that a compiled dictionary can store an array of DictUnits
+// and use it in place. The word itself is the key in the trie.
 struct DictUnit {
-  Unicode word;
   double weight;
-  string tag;
+  uint32_t length; // of the word, in runes
+  uint32_t tag;    // offset of the tag string, see DictTrie::GetTag
 }; // struct DictUnit
 
-// for debugging
-// inline ostream & operator << (ostream& os, const DictUnit& unit) {
-//   string s;
-//   s << unit.word;
-//   return os << StringFormat("%s %s %.3lf", s.c_str(), unit.tag.c_str(), unit.weight);
-// }
-
 struct Dag {
   RuneStr runestr;
   // [offset, nexts.first]
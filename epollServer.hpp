@@ -0,0 +1,900 @@
+// 本文件实现 基于 epoll 的事件驱动 HTTP 服务器
+
+// httplib::Server 为每个连接分配一个线程池中的线程, 保持连接(keep-alive)期间 这个线程一直被占用
+// 线程池只有几个线程, 少量空闲的保持连接 就能占满所有线程, 之后的新连接 都得不到处理
+// 这里将 网络I/O 和 请求处理 分开:
+//  一个 I/O 线程(reactor) 通过 epoll 管理所有连接, 负责 接受连接, 读取并解析请求, 发送响应
+//  请求解析完成后, 交给计算线程池 执行处理函数(搜索), 计算线程不接触套接字
+//  计算线程将生成的响应放入完成队列, 通过 eventfd 唤醒 I/O 线程发送
+// 空闲的连接 只占用一个 connection_t 和一个文件描述符, 几万个连接也没有多少开销
+// 连接数 和 同时搜索的数量 各自独立: 前者由 maxConnections 限制, 后者由计算线程数决定
+//
+// 只实现 本项目需要的 HTTP/1.x 子集:
+//  只处理 GET 和 POST 请求, 请求正文会被读取并丢弃, 不支持 chunked 请求正文, 请求头不能超过 MAX_HEADER_BYTES
+//  支持保持连接 和 流水线请求(pipelining), 同一个连接上的请求 按顺序逐个处理
+//  超过 idleTimeout 没有活动的连接 会被关闭
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "logMessage.hpp"
+
+namespace ns_server {
+	// 请求头的最大字节数, 请求正文的最大字节数
+	const std::size_t MAX_HEADER_BYTES = 8 << 10;
+	const std::size_t MAX_BODY_BYTES = 64 << 10;
+	// 每次 read 使用的缓冲区大小
+	const std::size_t READ_CHUNK = 16 << 10;
+	// epoll_wait 一次最多返回的事件数, 以及 检查空闲连接的时间间隔(毫秒)
+	const int MAX_EVENTS = 1024;
+	const int TIMER_INTERVAL_MS = 1000;
+
+	typedef struct httpRequest {
+		std::string _method;
+		std::string _path;
+		std::string _version;
+		std::string _remoteAddr; // 对端的 IP 地址
+		std::unordered_map<std::string, std::string> _params;
+		std::vector<std::pair<std::string, std::string>> _headers;
+
+		bool hasParam(const std::string& key) const { return _params.find(key) != _params.end(); }
+
+		std::string getParam(const std::string& key) const {
+			auto it = _params.find(key);
+			return it == _params.end() ? std::string() : it->second;
+		}
+
+		// 请求头的名字 不区分大小写
+		std::string getHeader(const std::string& key) const {
+			for (const auto& header : _headers) {
+				if (header.first.size() == key.size() && strncasecmp(header.first.data(), key.data(), key.size()) == 0)
+					return header.second;
+			}
+			return std::string();
+		}
+	} httpRequest_t;
+
+	typedef struct httpResponse {
+		int _status;
+		std::string _contentType;
+		std::vector<std::pair<std::string, std::string>> _headers;
+		// 正文以 shared_ptr 保存, 缓存中的响应正文 可以直接发送, 不需要复制
+		std::shared_ptr<const std::string> _body;
+
+		httpResponse()
+			: _status(200) {}
+
+		void setHeader(const std::string& key, const std::string& value) { _headers.emplace_back(key, value); }
+
+		void setContent(std::string body, const std::string& contentType) {
+			_body = std::make_shared<const std::string>(std::move(body));
+			_contentType = contentType;
+		}
+
+		void setContent(std::shared_ptr<const std::string> body, const std::string& contentType) {
+			_body = std::move(body);
+			_contentType = contentType;
+		}
+	} httpResponse_t;
+
+	typedef std::function<void(const httpRequest_t&, httpResponse_t&)> handler_t;
+
+	// 状态码对应的原因短语
+	inline const char* statusMessage(int status) {
+		switch (status) {
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 413: return "Payload Too Large";
+		case 429: return "Too Many Requests";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 503: return "Service Unavailable";
+		default: return "Unknown";
+		}
+	}
+
+	// 十六进制字符的值, 不是十六进制字符时 返回 -1
+	inline int hexValue(char c) {
+		if ('0' <= c && c <= '9')
+			return c - '0';
+		if ('a' <= c && c <= 'f')
+			return c - 'a' + 10;
+		if ('A' <= c && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	// url 解码, plusToSpace 为 true 时 '+' 解码为空格(查询参数)
+	inline std::string decodeUrl(const std::string& src, bool plusToSpace) {
+		std::string out;
+		out.reserve(src.size());
+		for (std::size_t i = 0; i < src.size(); i++) {
+			char c = src[i];
+			int high = 0, low = 0;
+			if (c == '%' && i + 2 < src.size() && (high = hexValue(src[i + 1])) >= 0 &&
+				(low = hexValue(src[i + 2])) >= 0) {
+				out.push_back((char)(high * 16 + low));
+				i += 2;
+			}
+			else if (c == '+' && plusToSpace) {
+				out.push_back(' ');
+			}
+			else {
+				out.push_back(c);
+			}
+		}
+		return out;
+	}
+
+	// 解析 url 中 '?' 之后的查询参数, 同名参数 保留第一个
+	inline void parseQuery(const std::string& query, std::unordered_map<std::string, std::string>* params) {
+		std::size_t begin = 0;
+		while (begin <= query.size()) {
+			std::size_t end = query.find('&', begin);
+			if (end == std::string::npos)
+				end = query.size();
+			if (end > begin) {
+				std::size_t eq = query.find('=', begin);
+				if (eq == std::string::npos || eq > end)
+					eq = end;
+				std::string key = decodeUrl(query.substr(begin, eq - begin), true);
+				std::string value = eq < end ? decodeUrl(query.substr(eq + 1, end - eq - 1), true) : std::string();
+				params->emplace(std::move(key), std::move(value));
+			}
+			begin = end + 1;
+		}
+	}
+
+	// 根据文件扩展名 获取静态文件的 Content-Type
+	inline const char* contentTypeOf(const std::string& path) {
+		static const std::pair<const char*, const char*> types[] = {
+			{".html", "text/html"},
+			{".htm", "text/html"},
+			{".css", "text/css"},
+			{".js", "text/javascript"},
+			{".json", "application/json"},
+			{".png", "image/png"},
+			{".jpg", "image/jpeg"},
+			{".jpeg", "image/jpeg"},
+			{".gif", "image/gif"},
+			{".svg", "image/svg+xml"},
+			{".ico", "image/x-icon"},
+			{".txt", "text/plain"},
+		};
+		std::size_t dot = path.rfind('.');
+		if (dot != std::string::npos) {
+			for (const auto& type : types) {
+				if (strcasecmp(path.c_str() + dot, type.first) == 0)
+					return type.second;
+			}
+		}
+		return "application/octet-stream";
+	}
+
+	// 计算线程池: 固定数量的线程 从任务队列中取出任务执行
+	class computePool {
+	public:
+		explicit computePool(std::size_t threadNum)
+			: _stop(false) {
+			if (threadNum == 0)
+				threadNum = 1;
+			for (std::size_t i = 0; i < threadNum; i++)
+				_threads.emplace_back(&computePool::workerRoutine, this);
+		}
+
+		computePool(const computePool&) = delete;
+		computePool& operator=(const computePool&) = delete;
+
+		~computePool() { shutdown(); }
+
+		// 执行完队列中剩余的任务 并等待所有线程退出, 可以重复调用
+		void shutdown() {
+			{
+				std::lock_guard<std::mutex> lock(_mtx);
+				_stop = true;
+			}
+			_cond.notify_all();
+			for (std::thread& thread : _threads) {
+				if (thread.joinable())
+					thread.join();
+			}
+		}
+
+		void enqueue(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(_mtx);
+				_tasks.push_back(std::move(task));
+			}
+			_cond.notify_one();
+		}
+
+	private:
+		void workerRoutine() {
+			for (;;) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(_mtx);
+					_cond.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+					// 停止时 也要执行完队列中剩余的任务
+					if (_tasks.empty())
+						return;
+					task = std::move(_tasks.front());
+					_tasks.pop_front();
+				}
+				task();
+			}
+		}
+
+		std::mutex _mtx;
+		std::condition_variable _cond;
+		std::deque<std::function<void()>> _tasks;
+		std::vector<std::thread> _threads;
+		bool _stop;
+	};
+
+	class epollServer {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// computeThreads: 执行处理函数的线程数, maxConnections: 同时保持的最大连接数
+		// idleTimeoutSeconds: 连接空闲多久之后关闭
+		epollServer(std::size_t computeThreads, std::size_t maxConnections, std::uint32_t idleTimeoutSeconds)
+			: _maxConnections(maxConnections)
+			, _idleTimeout(std::chrono::seconds(idleTimeoutSeconds))
+			, _listenFd(-1)
+			, _epollFd(-1)
+			, _wakeFd(-1)
+			, _spareFd(-1)
+			, _nextId(0)
+			, _reusePort(false)
+			, _running(false)
+			, _pool(computeThreads) {}
+
+		epollServer(const epollServer&) = delete;
+		epollServer& operator=(const epollServer&) = delete;
+
+		~epollServer() {
+			// 计算线程中的任务 还会访问完成队列 和 _wakeFd, 先等待它们结束
+			_pool.shutdown();
+			for (auto& conn : _connections)
+				::close(conn.first);
+			closeFd(_listenFd);
+			closeFd(_epollFd);
+			closeFd(_wakeFd);
+			closeFd(_spareFd);
+		}
+
+		// 注册 path 对应的处理函数, 处理函数在计算线程中执行
+		void Get(const std::string& path, handler_t handler) { _handlers[path] = std::move(handler); }
+		void Post(const std::string& path, handler_t handler) { _postHandlers[path] = std::move(handler); }
+
+		// 没有对应处理函数的路径 从 baseDir 目录中查找静态文件
+		void setBaseDir(const std::string& baseDir) { _baseDir = baseDir; }
+
+		// 监听套接字设置 SO_REUSEPORT, 多个进程可以绑定同一个端口, 由内核在它们之间分配新连接
+		void setReusePort(bool reusePort) { _reusePort = reusePort; }
+
+		// 监听 host:port 并运行事件循环, 直到 stop() 被调用. 初始化失败时返回 false
+		bool listen(const char* host, std::uint16_t port) {
+			if (!bindListen(host, port) || !initEpoll())
+				return false;
+
+			_running = true;
+			std::vector<struct epoll_event> events(MAX_EVENTS);
+			clock::time_point lastSweep = clock::now();
+			while (_running) {
+				int n = epoll_wait(_epollFd, events.data(), MAX_EVENTS, TIMER_INTERVAL_MS);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					LOG(FATAL, "epoll_wait error: %s", strerror(errno));
+					return false;
+				}
+				for (int i = 0; i < n; i++) {
+					int fd = events[i].data.fd;
+					if (fd == _listenFd)
+						acceptConnections();
+					else if (fd == _wakeFd)
+						handleCompletions();
+					else
+						handleEvent(fd, events[i].events);
+				}
+				if (clock::now() - lastSweep >= std::chrono::milliseconds(TIMER_INTERVAL_MS)) {
+					closeIdleConnections();
+					lastSweep = clock::now();
+				}
+			}
+
+			return true;
+		}
+
+		// 可以在任意线程调用, 事件循环 在下一次唤醒时退出
+		void stop() {
+			_running = false;
+			wakeUp();
+		}
+
+	private:
+		typedef struct connection {
+			int _fd;
+			std::uint64_t _id; // 文件描述符会被复用, 通过 _id 识别 完成的请求是否属于这个连接
+			std::string _remoteAddr;
+			std::string _in;   // 已读取 尚未处理的数据
+			std::string _outHead;
+			std::shared_ptr<const std::string> _outBody;
+			std::size_t _outOffset; // _outHead + _outBody 中已发送的字节数
+			bool _busy;				// 有请求 正在计算线程中处理
+			bool _closeAfterWrite;	// 响应发送完成之后 关闭连接
+			bool _peerClosed;		// 对端已经关闭写入, 处理完已读取的请求之后 关闭连接
+			std::uint32_t _events;	// 当前在 epoll 中注册的事件
+			clock::time_point _active;
+			std::list<connection*>::iterator _idlePos;
+
+			connection(int fd, std::uint64_t id)
+				: _fd(fd)
+				, _id(id)
+				, _outOffset(0)
+				, _busy(false)
+				, _closeAfterWrite(false)
+				, _peerClosed(false)
+				, _events(0)
+				, _active(clock::now()) {}
+
+			bool hasOutput() const { return !_outHead.empty(); }
+		} connection_t;
+
+		// 计算线程 生成的响应
+		typedef struct completion {
+			int _fd;
+			std::uint64_t _id;
+			std::string _head;
+			std::shared_ptr<const std::string> _body;
+			bool _keepAlive;
+		} completion_t;
+
+		static void closeFd(int& fd) {
+			if (fd >= 0)
+				::close(fd);
+			fd = -1;
+		}
+
+		static bool setNonBlocking(int fd) {
+			int flags = fcntl(fd, F_GETFL, 0);
+			return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+		}
+
+		bool bindListen(const char* host, std::uint16_t port) {
+			_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (_listenFd < 0) {
+				LOG(FATAL, "socket error: %s", strerror(errno));
+				return false;
+			}
+			int opt = 1;
+			setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+			if (_reusePort && setsockopt(_listenFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+				LOG(FATAL, "SO_REUSEPORT error: %s", strerror(errno));
+				return false;
+			}
+
+			struct sockaddr_in addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(port);
+			if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+				LOG(FATAL, "invalid listen address: %s", host);
+				return false;
+			}
+			if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+				LOG(FATAL, "bind %s:%d error: %s", host, port, strerror(errno));
+				return false;
+			}
+			if (::listen(_listenFd, SOMAXCONN) < 0) {
+				LOG(FATAL, "listen error: %s", strerror(errno));
+				return false;
+			}
+
+			return true;
+		}
+
+		bool initEpoll() {
+			_epollFd = epoll_create1(EPOLL_CLOEXEC);
+			_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			// 预留一个文件描述符, 文件描述符耗尽(EMFILE)时 释放它 接受并立即关闭新连接
+			// 否则 监听套接字一直可读, 事件循环会空转
+			_spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (_epollFd < 0 || _wakeFd < 0) {
+				LOG(FATAL, "epoll init error: %s", strerror(errno));
+				return false;
+			}
+
+			struct epoll_event event;
+			std::memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = _listenFd;
+			if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &event) < 0)
+				return false;
+			event.data.fd = _wakeFd;
+			return epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event) == 0;
+		}
+
+		void wakeUp() {
+			std::uint64_t one = 1;
+			if (_wakeFd >= 0 && write(_wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+				LOG(WARNING, "eventfd write error: %s", strerror(errno));
+		}
+
+		void acceptConnections() {
+			for (;;) {
+				struct sockaddr_in peer;
+				socklen_t peerLen = sizeof(peer);
+				int fd = accept4(_listenFd, (struct sockaddr*)&peer, &peerLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd < 0) {
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					// accept 先分配文件描述符 再取出连接, 没有待接受的连接时 也会返回 EMFILE
+					if ((errno == EMFILE || errno == ENFILE) && _spareFd >= 0) {
+						closeFd(_spareFd);
+						fd = accept(_listenFd, nullptr, nullptr);
+						_spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+						if (fd < 0)
+							return;
+						::close(fd);
+						LOG(WARNING, "文件描述符耗尽, 拒绝新连接");
+						continue;
+					}
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						LOG(WARNING, "accept error: %s", strerror(errno));
+					return;
+				}
+				if (_connections.size() >= _maxConnections) {
+					::close(fd);
+					continue;
+				}
+
+				int opt = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+				std::unique_ptr<connection_t> conn(new connection_t(fd, _nextId++));
+				char addr[INET_ADDRSTRLEN];
+				if (inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr)) != nullptr)
+					conn->_remoteAddr = addr;
+				_idle.push_front(conn.get());
+				conn->_idlePos = _idle.begin();
+				connection_t* raw = conn.get();
+				_connections[fd] = std::move(conn);
+				updateEvents(raw, EPOLLIN);
+			}
+		}
+
+		// 修改连接在 epoll 中注册的事件
+		void updateEvents(connection_t* conn, std::uint32_t events) {
+			if (conn->_events == events)
+				return;
+			struct epoll_event event;
+			std::memset(&event, 0, sizeof(event));
+			event.events = events;
+			event.data.fd = conn->_fd;
+			int op = conn->_events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+			if (epoll_ctl(_epollFd, op, conn->_fd, &event) < 0)
+				LOG(WARNING, "epoll_ctl error: %s", strerror(errno));
+			conn->_events = events;
+		}
+
+		// 请求处理中 不读取后续数据, 有待发送的数据时 等待可写
+		void refreshEvents(connection_t* conn) {
+			if (conn->hasOutput())
+				updateEvents(conn, EPOLLOUT);
+			else if (conn->_busy)
+				updateEvents(conn, 0);
+			else
+				updateEvents(conn, conn->_peerClosed ? 0u : (std::uint32_t)EPOLLIN);
+		}
+
+		void touch(connection_t* conn) {
+			conn->_active = clock::now();
+			_idle.splice(_idle.begin(), _idle, conn->_idlePos);
+		}
+
+		void closeConnection(connection_t* conn) {
+			int fd = conn->_fd;
+			if (conn->_events != 0)
+				epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+			_idle.erase(conn->_idlePos);
+			_connections.erase(fd);
+			::close(fd);
+		}
+
+		// 链表尾部是最久没有活动的连接, 从尾部开始关闭超时的连接
+		// 正在处理请求的连接 不会因为超时被关闭
+		void closeIdleConnections() {
+			clock::time_point now = clock::now();
+			auto it = _idle.end();
+			while (it != _idle.begin()) {
+				connection_t* conn = *--it;
+				if (now - conn->_active <= _idleTimeout)
+					break;
+				if (conn->_busy)
+					continue;
+				it = std::next(it);
+				closeConnection(conn);
+			}
+		}
+
+		void handleEvent(int fd, std::uint32_t events) {
+			auto it = _connections.find(fd);
+			if (it == _connections.end())
+				return;
+			connection_t* conn = it->second.get();
+
+			if (events & (EPOLLERR | EPOLLHUP)) {
+				closeConnection(conn);
+				return;
+			}
+			if (events & EPOLLOUT) {
+				writeOutput(conn);
+				return;
+			}
+			if (events & EPOLLIN)
+				readInput(conn);
+		}
+
+		void readInput(connection_t* conn) {
+			char buffer[READ_CHUNK];
+			for (;;) {
+				ssize_t n = read(conn->_fd, buffer, sizeof(buffer));
+				if (n > 0) {
+					conn->_in.append(buffer, n);
+					if (conn->_in.size() > MAX_HEADER_BYTES + MAX_BODY_BYTES)
+						break;
+					continue;
+				}
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					break;
+				if (n < 0) {
+					closeConnection(conn);
+					return;
+				}
+				// 对端关闭写入, 已经读取的请求 仍然需要应答
+				conn->_peerClosed = true;
+				break;
+			}
+			touch(conn);
+			processInput(conn);
+		}
+
+		// 从已读取的数据中 解析一个完整的请求, 交给计算线程处理
+		void processInput(connection_t* conn) {
+			if (conn->_busy || conn->hasOutput()) {
+				refreshEvents(conn);
+				return;
+			}
+
+			std::unique_ptr<httpRequest_t> request(new httpRequest_t);
+			std::size_t consumed = 0;
+			bool keepAlive = true;
+			int status = conn->_in.empty() ? 0 : parseRequest(conn->_in, request.get(), &consumed, &keepAlive);
+			if (status == 0) {
+				// 请求还不完整, 继续读取. 对端已经关闭时 不会再有数据
+				if (conn->_peerClosed)
+					closeConnection(conn);
+				else
+					refreshEvents(conn);
+				return;
+			}
+			if (status != 200) {
+				sendError(conn, status);
+				return;
+			}
+			conn->_in.erase(0, consumed);
+			request->_remoteAddr = conn->_remoteAddr;
+			conn->_busy = true;
+			refreshEvents(conn);
+
+			int fd = conn->_fd;
+			std::uint64_t id = conn->_id;
+			std::shared_ptr<httpRequest_t> shared(request.release());
+			_pool.enqueue([this, fd, id, shared, keepAlive]() {
+				httpResponse_t response;
+				dispatch(*shared, response);
+
+				completion_t done;
+				done._fd = fd;
+				done._id = id;
+				done._head = serializeHead(response, keepAlive);
+				done._body = response._body;
+				done._keepAlive = keepAlive;
+				{
+					std::lock_guard<std::mutex> lock(_completionMtx);
+					_completions.push_back(std::move(done));
+				}
+				wakeUp();
+			});
+		}
+
+		// 解析请求, 返回 0 表示数据还不完整, 200 表示解析成功, 其他值为 应该返回的错误状态码
+		static int parseRequest(const std::string& in, httpRequest_t* request, std::size_t* consumed,
+								bool* keepAlive) {
+			std::size_t headerEnd = in.find("\r\n\r\n");
+			if (headerEnd == std::string::npos)
+				return in.size() > MAX_HEADER_BYTES ? 431 : 0;
+			if (headerEnd > MAX_HEADER_BYTES)
+				return 431;
+
+			// 请求行: 方法 url 版本
+			std::size_t lineEnd = in.find("\r\n");
+			std::size_t sp1 = in.find(' ');
+			std::size_t sp2 = sp1 == std::string::npos ? sp1 : in.find(' ', sp1 + 1);
+			if (sp2 == std::string::npos || sp2 > lineEnd)
+				return 400;
+			request->_method = in.substr(0, sp1);
+			std::string target = in.substr(sp1 + 1, sp2 - sp1 - 1);
+			request->_version = in.substr(sp2 + 1, lineEnd - sp2 - 1);
+			if (request->_version != "HTTP/1.1" && request->_version != "HTTP/1.0")
+				return 400;
+
+			std::size_t question = target.find('?');
+			request->_path = decodeUrl(target.substr(0, question), false);
+			if (question != std::string::npos)
+				parseQuery(target.substr(question + 1), &request->_params);
+
+			// 请求头
+			std::size_t contentLength = 0;
+			std::size_t pos = lineEnd + 2;
+			while (pos < headerEnd) {
+				std::size_t end = in.find("\r\n", pos);
+				std::size_t colon = in.find(':', pos);
+				if (colon == std::string::npos || colon > end)
+					return 400;
+				std::size_t valueBegin = in.find_first_not_of(" \t", colon + 1);
+				std::size_t valueEnd = in.find_last_not_of(" \t", end - 1);
+				std::string value;
+				if (valueBegin < end && valueEnd != std::string::npos && valueEnd >= valueBegin)
+					value = in.substr(valueBegin, valueEnd - valueBegin + 1);
+				request->_headers.emplace_back(in.substr(pos, colon - pos), std::move(value));
+				pos = end + 2;
+			}
+
+			std::string length = request->getHeader("Content-Length");
+			if (!length.empty()) {
+				if (length.size() > 9 || length.find_first_not_of("0123456789") != std::string::npos)
+					return 400;
+				contentLength = std::stoul(length);
+				if (contentLength > MAX_BODY_BYTES)
+					return 413;
+			}
+			if (!request->getHeader("Transfer-Encoding").empty())
+				return 501;
+			if (in.size() < headerEnd + 4 + contentLength)
+				return 0;
+			*consumed = headerEnd + 4 + contentLength;
+
+			// HTTP/1.1 默认保持连接, HTTP/1.0 需要明确要求
+			std::string connection = request->getHeader("Connection");
+			if (request->_version == "HTTP/1.1")
+				*keepAlive = strcasecmp(connection.c_str(), "close") != 0;
+			else
+				*keepAlive = strcasecmp(connection.c_str(), "keep-alive") == 0;
+
+			return 200;
+		}
+
+		// 在计算线程中执行: 按方法查找处理函数, GET 请求没有处理函数时 查找静态文件
+		// 路径只注册了另一种方法时 返回 405
+		void dispatch(const httpRequest_t& request, httpResponse_t& response) {
+			const bool isGet = request._method == "GET";
+			if (!isGet && request._method != "POST") {
+				response._status = 405;
+				return;
+			}
+			const std::unordered_map<std::string, handler_t>& handlers = isGet ? _handlers : _postHandlers;
+			const std::unordered_map<std::string, handler_t>& others = isGet ? _postHandlers : _handlers;
+			auto it = handlers.find(request._path);
+			if (it == handlers.end() && others.count(request._path)) {
+				response._status = 405;
+				return;
+			}
+			if (it != handlers.end()) {
+				try {
+					it->second(request, response);
+				}
+				catch (const std::exception& e) {
+					LOG(WARNING, "handler %s error: %s", request._path.c_str(), e.what());
+					response = httpResponse_t();
+					response._status = 500;
+				}
+				return;
+			}
+			if (!isGet || !serveFile(request._path, response))
+				response._status = 404;
+		}
+
+		bool serveFile(const std::string& path, httpResponse_t& response) {
+			if (_baseDir.empty() || path.empty() || path[0] != '/' || path.find("..") != std::string::npos)
+				return false;
+			std::string file = _baseDir + path;
+			struct stat st;
+			if (stat(file.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+				if (file.back() != '/')
+					file += '/';
+				file += "index.html";
+			}
+			std::ifstream in(file, std::ios::in | std::ios::binary);
+			if (!in.is_open())
+				return false;
+			std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			response.setContent(std::move(content), contentTypeOf(file));
+			return true;
+		}
+
+		static std::string serializeHead(const httpResponse_t& response, bool keepAlive) {
+			std::string head;
+			head.reserve(256);
+			head += "HTTP/1.1 ";
+			head += std::to_string(response._status);
+			head += ' ';
+			head += statusMessage(response._status);
+			head += "\r\nContent-Length: ";
+			head += std::to_string(response._body ? response._body->size() : 0);
+			if (!response._contentType.empty()) {
+				head += "\r\nContent-Type: ";
+				head += response._contentType;
+			}
+			head += keepAlive ? "\r\nConnection: keep-alive" : "\r\nConnection: close";
+			for (const auto& header : response._headers) {
+				head += "\r\n";
+				head += header.first;
+				head += ": ";
+				head += header.second;
+			}
+			head += "\r\n\r\n";
+			return head;
+		}
+
+		// 在 I/O 线程中直接生成错误响应, 发送之后关闭连接
+		void sendError(connection_t* conn, int status) {
+			httpResponse_t response;
+			response._status = status;
+			conn->_in.clear();
+			conn->_outHead = serializeHead(response, false);
+			conn->_outBody.reset();
+			conn->_outOffset = 0;
+			conn->_closeAfterWrite = true;
+			writeOutput(conn);
+		}
+
+		// 将完成队列中的响应 交给对应的连接发送
+		void handleCompletions() {
+			std::uint64_t count;
+			while (read(_wakeFd, &count, sizeof(count)) > 0) {}
+
+			std::vector<completion_t> completions;
+			{
+				std::lock_guard<std::mutex> lock(_completionMtx);
+				completions.swap(_completions);
+			}
+			for (completion_t& done : completions) {
+				auto it = _connections.find(done._fd);
+				// 连接在处理期间 已经关闭
+				if (it == _connections.end() || it->second->_id != done._id)
+					continue;
+				connection_t* conn = it->second.get();
+				conn->_busy = false;
+				conn->_outHead = std::move(done._head);
+				conn->_outBody = std::move(done._body);
+				conn->_outOffset = 0;
+				conn->_closeAfterWrite = !done._keepAlive;
+				touch(conn);
+				writeOutput(conn);
+			}
+		}
+
+		// 尽可能多地发送待发送的数据, 发送完成后 继续处理流水线中的下一个请求
+		void writeOutput(connection_t* conn) {
+			while (conn->hasOutput()) {
+				std::size_t headSize = conn->_outHead.size();
+				std::size_t bodySize = conn->_outBody ? conn->_outBody->size() : 0;
+				struct iovec iov[2];
+				int iovcnt = 0;
+				if (conn->_outOffset < headSize) {
+					iov[iovcnt].iov_base = &conn->_outHead[conn->_outOffset];
+					iov[iovcnt].iov_len = headSize - conn->_outOffset;
+					iovcnt++;
+				}
+				std::size_t bodyOffset = conn->_outOffset > headSize ? conn->_outOffset - headSize : 0;
+				if (bodyOffset < bodySize) {
+					iov[iovcnt].iov_base = (void*)(conn->_outBody->data() + bodyOffset);
+					iov[iovcnt].iov_len = bodySize - bodyOffset;
+					iovcnt++;
+				}
+				if (iovcnt == 0) {
+					conn->_outHead.clear();
+					conn->_outBody.reset();
+					conn->_outOffset = 0;
+					break;
+				}
+
+				// 对端已经关闭时 不产生 SIGPIPE
+				struct msghdr msg;
+				std::memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = iovcnt;
+				ssize_t n = sendmsg(conn->_fd, &msg, MSG_NOSIGNAL);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						refreshEvents(conn);
+						return;
+					}
+					closeConnection(conn);
+					return;
+				}
+				conn->_outOffset += n;
+			}
+
+			if (conn->_closeAfterWrite) {
+				closeConnection(conn);
+				return;
+			}
+			touch(conn);
+			processInput(conn);
+		}
+
+		std::unordered_map<std::string, handler_t> _handlers;	  // GET 请求的处理函数
+		std::unordered_map<std::string, handler_t> _postHandlers; // POST 请求的处理函数
+		std::string _baseDir;
+		std::size_t _maxConnections;
+		clock::duration _idleTimeout;
+
+		int _listenFd;
+		int _epollFd;
+		int _wakeFd; // 计算线程 通过它唤醒 I/O 线程
+		int _spareFd;
+		std::uint64_t _nextId;
+		bool _reusePort;
+		std::atomic<bool> _running;
+
+		// 以下成员只在 I/O 线程中访问
+		std::unordered_map<int, std::unique_ptr<connection_t>> _connections;
+		std::list<connection_t*> _idle; // 头部是最近活动的连接
+
+		std::mutex _completionMtx; // 保护 _completions
+		std::vector<completion_t> _completions;
+
+		// 最后构造: 计算线程启动时 其他成员都已经初始化
+		computePool _pool;
+	};
+} // namespace ns_server
@@ -1,28 +1,302 @@
 #include <iostream>
+#include <memory>
+#include <thread>
 #include <pthread.h>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <new>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <json/json.h>
 #include "util.hpp"
 #include "daemonize.hpp"
 #include "searcher.hpp"
 #include "logMessage.hpp"
+#include "lruCache.hpp"
+#include "singleFlight.hpp"
+#include "epollServer.hpp"
 #include "httplib.h"
 
 const std::string& input = "./data/output/raw";
+const std::string& snapshot = "./data/output/index.snap";
 const std::string& rootPath = "./wwwRoot";
 
-int main() {
-	// 守护进程设置
-	daemonize();
-	// 日志系统
-	class log logSvr;
-	logSvr.enable();
+// 响应正文缓存: 分片数, 总字节数, 条目的有效时间(秒)
+const std::size_t RESPONSE_CACHE_SHARDS = 16;
+const std::size_t RESPONSE_CACHE_BYTES = 64 << 20;
+const std::uint32_t RESPONSE_CACHE_TTL = 600;
+// 短于 GZIP_MIN_BYTES 的正文 压缩节省的传输很少, 不压缩
+const std::size_t GZIP_MIN_BYTES = 1024;
+
+// epoll 模式: 最大连接数, 连接的空闲超时时间(秒)
+const std::size_t EPOLL_MAX_CONNECTIONS = 50000;
+const std::uint32_t EPOLL_IDLE_TIMEOUT = 60;
+
+// prefork 模式: 工作进程运行不到 WORKER_MIN_UPTIME 秒就退出时, 等待 WORKER_RESTART_DELAY 秒再重启
+// 防止 端口被占用等 每次启动都会失败的情况下 主进程不停地 fork
+const std::uint32_t WORKER_MIN_UPTIME = 5;
+const std::uint32_t WORKER_RESTART_DELAY = 1;
+
+// /admin/reload: 两次开始重新加载之间 至少间隔 ADMIN_RELOAD_INTERVAL 秒, 令牌通过 ADMIN_TOKEN_HEADER 请求头传递
+const std::uint32_t ADMIN_RELOAD_INTERVAL = 10;
+const char* const ADMIN_TOKEN_HEADER = "X-Admin-Token";
+
+// 将 data 压缩为 gzip 格式
+bool gzipCompress(const std::string& data, std::string* out) {
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	// windowBits 加 16 表示输出 gzip 格式, 而不是 zlib 格式
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out->resize(deflateBound(&stream, data.size()));
+	stream.next_in = (Bytef*)data.data();
+	stream.avail_in = data.size();
+	stream.next_out = (Bytef*)&(*out)[0];
+	stream.avail_out = out->size();
+	int ret = deflate(&stream, Z_FINISH);
+	out->resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return ret == Z_STREAM_END;
+}
+
+// 一次搜索请求的响应正文, 以及 gzip 压缩后的版本, 客户端支持 gzip 时 直接发送压缩好的正文
+// 压缩在第一个支持 gzip 的请求 取正文时才进行, 之后的请求共享压缩结果. 只被不支持 gzip 的客户端请求的正文 不会被压缩
+typedef struct responseBody {
+	std::string _json;
+
+	// 压缩后的正文, 正文太短 或压缩失败时 为空
+	const std::string& gzip() const {
+		std::call_once(_gzipOnce, [this]() {
+			if (_json.size() < GZIP_MIN_BYTES || !gzipCompress(_json, &_gzip))
+				_gzip.clear();
+		});
+		return _gzip;
+	}
+
+private:
+	mutable std::once_flag _gzipOnce;
+	mutable std::string _gzip;
+} responseBody_t;
+
+typedef std::shared_ptr<const responseBody_t> responsePtr;
+typedef std::shared_ptr<const std::string> contentPtr;
+
+// 缓存的统计信息, jsoncpp 0.10.5.2 不支持 long long, 转换成 double
+Json::Value cacheStatsJson(const ns_cache::cacheStats_t& stats) {
+	Json::Value value;
+	value["hits"] = (double)stats._hits;
+	value["misses"] = (double)stats._misses;
+	value["evictions"] = (double)stats._evictions;
+	value["expirations"] = (double)stats._expirations;
+	value["entries"] = (double)stats._entries;
+	value["bytes"] = (double)stats._bytes;
+	return value;
+}
+
+// 将url参数 解析为非负整数, 为空或不合法时 返回defaultValue
+std::size_t parseSizeParam(const std::string& value, std::size_t defaultValue) {
+	if (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789") != std::string::npos)
+		return defaultValue;
+
+	return std::stoul(value);
+}
+
+// 搜索服务: 搜索器 以及 响应正文的缓存, 与使用哪种 HTTP 服务器无关
+class searchService {
+public:
+	searchService()
+		: _responseCache(RESPONSE_CACHE_SHARDS, RESPONSE_CACHE_BYTES, RESPONSE_CACHE_TTL)
+		, _reloading(false)
+		, _sharedReloading(nullptr)
+		, _master(0) {}
+
+	~searchService() {
+		std::lock_guard<std::mutex> lock(_reloadMtx);
+		if (_reloader.joinable())
+			_reloader.join();
+	}
+
+	void init() { _searcher.initSearcher(input, snapshot); }
+
+	// 加载快照时 校验整个快照, 在 init() 之前调用
+	void setVerifySnapshot(bool verify) { _searcher.setVerifySnapshot(verify); }
 
-	ns_searcher::searcher searcher;
-	searcher.initSearcher(input);
+	// 重新加载索引, 在调用线程中执行, 加载期间 搜索继续使用旧索引. 加载失败时 保留旧索引 并返回 false
+	bool reload() {
+		if (!_searcher.reloadIndex(input, snapshot))
+			return false;
+		// 响应正文缓存的键中 带有索引编号, 清空只是为了尽早释放旧索引的响应
+		_responseCache.clear();
+		return true;
+	}
 
+	// 在后台线程中重新加载索引, 已经有加载在进行时 返回 false
+	// prefork 模式的工作进程中 转发给主进程, 由主进程加载后 重新 fork 工作进程. 主进程正在加载时 返回 false
+	bool requestReload() {
+		if (_master > 0)
+			return !_sharedReloading->load() && kill(_master, SIGHUP) == 0;
+
+		return reloadInBackground(nullptr);
+	}
+
+	// 在后台线程中重新加载索引, 加载结束后 在后台线程中调用 done(是否成功). 已经有加载在进行时 返回 false
+	bool reloadInBackground(std::function<void(bool)> done) {
+		std::lock_guard<std::mutex> lock(_reloadMtx);
+		if (_reloading)
+			return false;
+		if (_reloader.joinable())
+			_reloader.join();
+		_reloading = true;
+		_reloader = std::thread([this, done]() {
+			bool ok = reload();
+			_reloading = false;
+			if (done)
+				done(ok);
+		});
+		return true;
+	}
+
+	// 等待后台的加载线程退出
+	void joinReload() {
+		std::lock_guard<std::mutex> lock(_reloadMtx);
+		if (_reloader.joinable())
+			_reloader.join();
+	}
+
+	// prefork 模式: 在 fork 工作进程之前 由主进程调用
+	// 建立主进程与工作进程共享的内存页, 主进程在其中标记 是否正在重新加载, 工作进程据此拒绝 reload 请求
+	bool sharePreforkState() {
+		static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "std::atomic<bool> must be lock free to be shared between processes");
+		void* addr = mmap(nullptr, sizeof(std::atomic<bool>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			return false;
+		_sharedReloading = new (addr) std::atomic<bool>(false);
+		return true;
+	}
+	// 主进程 在开始重新加载之前置位, 新的工作进程 fork 完成之后清除
+	void setSharedReloading(bool reloading) { _sharedReloading->store(reloading); }
+
+	// 在 prefork 模式的工作进程中调用, 之后的 requestReload() 向 master 发送 SIGHUP
+	void forwardReloadTo(pid_t master) { _master = master; }
+
+	// 设置 /admin/reload 的令牌, 为空时 只接受来自本机的请求
+	void setAdminToken(const std::string& token) { _adminToken = token; }
+
+	// 处理 /admin/reload 请求: 只接受来自本机的请求, 或带有正确令牌的请求
+	// 距上一次开始重新加载 不到 ADMIN_RELOAD_INTERVAL 秒时 拒绝, 防止反复重建索引
+	// 返回 HTTP 状态码, 响应正文写入 body
+	int adminReload(const std::string& remoteAddr, const std::string& token, std::string* body) {
+		bool loopback = remoteAddr.compare(0, 4, "127.") == 0 || remoteAddr == "::1" ||
+						remoteAddr.compare(0, 11, "::ffff:127.") == 0;
+		if (!loopback && (_adminToken.empty() || !tokenEqual(token, _adminToken))) {
+			*body = "forbidden\n";
+			return 403;
+		}
+
+		std::lock_guard<std::mutex> lock(_adminMtx);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (_lastAdminReload != std::chrono::steady_clock::time_point() &&
+			now - _lastAdminReload < std::chrono::seconds(ADMIN_RELOAD_INTERVAL)) {
+			*body = "reload requested too recently\n";
+			return 429;
+		}
+		if (!requestReload()) {
+			*body = "reload already in progress\n";
+			return 503;
+		}
+		_lastAdminReload = now;
+		*body = "reload started\n";
+		return 200;
+	}
+
+	// 搜索 word, 返回第 page 页(从1开始) 每页 topK 个结果 的响应正文, 搜索失败时 返回空指针
+	// 参数不合法时使用默认值. acceptGzip 为 true 且正文可以压缩时 返回压缩的正文, 并将 gzip 设置为 true
+	contentPtr search(const std::string& word, std::size_t topK, std::size_t page, bool acceptGzip, bool* gzip) {
+		if (topK == 0 || topK > ns_searcher::MAX_TOPK)
+			topK = ns_searcher::DEFAULT_TOPK;
+		if (page == 0)
+			page = 1;
+
+		// 以 搜索内容和分页参数 为键, 缓存最终的响应正文, 命中时 不需要搜索, 也不需要序列化
+		// 搜索结果缓存(见 searcher.hpp) 与之配合: 关键词顺序或大小写不同的查询 这里不命中, 但仍然可以复用搜索结果
+		// 与搜索结果缓存一样, 键中带有索引编号, 更换索引之后 旧索引生成的响应不会被命中
+		std::string key = std::to_string(_searcher.indexId()) + "#" + std::to_string(page) + "," +
+						  std::to_string(topK) + " " + word;
+		responsePtr body;
+		if (!_responseCache.get(key, &body)) {
+			// 缓存未命中的 相同请求 同时到达时, 只由一个线程搜索, 其他线程等待 并共享它生成的响应正文
+			body = _searchFlight.run(key, [&]() {
+				std::shared_ptr<responseBody_t> fresh = std::make_shared<responseBody_t>();
+				_searcher.search(word, &fresh->_json, (page - 1) * topK, topK);
+				// 先写入缓存 再结束合并, 之后到达的请求 可以直接从缓存中获取
+				// 只按 JSON 正文计入缓存大小, 之后才生成的压缩正文 通常只有它的几分之一
+				_responseCache.put(key, fresh, fresh->_json.size());
+				return responsePtr(fresh);
+			});
+		}
+		if (!body)
+			return nullptr;
+
+		// 返回的指针 与 body 共享所有权, 发送期间 缓存条目被淘汰 也不影响正文
+		*gzip = acceptGzip && !body->gzip().empty();
+		return contentPtr(body, *gzip ? &body->gzip() : &body->_json);
+	}
+
+	// 结果缓存 和 响应正文缓存 的命中情况
+	std::string stats() {
+		Json::Value root;
+		root["resultCache"] = cacheStatsJson(_searcher.cacheStats());
+		root["responseCache"] = cacheStatsJson(_responseCache.stats());
+		root["index"]["documents"] = (double)_searcher.docCount();
+		root["index"]["generation"] = (double)_searcher.generation();
+		root["index"]["reloading"] = _sharedReloading ? _sharedReloading->load() : _reloading.load();
+		Json::StyledWriter writer;
+		return writer.write(root);
+	}
+
+private:
+	ns_searcher::searcher _searcher;
+	ns_cache::shardedLruCache<responsePtr> _responseCache;
+	ns_cache::singleFlight<responseBody_t> _searchFlight;
+
+	std::mutex _reloadMtx;
+	std::thread _reloader;
+	std::atomic<bool> _reloading;
+	std::atomic<bool>* _sharedReloading; // prefork 模式下 主进程与工作进程共享的加载标记, 见 sharePreforkState()
+	pid_t _master; // prefork 模式的工作进程中 为主进程的 pid, 否则为 0
+
+	std::string _adminToken;
+	std::mutex _adminMtx;
+	std::chrono::steady_clock::time_point _lastAdminReload; // 受 _adminMtx 保护
+
+	// 比较令牌, 耗时只与长度有关, 不会因为 前面的字节相同而变长
+	static bool tokenEqual(const std::string& a, const std::string& b) {
+		if (a.size() != b.size())
+			return false;
+		unsigned char diff = 0;
+		for (std::size_t i = 0; i < a.size(); i++)
+			diff |= a[i] ^ b[i];
+		return diff == 0;
+	}
+};
+
+// 使用 httplib::Server, 每个连接 占用线程池中的一个线程
+void runHttplibServer(searchService& service) {
 	httplib::Server svr;
 
 	svr.set_base_dir(rootPath.c_str());
-	svr.Get("/s", [&searcher](const httplib::Request& request, httplib::Response& response) {
+	svr.Get("/s", [&service](const httplib::Request& request, httplib::Response& response) {
 		// 首先, 网页发起请求 如果需要带参数, 则是需要以 key=value的格式在url中 或者 正文有效中传参的
 		// 就像我们使用一般搜索引擎搜索一样:
 		// 如果在 google搜索http, 那么 url就会变为 https://www.google.com/search?q=http&sxsrf=AB5stBgDxDV91zrABB
@@ -34,13 +308,33 @@ int main() {
 			response.set_content("请输入内容后搜索", "text/plain; charset=utf-8");
 		}
 		std::string searchContent = request.get_param_value("word");
-		LOG(NOTICE, "User search:: %s", searchContent.c_str());
-		// std::cout << "User search:: " << searchContent << std::endl;
 
-		std::string searchJsonResult;
-		searcher.search(searchContent, &searchJsonResult);
+		// 分页参数: k=每页结果数, page=页码(从1开始), 不合法时使用默认值
+		std::size_t topK = parseSizeParam(request.get_param_value("k"), ns_searcher::DEFAULT_TOPK);
+		std::size_t page = parseSizeParam(request.get_param_value("page"), 1);
+		bool acceptGzip = request.get_header_value("Accept-Encoding").find("gzip") != std::string::npos;
+		bool gzip = false;
+		contentPtr body = service.search(searchContent, topK, page, acceptGzip, &gzip);
+		if (!body) {
+			// 合并执行的领头请求 搜索失败
+			response.status = 500;
+			return;
+		}
+
 		// 搜获取到搜索结果之后 设置相应内容
-		response.set_content(searchJsonResult, "application/json");
+		response.set_header("Vary", "Accept-Encoding");
+		if (gzip)
+			response.set_header("Content-Encoding", "gzip");
+		response.set_content(*body, "application/json");
+	});
+	svr.Get("/stats", [&service](const httplib::Request&, httplib::Response& response) {
+		response.set_content(service.stats(), "application/json");
+	});
+	// 在后台重新加载索引, 与向进程发送 SIGHUP 相同. 会改变服务状态, 所以只接受 POST, 权限和频率限制 见 adminReload()
+	svr.Post("/admin/reload", [&service](const httplib::Request& request, httplib::Response& response) {
+		std::string body;
+		response.status = service.adminReload(request.remote_addr, request.get_header_value(ADMIN_TOKEN_HEADER), &body);
+		response.set_content(body, "text/plain");
 	});
 	// svr.Get("/hi", [](const httplib::Request&, httplib::Response& res) {
 	// 	res.set_content("Hello World!", "text/plain");
@@ -49,6 +343,330 @@ int main() {
 	LOG(NOTICE, "服务器启动成功...");
 	// std::cout << "服务器启动成功..." << std::endl;
 	svr.listen("0.0.0.0", 8080);
+}
+
+// 使用 epoll 事件驱动的服务器, I/O 线程管理所有连接, 搜索在 computeThreads 个计算线程中执行
+// 连接数 不再受线程数限制, 同时搜索的数量 等于计算线程数
+// reusePort 为 true 时 以 SO_REUSEPORT 监听, 供 prefork 模式的多个工作进程 绑定同一个端口
+void runEpollServer(searchService& service, std::size_t computeThreads, bool reusePort) {
+	// 每个连接占用一个文件描述符, 将文件描述符的软限制 提高到硬限制
+	// 最大连接数 不超过这个限制, 并为日志 索引文件等 留出一些文件描述符
+	std::size_t maxConnections = EPOLL_MAX_CONNECTIONS;
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		if (limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+				getrlimit(RLIMIT_NOFILE, &limit);
+		}
+		if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < maxConnections + 64)
+			maxConnections = limit.rlim_cur > 128 ? limit.rlim_cur - 64 : 64;
+	}
+
+	ns_server::epollServer svr(computeThreads, maxConnections, EPOLL_IDLE_TIMEOUT);
+
+	svr.setBaseDir(rootPath);
+	svr.setReusePort(reusePort);
+	svr.Get("/s", [&service](const ns_server::httpRequest_t& request, ns_server::httpResponse_t& response) {
+		std::string searchContent = request.getParam("word");
+
+		std::size_t topK = parseSizeParam(request.getParam("k"), ns_searcher::DEFAULT_TOPK);
+		std::size_t page = parseSizeParam(request.getParam("page"), 1);
+		bool acceptGzip = request.getHeader("Accept-Encoding").find("gzip") != std::string::npos;
+		bool gzip = false;
+		contentPtr body = service.search(searchContent, topK, page, acceptGzip, &gzip);
+		if (!body) {
+			response._status = 500;
+			return;
+		}
+
+		response.setHeader("Vary", "Accept-Encoding");
+		if (gzip)
+			response.setHeader("Content-Encoding", "gzip");
+		// 直接发送缓存中的正文, 不复制
+		response.setContent(body, "application/json");
+	});
+	svr.Get("/stats", [&service](const ns_server::httpRequest_t&, ns_server::httpResponse_t& response) {
+		response.setContent(service.stats(), "application/json");
+	});
+	svr.Post("/admin/reload", [&service](const ns_server::httpRequest_t& request, ns_server::httpResponse_t& response) {
+		std::string body;
+		response._status = service.adminReload(request._remoteAddr, request.getHeader(ADMIN_TOKEN_HEADER), &body);
+		response.setContent(std::move(body), "text/plain");
+	});
+
+	LOG(NOTICE, "服务器启动成功(epoll), 计算线程数: %u, 最大连接数: %u", (unsigned)computeThreads,
+		(unsigned)maxConnections);
+	if (!svr.listen("0.0.0.0", 8080))
+		LOG(FATAL, "服务器启动失败");
+}
+
+// 由 sigwait 处理的信号: SIGHUP 重新加载索引, prefork 模式的主进程 还要处理 SIGTERM SIGINT SIGCHLD
+// 以及 后台加载线程 加载结束时 通过 sigqueue 发给主进程的 SIGUSR1
+// 必须在创建任何线程之前屏蔽, 之后创建的线程 继承屏蔽字, 信号只会被 sigwait 取走
+// 否则信号可能被投递给 日志线程等 没有屏蔽它的线程, 执行默认动作 终止整个进程
+sigset_t controlSignals(bool prefork) {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	if (prefork) {
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGCHLD);
+		sigaddset(&signals, SIGUSR1);
+	}
+	return signals;
+}
+
+// 单进程模式: 后台线程等待 SIGHUP, 收到时 在后台重新加载索引
+void watchReloadSignal(searchService& service) {
+	std::thread([&service]() {
+		sigset_t signals = controlSignals(false);
+		int sig = 0;
+		while (sigwait(&signals, &sig) == 0) {
+			LOG(NOTICE, "收到 SIGHUP, 重新加载索引");
+			if (!service.requestReload())
+				LOG(WARNING, "索引正在加载, 忽略 SIGHUP");
+		}
+	}).detach();
+}
+
+// fork 一个工作进程, 工作进程运行 epoll 服务器, 直到被终止
+pid_t startWorker(searchService& service, std::size_t computeThreads) {
+	pid_t master = getpid();
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	// 主进程退出(包括被 SIGKILL)时, 工作进程也随之退出
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != master)
+		_exit(0);
+	// 工作进程忽略 SIGHUP, 发给整个进程组的 SIGHUP 只由主进程处理
+	// 工作进程收到的 /admin/reload 请求 转发给主进程
+	signal(SIGHUP, SIG_IGN);
+	service.forwardReloadTo(master);
+	sigset_t signals;
+	sigemptyset(&signals);
+	pthread_sigmask(SIG_SETMASK, &signals, nullptr);
+
+	runEpollServer(service, computeThreads, true);
+	// 服务器只会因为启动失败返回, 不执行主进程注册的 atexit 和 全局对象的析构
+	_exit(1);
+}
+
+// prefork 模式: 主进程加载一次索引, 然后 fork workerNum 个工作进程
+// 工作进程各自以 SO_REUSEPORT 绑定同一个端口, 由内核将新连接 分配给各个工作进程
+// 索引在 fork 之前就已经建立, 工作进程只读取索引, 所以索引所在的内存页 由所有进程写时复制共享, 不会被复制
+// 每个工作进程有自己的 结果缓存 和 响应正文缓存
+// 主进程不处理请求, 只负责监控: 工作进程崩溃时 记录原因 并重新 fork, 一个请求导致的崩溃 不会使整个服务不可用
+// 收到 SIGHUP 时 主进程在后台线程中重新加载索引, 期间继续处理 SIGCHLD SIGTERM SIGINT
+// 加载期间 再收到的 SIGHUP 被忽略, 工作进程通过共享的加载标记 直接拒绝 reload 请求
+// 加载线程结束时 通过 SIGUSR1 通知主进程, 成功时 先 fork 一组新的工作进程, 再终止旧的工作进程
+// 新旧工作进程 短时间内同时监听端口, 旧工作进程退出后 旧索引的内存页 随之释放
+// 加载线程可能持有锁, 所以加载期间不 fork: 退出的工作进程 在加载结束后 才补齐
+void runPreforkServer(searchService& service, std::size_t workerNum) {
+	std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+	std::size_t computeThreads = std::max<std::size_t>(1, cores / workerNum);
+	if (!service.sharePreforkState()) {
+		LOG(FATAL, "mmap error: %s", strerror(errno));
+		return;
+	}
+
+	typedef std::chrono::steady_clock clock;
+	std::unordered_map<pid_t, clock::time_point> workers;
+	std::unordered_set<pid_t> retiring; // 已经被替换 正在退出的工作进程, 退出后不重启
+	auto spawn = [&]() {
+		pid_t pid = startWorker(service, computeThreads);
+		if (pid < 0)
+			LOG(WARNING, "fork error: %s", strerror(errno));
+		else
+			workers[pid] = clock::now();
+		return pid;
+	};
+	for (std::size_t i = 0; i < workerNum; i++) {
+		spawn();
+	}
+	LOG(NOTICE, "主进程启动成功(prefork), 工作进程数: %u, 每个工作进程的计算线程数: %u", (unsigned)workerNum,
+		(unsigned)computeThreads);
+
+	// 信号已经在 main 中屏蔽, 这里逐个取出处理, 不需要信号处理函数
+	const pid_t master = getpid();
+	sigset_t signals = controlSignals(true);
+	bool reloading = false;
+	bool stop = false;
+	while (!stop) {
+		siginfo_t info;
+		int sig = sigwaitinfo(&signals, &info);
+		if (sig < 0) {
+			if (errno != EINTR)
+				LOG(FATAL, "sigwaitinfo error: %s", strerror(errno));
+			continue;
+		}
+
+		switch (sig) {
+		case SIGHUP: {
+			if (reloading) {
+				LOG(NOTICE, "索引正在重新加载, 忽略 SIGHUP");
+				break;
+			}
+			LOG(NOTICE, "收到 SIGHUP, 重新加载索引");
+			service.setSharedReloading(true);
+			reloading = service.reloadInBackground([master](bool ok) {
+				union sigval value;
+				value.sival_int = ok;
+				sigqueue(master, SIGUSR1, value);
+			});
+			if (!reloading)
+				service.setSharedReloading(false);
+			break;
+		}
+		case SIGUSR1: {
+			// 只接受加载线程发出的通知
+			if (!reloading || info.si_code != SI_QUEUE || info.si_pid != master)
+				break;
+			service.joinReload();
+			if (info.si_value.sival_int) {
+				std::vector<pid_t> old;
+				for (auto& worker : workers) {
+					old.push_back(worker.first);
+				}
+				for (std::size_t i = 0; i < workerNum; i++) {
+					spawn();
+				}
+				for (pid_t pid : old) {
+					workers.erase(pid);
+					retiring.insert(pid);
+					kill(pid, SIGTERM);
+				}
+				LOG(NOTICE, "已使用新索引 重新启动全部工作进程");
+			}
+			else {
+				// 加载失败, 继续使用旧索引, 补齐加载期间退出的工作进程
+				for (std::size_t i = workers.size(); i < workerNum; i++) {
+					spawn();
+				}
+			}
+			service.setSharedReloading(false);
+			reloading = false;
+			break;
+		}
+		case SIGCHLD: {
+			// 多个 SIGCHLD 可能合并为一个, 回收所有已经退出的子进程
+			int status = 0;
+			pid_t pid;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				if (retiring.erase(pid))
+					continue;
+				auto it = workers.find(pid);
+				if (it == workers.end())
+					continue;
+				clock::duration uptime = clock::now() - it->second;
+				workers.erase(it);
+				if (WIFSIGNALED(status))
+					LOG(WARNING, "工作进程 %d 被信号 %d 终止", (int)pid, WTERMSIG(status));
+				else
+					LOG(WARNING, "工作进程 %d 退出, 退出码: %d", (int)pid, WEXITSTATUS(status));
+
+				if (reloading) {
+					LOG(NOTICE, "索引正在重新加载, 加载结束后 再重新启动工作进程");
+					continue;
+				}
+				if (uptime < std::chrono::seconds(WORKER_MIN_UPTIME))
+					sleep(WORKER_RESTART_DELAY);
+				pid = spawn();
+				if (pid > 0)
+					LOG(NOTICE, "重新启动工作进程 %d", (int)pid);
+			}
+			break;
+		}
+		default: // SIGTERM SIGINT
+			stop = true;
+			break;
+		}
+	}
+
+	// 终止所有工作进程 并等待它们退出
+	for (auto& worker : workers)
+		kill(worker.first, SIGTERM);
+	for (pid_t pid : retiring)
+		kill(pid, SIGTERM);
+	for (auto& worker : workers)
+		waitpid(worker.first, nullptr, 0);
+	for (pid_t pid : retiring)
+		waitpid(pid, nullptr, 0);
+	if (reloading) {
+		// 不等待加载线程, 快照先写入临时文件 再 rename, 中途退出不会损坏已有的快照
+		LOG(NOTICE, "主进程退出, 放弃正在进行的索引加载");
+		asyncLogger::getInstance().flush();
+		_exit(0);
+	}
+	LOG(NOTICE, "主进程退出");
+}
+
+// ./searcherServerd              使用 httplib::Server
+// ./searcherServerd --epoll      使用 epoll 事件驱动的服务器
+// ./searcherServerd --prefork N  主进程加载索引后 fork N 个 epoll 工作进程(默认为CPU核数), 共同监听同一个端口
+// 三种模式下 向(主)进程发送 SIGHUP 或 POST /admin/reload, 都会重新加载 ./data/output/raw 并更换索引, 不需要重启
+int main(int argc, char* argv[]) {
+	bool useEpoll = false;
+	bool usePrefork = false;
+	bool verifySnapshot = false;
+	std::string adminToken;
+	std::size_t workerNum = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--epoll") == 0 || strcmp(argv[i], "-e") == 0) {
+			useEpoll = true;
+		}
+		else if (strcmp(argv[i], "--prefork") == 0) {
+			usePrefork = true;
+			// 之后紧跟的数字 是工作进程数
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				workerNum = std::max<std::size_t>(1, parseSizeParam(argv[++i], workerNum));
+		}
+		else if (strcmp(argv[i], "--verify-snapshot") == 0) {
+			// 加载快照时 读取整个文件 检查校验和, 默认只校验目录
+			verifySnapshot = true;
+		}
+		else if (strcmp(argv[i], "--admin-token") == 0 && i + 1 < argc) {
+			// 其他机器 通过 /admin/reload 重新加载索引时 需要提供的令牌
+			adminToken = argv[++i];
+		}
+		else if (strcmp(argv[i], "--log-fsync-ms") == 0 && i + 1 < argc) {
+			// 日志 fsync 的时间间隔, 默认 1000 毫秒
+			asyncLogger::getInstance().setFsyncInterval(parseSizeParam(argv[++i], 1000));
+		}
+		else if (strcmp(argv[i], "--log-full") == 0 && i + 1 < argc) {
+			// 日志缓冲区满时 NOTICE 及以下等级的日志: drop 丢弃(默认), block 等待
+			asyncLogger::getInstance().setFullPolicy(strcmp(argv[++i], "block") == 0 ? asyncLogger::BLOCK
+																					 : asyncLogger::DROP);
+		}
+	}
+
+	// 守护进程设置
+	daemonize();
+	// 在日志线程 建立索引的线程 创建之前 屏蔽控制信号
+	sigset_t signals = controlSignals(usePrefork);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	// 日志系统
+	class log logSvr;
+	logSvr.enable();
+
+	searchService service;
+	service.setVerifySnapshot(verifySnapshot);
+	service.setAdminToken(adminToken);
+	service.init();
+
+	if (usePrefork) {
+		runPreforkServer(service, workerNum);
+	}
+	else {
+		watchReloadSignal(service);
+		if (useEpoll)
+			runEpollServer(service, std::thread::hardware_concurrency(), false);
+		else
+			runHttplibServer(service);
+	}
 
 	return 0;
 }
@@ -26,91 +26,364 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <memory>
 #include <utility>
 #include <vector>
 #include <string>
 #include <unordered_map>
-#include <mutex>
+#include <unordered_set>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arrayRef.hpp"
 #include "logMessage.hpp"
+#include "manifest.hpp"
+#include "postingList.hpp"
+#include "termDict.hpp"
 #include "util.hpp"
 
 namespace ns_index {
 
+	// 建立索引时 文档的 title content url 以及内容的字节偏移采样 由索引自己保存在这里
+	// 从快照加载的文档 这些数据都在快照的映射中, 没有 docText_t
+	typedef struct docText {
+		std::string _title;
+		std::string _content;
+		std::string _url;
+		std::vector<std::uint32_t> _contentOffsets;
+	} docText_t;
+
 	// 用于正排索引中 存储文档内容
+	// 文档的文本 指向 docText_t 或快照的映射, 正排索引中只记录位置
 	typedef struct docInfo {
-		std::string _title;	  // 文档标题
-		std::string _content; // 文档去标签之后的内容
-		std::string _url;	  // 文档对应官网url
+		textRef _title;	  // 文档标题
+		textRef _content; // 文档去标签之后的内容
+		textRef _url;	  // 文档对应官网url
 		std::size_t _docId;	  // 文档id
+		std::uint32_t _titleLength;	  // 标题分词得到的位置数, 即标题的长度, 用于 BM25F 的长度归一化
+		std::uint32_t _contentLength; // 内容的长度
+		arrayRef<std::uint32_t> _contentOffsets; // 内容中 每 OFFSET_SAMPLE_INTERVAL 个位置 采样一次的字节偏移, 用于定位摘要
+		docText_t* _text; // 建立索引时 文档数据的保存位置, 从快照加载的文档为 nullptr
+
+		docInfo()
+			: _docId(0)
+			, _titleLength(0)
+			, _contentLength(0)
+			, _text(nullptr) {}
 	} docInfo_t;
 
-	// 用于倒排索引中 记录关键字对应的文档id和权重
-	typedef struct invertedElem {
-		std::size_t _docId;	   // 文档id
-		std::string _keyword;  // 关键字
-		std::uint64_t _weight; // 搜索此关键字, 此文档id 所占权重
-
-		invertedElem() // 权重初始化为0
-			: _weight(0) {}
-	} invertedElem_t;
-
 	// 关键字的词频
 	typedef struct keywordCnt {
-		std::size_t _titleCnt;	 // 关键字在标题中出现的次数
-		std::size_t _contentCnt; // 关键字在内容中出现的次数
+		std::size_t _titleCnt;	 // 关键字在标题中出现的次数, 按词的种类加权(见 ns_util::WORD_WEIGHT 等)
+		std::size_t _contentCnt; // 关键字在内容中出现的次数, 按词的种类加权
+		std::vector<std::uint32_t> _positions; // 关键字在文档中出现的位置, 内容中的位置 排在标题之后
 
 		keywordCnt()
 			: _titleCnt(0)
 			, _contentCnt(0) {}
 	} keywordCnt_t;
 
-	// 倒排拉链
-	typedef std::vector<invertedElem_t> invertedList_t;
+	// BM25F 打分
+	// 关键字在文档中的权重 由标题和内容两个字段的词频合成:
+	//  tf = TITLE_WEIGHT * 标题词频 / B_title + 内容词频 / B_content, 其中 B = 1 - b + b * 字段长度 / 字段平均长度
+	//  文档权重 = idf * tf / (k1 + tf)
+	// 词频按词的种类加权(见 ns_util::WORD_WEIGHT 等), 并以普通的词为1
+	// tf / (k1 + tf) 只与文档和关键字有关, 在建立索引时计算, 量化为 [1, BM25_QUANT_MAX] 的整数 存储在倒排拉链中
+	// idf 只与关键字有关, 搜索时由 文档总数 和 倒排拉链长度(即包含关键字的文档数) 计算, 每个倒排元素只需要一次乘法
+	const double BM25_K1 = 1.2;
+	const double BM25_TITLE_WEIGHT = 5.0;
+	const double BM25_TITLE_B = 0.5;
+	const double BM25_CONTENT_B = 0.75;
+	// 不超过 2字节 varint 能表示的最大值
+	const std::uint32_t BM25_QUANT_MAX = (1 << 14) - 1;
+
+	// 建立倒排拉链时 先将 标题和内容的词频 打包存储在权重中, 所有文档都建立完成, 知道字段的平均长度之后 再计算 BM25F 权重
+	const std::uint32_t RAW_TF_BITS = 16;
+	const std::uint32_t RAW_TF_MAX = (1 << RAW_TF_BITS) - 1;
+
+	// 文档内容中 第一个词的位置, 比标题中最后一个词的位置 至少大这么多
+	// 这样 短语查询(包括允许间隔的 ~N) 就不会匹配到 标题末尾和内容开头 拼起来的短语
+	const std::uint32_t CONTENT_POSITION_GAP = 1024;
+
+	// 建立索引时 每建立这么多文档 打印一次进度
+	const std::size_t BUILD_PROGRESS_INTERVAL = 1000;
+
+	// 倒排拉链, 文档id 和 权重经过压缩编码存储, 通过迭代器解码遍历
+	// invertedElem_t 的定义也在 postingList.hpp 中
+	typedef postingList invertedList_t;
+
+	// 倒排索引: 词典为每个关键字分配 termId(见 termDict.hpp), 倒排拉链存储在以 termId 为下标的 vector 中
+	// 并行建立索引时 每个线程的局部倒排索引 也是这个结构
+	typedef struct invertedIndex {
+		termDict _terms;
+		std::vector<invertedList_t> _lists; // 第i条倒排拉链 属于 termId 为i的关键字
+
+		// 关键字的 termId, 关键字不存在时 添加关键字 和一条空的倒排拉链
+		std::uint32_t insert(const char* word, std::size_t len) {
+			std::uint32_t termId = _terms.insert(word, len);
+			if (termId == _lists.size())
+				_lists.emplace_back();
+			return termId;
+		}
+		std::uint32_t insert(const std::string& word) { return insert(word.data(), word.size()); }
+
+		void clear() {
+			_terms.clear();
+			_lists.clear();
+		}
+	} invertedIndex_t;
+
+	// 索引快照
+	// 建立索引需要对所有文档分词, 非常耗时. 所以可以将建立好的索引 以二进制形式保存到文件中
+	// 服务重启时 直接 mmap 快照文件, 索引中的 文档内容、词典 和倒排拉链 都直接指向映射的内存, 不需要分词 也不需要复制
+	// 快照文件格式: snapshotHeader_t + 数据部分
+	//  数据部分依次为:
+	//   每个文档的 title url content(首尾相接) 以及内容的字节偏移采样
+	//   所有倒排拉链的块信息, 所有倒排拉链的编码数据, 所有倒排拉链的位置信息, 词典中首尾相接的关键字
+	//   目录: snapshotDirectory_t, 文档表, 倒排拉链表, 词典中每个关键字的偏移, 词典的哈希表
+	//  目录中记录的偏移 都相对于数据部分的开头. 数组都按8字节对齐写入, 映射之后 可以直接当作数组访问
+	//  加载时 只需要读取目录 和块信息, 文档内容 和倒排拉链的编码数据 在搜索用到时 才通过缺页读入
+	// 所有整数都以本机字节序写入
+	// 文件头中还记录了 建立索引时 raw 的版本号(见 manifest.hpp), 用于判断快照是否过期 以及能否应用增量文件
+	const char SNAPSHOT_MAGIC[8] = {'B', 'D', 'S', 'I', 'N', 'D', 'E', 'X'};
+	const std::uint32_t SNAPSHOT_VERSION = 11;
+	const std::uint32_t SNAPSHOT_ENDIAN = 0x01020304;
+	const std::size_t SNAPSHOT_ALIGN = 8;
+
+	typedef struct snapshotHeader {
+		char _magic[8];			 // 魔数
+		std::uint32_t _version;	 // 快照格式版本, 格式 或 分词结果 改变时递增
+		std::uint32_t _endian;	 // 字节序标记, 防止加载其他字节序机器上生成的快照
+		std::uint64_t _size;	   // 数据部分的字节数
+		std::uint64_t _checksum;   // 整个数据部分的校验和, 只在加载时要求校验的情况下 检查
+		std::uint64_t _generation; // raw 的版本号, 0 表示未知
+		std::uint64_t _directory;  // 目录的偏移, 目录一直到文件末尾
+		std::uint64_t _directoryChecksum; // 目录的校验和, 每次加载都检查
+	} snapshotHeader_t;
+
+	typedef struct snapshotDirectory {
+		std::uint64_t _docCount;
+		std::uint64_t _docs;		// 文档表 snapshotDoc_t[_docCount], 第i项 属于文档id 为i的文档
+		std::uint64_t _termCount;
+		std::uint64_t _lists;		// 倒排拉链表 snapshotList_t[_termCount], 第i项 属于 termId 为i的关键字
+		std::uint64_t _arena;		// 词典中 首尾相接的关键字
+		std::uint64_t _arenaSize;
+		std::uint64_t _termOffsets; // 每个关键字在 _arena 中的偏移 uint32[_termCount + 1]
+		std::uint64_t _slots;		// 词典的哈希表 uint32[_slotCount]
+		std::uint64_t _slotCount;
+	} snapshotDirectory_t;
+
+	// 文档表中的一项
+	typedef struct snapshotDoc {
+		std::uint64_t _text;		   // title url content 首尾相接 的偏移
+		std::uint64_t _contentOffsets; // 内容的字节偏移采样 的偏移
+		std::uint32_t _titleSize;
+		std::uint32_t _urlSize;
+		std::uint32_t _contentSize;
+		std::uint32_t _contentOffsetCount;
+		std::uint32_t _titleLength;
+		std::uint32_t _contentLength;
+	} snapshotDoc_t;
+
+	// 倒排拉链表中的一项, 块数由倒排元素个数得到
+	typedef struct snapshotList {
+		std::uint64_t _blocks;
+		std::uint64_t _data;
+		std::uint64_t _positions;
+		std::uint32_t _size; // 倒排元素个数
+		std::uint32_t _dataSize;
+		std::uint32_t _positionsSize;
+		std::uint32_t _reserved;
+	} snapshotList_t;
+
+	// 快照写入: 带缓冲区, 并在写入的同时计算校验和
+	class snapshotWriter {
+	public:
+		snapshotWriter(std::ofstream& out)
+			: _out(out)
+			, _size(0)
+			, _checksum(0xcbf29ce484222325ULL) {}
+
+		void writeBytes(const void* data, std::size_t len) {
+			_buffer.append(static_cast<const char*>(data), len);
+			if (_buffer.size() >= bufferSize) {
+				flush(false);
+			}
+		}
+		template <class T>
+		void writeValue(T value) {
+			writeBytes(&value, sizeof(value));
+		}
+		template <class T>
+		void writeArray(arrayRef<T> array) {
+			writeBytes(array.data(), array.size() * sizeof(T));
+		}
+		// 补0 到 SNAPSHOT_ALIGN 的倍数, 之后写入的数组 映射后可以直接访问
+		void align() {
+			static const char zeros[SNAPSHOT_ALIGN] = {0};
+			writeBytes(zeros, (SNAPSHOT_ALIGN - offset() % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN);
+		}
+		// 已写入的字节数, 即下一个字节 在数据部分中的偏移
+		std::uint64_t offset() const { return _size + _buffer.size(); }
+
+		// 写入剩余数据. 返回 数据部分的总字节数, 校验和通过 checksum 输出
+		std::uint64_t finish(std::uint64_t* checksum) {
+			flush(true);
+			*checksum = _checksum;
+			return _size;
+		}
+
+	private:
+		void flush(bool all) {
+			// 校验和是分段计算的, 除最后一段外 每段长度都需要是8的倍数
+			std::size_t len = all ? _buffer.size() : _buffer.size() / 8 * 8;
+			_checksum = ns_util::hashUtil::hash64(_buffer.data(), len, _checksum);
+			_out.write(_buffer.data(), len);
+			_size += len;
+			_buffer.erase(0, len);
+		}
+
+		static const std::size_t bufferSize = 1 << 20;
+
+		std::ofstream& _out;
+		std::string _buffer;
+		std::uint64_t _size;
+		std::uint64_t _checksum;
+	};
+
+	// 快照读取: 按偏移和元素个数 取得 mmap 映射的数据部分中 数组的只读视图, 不复制
+	// 每次读取都检查 是否越界 以及是否按元素类型对齐
+	class snapshotReader {
+	public:
+		snapshotReader(const char* begin, std::uint64_t size)
+			: _begin(begin)
+			, _size(size) {}
+
+		template <class T>
+		bool readArray(std::uint64_t offset, std::uint64_t count, arrayRef<T>* array) const {
+			if (offset > _size || (_size - offset) / sizeof(T) < count || offset % alignof(T) != 0)
+				return false;
+			*array = arrayRef<T>(reinterpret_cast<const T*>(_begin + offset), count);
+			return true;
+		}
+
+	private:
+		const char* _begin;
+		std::uint64_t _size;
+	};
+
+	// 快照文件的只读映射, 索引指向映射中的数据, 所以映射与索引的生命周期相同, 析构时解除映射
+	class snapshotMapping {
+	public:
+		snapshotMapping(void* addr, std::size_t size)
+			: _addr(addr)
+			, _size(size) {}
+		~snapshotMapping() { munmap(_addr, _size); }
+
+		snapshotMapping(const snapshotMapping&) = delete;
+		snapshotMapping& operator=(const snapshotMapping&) = delete;
+
+		const char* data() const { return static_cast<const char*>(_addr); }
+		std::size_t size() const { return _size; }
+
+	private:
+		void* _addr;
+		std::size_t _size;
+	};
 
 	class index {
 	private:
 		// 正排索引使用vector, 下标天然是 文档id
 		std::vector<docInfo_t> forwardIndex;
-		// 倒排索引 使用 哈希表, 因为倒排索引 一定是 一个keyword 对应一组 invertedElem拉链
-		std::unordered_map<std::string, invertedList_t> invertedIndex;
+		// 倒排索引 一个keyword 对应一组 invertedElem拉链, 通过词典 将keyword 映射为 termId 再找到倒排拉链
+		invertedIndex_t invertedIndex;
+		// 建立索引 和应用增量文件时 新文档的文本, deque 追加元素时 已有元素的地址不变, 正排索引可以一直指向它们
+		// 增量文件删除的文档 不从这里移除, 文本随索引一起释放
+		std::deque<docText_t> _docTexts;
+		// 从快照加载时 快照文件的映射, 正排索引、词典 和倒排拉链 中没有复制的部分 都指向这里
+		std::unique_ptr<snapshotMapping> _mapping;
+		// 索引对应的 raw 的版本号, 0 表示未知
+		std::uint64_t _generation;
+		// 索引对象的编号, 每个对象都不同. 缓存的键中带上编号, 更换索引之后 旧索引的缓存条目不会被命中
+		std::uint64_t _id;
+
+		static std::atomic<std::uint64_t> _nextId;
 
-		// 单例模式设计
-		index() {}
+	public:
+		// 索引不再是单例: 更换索引时 在后台建立一个新的索引对象, 再替换搜索器持有的 shared_ptr (见 searcher.hpp)
+		index()
+			: _generation(0)
+			, _id(_nextId.fetch_add(1, std::memory_order_relaxed)) {}
 
 		index(const index&) = delete;
 		index& operator=(const index&) = delete;
 
-		static index* _instance; // 单例
-		static std::mutex _mtx;
+		std::uint64_t id() const { return _id; }
 
-	public:
-		// 获取单例
-		static index* getInstance() {
-			if (nullptr == _instance) {
-				_mtx.lock();
-				if (nullptr == _instance) {
-					_instance = new index;
-				}
-				_mtx.unlock();
-			}
+		// 通过关键字 检索词典, 获取关键字的 termId, 不存在时返回 NO_TERM
+		std::uint32_t findTerm(const std::string& keyword) const {
+			// 查询中出现 索引中没有的词 是正常情况, 不打印日志
+			return invertedIndex._terms.find(keyword);
+		}
 
-			return _instance;
+		// 通过 termId 获取对应的 倒排拉链
+		invertedList_t* getInvertedList(std::uint32_t termId) {
+			return &invertedIndex._lists[termId];
 		}
 
 		// 通过关键字 检索倒排索引, 获取对应的 倒排拉链
 		invertedList_t* getInvertedList(const std::string& keyword) {
-			// 先找 关键字 所在迭代器
-			auto iter = invertedIndex.find(keyword);
-			if (iter == invertedIndex.end()) {
-				LOG(WARNING, "%s have no invertedList!", keyword.c_str());
-				// std::cerr << keyword << " have no invertedList!" << std::endl;
+			std::uint32_t termId = findTerm(keyword);
+			if (termId == NO_TERM)
 				return nullptr;
+
+			return getInvertedList(termId);
+		}
+
+		// termId 对应的关键字 及其长度, 指向词典内部, 不需要复制
+		const char* getTerm(std::uint32_t termId, std::size_t* len) const {
+			*len = invertedIndex._terms.termLength(termId);
+			return invertedIndex._terms.term(termId);
+		}
+
+		// 关键字在文档内容中出现的位置(从内容的第一个词 开始计数), 最多输出 limit 个
+		// 通过倒排拉链中记录的 关键字在文档中的位置 得到, 文档不包含关键字时 返回 false
+		bool contentPositions(std::uint32_t termId, const docInfo_t& doc, std::size_t limit,
+							  std::vector<std::uint32_t>* out) {
+			out->clear();
+			invertedList_t::iterator it = invertedIndex._lists[termId].begin();
+			it.nextGEQ(doc._docId);
+			if (!it.valid() || it->_docId != doc._docId)
+				return false;
+
+			// 位置是递增的, 内容中的位置 排在标题之后
+			it.positions(out);
+			const std::uint32_t contentStart = doc._titleLength + CONTENT_POSITION_GAP;
+			auto first = std::lower_bound(out->begin(), out->end(), contentStart);
+			std::size_t count = std::min<std::size_t>(out->end() - first, limit);
+			for (std::size_t i = 0; i < count; i++) {
+				(*out)[i] = first[i] - contentStart;
 			}
+			out->resize(count);
+			return true;
+		}
 
-			// 找到之后
-			return &(iter->second);
+		// 内容中 位置为 position 的词 之前不远处的字节偏移, 从这里开始查找 很快就能找到这个词
+		static std::size_t contentOffset(const docInfo_t& doc, std::uint32_t position) {
+			std::size_t sample = position / ns_util::OFFSET_SAMPLE_INTERVAL;
+			return sample < doc._contentOffsets.size() ? doc._contentOffsets[sample] : 0;
 		}
 
 		// 通过倒排拉链中 每个倒排元素中存储的 文档id, 检索正排索引, 获取对应文档内容
@@ -124,10 +397,33 @@ namespace ns_index {
 			return &forwardIndex[docId];
 		}
 
+		// 包含关键字的文档数, 即倒排拉链的长度
+		std::size_t documentFrequency(std::uint32_t termId) const {
+			return invertedIndex._lists[termId].size();
+		}
+
+		// 文档总数, 文档id 的范围就是 [0, docCount())
+		std::size_t docCount() const {
+			return forwardIndex.size();
+		}
+
+		std::uint64_t generation() const { return _generation; }
+		void setGeneration(std::uint64_t generation) { _generation = generation; }
+
+		// 清空索引
+		void clear() {
+			forwardIndex.clear();
+			invertedIndex.clear();
+			_docTexts.clear();
+			_mapping.reset();
+			_generation = 0;
+		}
+
 		// 根据parser模块处理过的 所有文档的信息
 		// 提取文档信息, 建立 正排索引和倒排索引
 		// input 为 ./data/output/raw
-		bool buildIndex(const std::string& input) {
+		// threadNum > 1 时, 使用多个线程并行分词 建立倒排索引
+		bool buildIndex(const std::string& input, std::size_t threadNum = 1) {
 			// 先以读取方式打开文件
 			std::ifstream in(input, std::ios::in);
 			if (!in.is_open()) {
@@ -136,6 +432,10 @@ namespace ns_index {
 				return false;
 			}
 
+			if (threadNum > 1) {
+				return buildIndexParallel(in, threadNum);
+			}
+
 			std::size_t count = 0;
 
 			std::string line;
@@ -149,22 +449,464 @@ namespace ns_index {
 				}
 
 				// 文档建立正排索引成功, 接着就通过 doc 建立倒排索引
-				if (!buildInvertedIndex(*doc)) {
+				if (!buildInvertedIndex(*doc, &invertedIndex)) {
 					LOG(WARNING, "Failed to buildInvertedIndex for %s", line.c_str());
 					// std::cerr << "Failed to buildInvertedIndex for " << line << std::endl;
 					continue;
 				}
 
 				count++;
-				LOG(NOTICE, "当前已建立文档索引: %d ", count);
-				// if (count % 50 == 0)
-				// 	std::cout << "当前已经建立的索引文档: " << count << std::endl;
+				if (count % BUILD_PROGRESS_INTERVAL == 0)
+					LOG(NOTICE, "当前已建立文档索引: %lu ", count);
+			}
+			LOG(NOTICE, "已建立文档索引: %lu ", count);
+			computeScores(0);
+			shrinkInvertedIndex();
+
+			return true;
+		}
+
+		// 将正排索引和倒排索引 保存为快照文件
+		// 先写入临时文件, 写入完成后再 rename, 保证 output 要么是旧快照 要么是完整的新快照
+		bool saveSnapshot(const std::string& output) {
+			const std::string tmpOutput = output + ".tmp";
+			std::ofstream out(tmpOutput, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out.is_open()) {
+				LOG(WARNING, "Failed to open %s", tmpOutput.c_str());
+				return false;
+			}
+
+			// 先占位写入文件头, 数据部分写完之后 再回到文件开头写入真正的文件头
+			snapshotHeader_t header;
+			memset(&header, 0, sizeof(header));
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+			snapshotWriter writer(out);
+			// 正排索引
+			std::vector<snapshotDoc_t> docs(forwardIndex.size());
+			for (std::size_t docId = 0; docId < forwardIndex.size(); docId++) {
+				const docInfo_t& doc = forwardIndex[docId];
+				snapshotDoc_t& record = docs[docId];
+				record._text = writer.offset();
+				record._titleSize = doc._title.size();
+				record._urlSize = doc._url.size();
+				record._contentSize = doc._content.size();
+				writer.writeArray(doc._title);
+				writer.writeArray(doc._url);
+				writer.writeArray(doc._content);
+				writer.align();
+				record._contentOffsets = writer.offset();
+				record._contentOffsetCount = doc._contentOffsets.size();
+				writer.writeArray(doc._contentOffsets);
+				record._titleLength = doc._titleLength;
+				record._contentLength = doc._contentLength;
+			}
+
+			// 倒排拉链已经是编码好的, 直接写入即可
+			// 块信息、编码数据、位置信息 分别连续存放: 加载时检查块信息 只会读入块信息所在的页, 普通查询也不会读入位置信息所在的页
+			const std::vector<invertedList_t>& invertedLists = invertedIndex._lists;
+			std::vector<snapshotList_t> lists(invertedLists.size());
+			writer.align();
+			for (std::size_t termId = 0; termId < invertedLists.size(); termId++) {
+				lists[termId]._blocks = writer.offset();
+				lists[termId]._size = invertedLists[termId].size();
+				writer.writeArray(invertedLists[termId].blocks());
+			}
+			for (std::size_t termId = 0; termId < invertedLists.size(); termId++) {
+				lists[termId]._data = writer.offset();
+				lists[termId]._dataSize = invertedLists[termId].data().size();
+				writer.writeArray(invertedLists[termId].data());
+			}
+			for (std::size_t termId = 0; termId < invertedLists.size(); termId++) {
+				lists[termId]._positions = writer.offset();
+				lists[termId]._positionsSize = invertedLists[termId].positions().size();
+				writer.writeArray(invertedLists[termId].positions());
+			}
+
+			snapshotDirectory_t directory;
+			memset(&directory, 0, sizeof(directory));
+			directory._arena = writer.offset();
+			directory._arenaSize = invertedIndex._terms.arena().size();
+			writer.writeArray(invertedIndex._terms.arena());
+
+			// 目录: 先在内存中拼接, 单独计算校验和 再写入
+			writer.align();
+			header._directory = writer.offset();
+			std::string tables(sizeof(directory), '\0');
+			auto appendTable = [&tables, &header](const void* data, std::size_t len) {
+				tables.resize((tables.size() + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN, '\0');
+				std::uint64_t offset = header._directory + tables.size();
+				tables.append(static_cast<const char*>(data), len);
+				return offset;
+			};
+			arrayRef<std::uint32_t> termOffsets = invertedIndex._terms.offsets();
+			arrayRef<std::uint32_t> slots = invertedIndex._terms.slots();
+			directory._docCount = docs.size();
+			directory._docs = appendTable(docs.data(), docs.size() * sizeof(snapshotDoc_t));
+			directory._termCount = lists.size();
+			directory._lists = appendTable(lists.data(), lists.size() * sizeof(snapshotList_t));
+			directory._termOffsets = appendTable(termOffsets.data(), termOffsets.size() * sizeof(std::uint32_t));
+			directory._slotCount = slots.size();
+			directory._slots = appendTable(slots.data(), slots.size() * sizeof(std::uint32_t));
+			memcpy(&tables[0], &directory, sizeof(directory));
+			header._directoryChecksum = ns_util::hashUtil::hash64(tables.data(), tables.size());
+			writer.writeBytes(tables.data(), tables.size());
+
+			memcpy(header._magic, SNAPSHOT_MAGIC, sizeof(header._magic));
+			header._version = SNAPSHOT_VERSION;
+			header._endian = SNAPSHOT_ENDIAN;
+			header._generation = _generation;
+			header._size = writer.finish(&header._checksum);
+			out.seekp(0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.close();
+			if (!out) {
+				LOG(WARNING, "Failed to write %s", tmpOutput.c_str());
+				unlink(tmpOutput.c_str());
+				return false;
+			}
+
+			if (rename(tmpOutput.c_str(), output.c_str()) != 0) {
+				LOG(WARNING, "Failed to rename %s to %s", tmpOutput.c_str(), output.c_str());
+				unlink(tmpOutput.c_str());
+				return false;
 			}
+			LOG(NOTICE, "索引快照已保存: %s, 文档数: %lu", output.c_str(), forwardIndex.size());
+
+			return true;
+		}
+
+		// 通过 mmap 加载快照文件, 映射在索引的生命周期内 一直保持
+		// 文档内容、词典 和倒排拉链 都直接指向映射的内存, 加载时只读取目录 和块信息, 耗时与文档数和关键字数成正比, 与快照大小无关
+		// 映射是只读的, prefork 模式下的工作进程 以及重新加载时新旧两个索引 共享同一份页缓存
+		// applyDelta() 修改的倒排拉链 和词典, 在修改之前 才复制到索引自己的内存中(写时复制), 没有修改的部分 继续使用映射
+		// 目录每次加载都校验. 整个数据部分的校验和 需要读取整个文件, 只在 verify 为 true 时检查
+		// 不检查时, 损坏的文档内容 或倒排拉链 只会在用到时 得到错误的结果
+		// 快照不存在、版本不匹配 或 校验失败时返回false, 此时索引保持为空, 调用者可以重新 buildIndex
+		bool loadSnapshot(const std::string& input, bool verify = false) {
+			clear();
+			int fd = open(input.c_str(), O_RDONLY);
+			if (fd < 0) {
+				LOG(WARNING, "Failed to open %s", input.c_str());
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < sizeof(snapshotHeader_t)) {
+				LOG(WARNING, "%s is not a index snapshot", input.c_str());
+				close(fd);
+				return false;
+			}
+			std::size_t fileSize = st.st_size;
+			void* addr = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd); // 映射建立之后, 文件描述符就不需要了
+			if (addr == MAP_FAILED) {
+				LOG(WARNING, "Failed to mmap %s", input.c_str());
+				return false;
+			}
+			std::unique_ptr<snapshotMapping> mapping(new snapshotMapping(addr, fileSize));
+
+			if (!loadSnapshotFrom(mapping->data(), fileSize, verify)) {
+				LOG(WARNING, "Invalid index snapshot: %s", input.c_str());
+				clear();
+				return false;
+			}
+			_mapping = std::move(mapping);
+			LOG(NOTICE, "索引快照已加载: %s, 文档数: %lu", input.c_str(), forwardIndex.size());
+
+			return true;
+		}
+
+		// 应用 parser 增量解析生成的增量文件(格式见 manifest.hpp), 只对新增的文档分词
+		//  1. 从正排索引中删除 增量文件中D记录的url 对应的文档, 剩余文档的id 依次前移
+		//  2. 按新的文档id 重写所有倒排拉链, 去掉已删除的文档
+		//  3. 将A记录的文档 依次追加到索引末尾, 并建立倒排索引
+		//  4. 用更新后的字段平均长度 计算新增文档的 BM25F 权重, 已有文档的权重不变, 重新建立索引时 才会按新的平均长度计算
+		// 重写倒排拉链只需要解码再编码, 比对所有文档重新分词快得多
+		// 增量文件无效时返回false, 此时索引可能已经被部分修改, 调用者需要重新 buildIndex
+		bool applyDelta(const std::string& deltaPath, std::uint64_t fromGeneration, std::uint64_t toGeneration) {
+			std::ifstream in(deltaPath, std::ios::in | std::ios::binary);
+			if (!in.is_open()) {
+				LOG(WARNING, "Failed to open %s", deltaPath.c_str());
+				return false;
+			}
+			std::uint64_t from = 0, to = 0;
+			if (!ns_manifest::readDeltaHeader(in, &from, &to) || from != fromGeneration || to != toGeneration) {
+				LOG(WARNING, "%s does not apply to the current index", deltaPath.c_str());
+				return false;
+			}
+
+			std::unordered_set<std::string> removedUrls;
+			std::vector<std::string> addedDocs;
+			std::string line;
+			while (std::getline(in, line)) {
+				if (line.size() < 2 || line[1] != ns_manifest::SEP) {
+					LOG(WARNING, "Invalid line in %s", deltaPath.c_str());
+					return false;
+				}
+				if (line[0] == ns_manifest::DELTA_DEL) {
+					removedUrls.insert(line.substr(2));
+				}
+				else if (line[0] == ns_manifest::DELTA_ADD) {
+					addedDocs.push_back(line.substr(2));
+				}
+				else {
+					LOG(WARNING, "Invalid line in %s", deltaPath.c_str());
+					return false;
+				}
+			}
+
+			// 1. 压缩正排索引, newIds 记录 旧文档id 对应的新文档id
+			const std::uint32_t removedId = std::numeric_limits<std::uint32_t>::max();
+			std::vector<std::uint32_t> newIds(forwardIndex.size(), removedId);
+			std::size_t liveCount = 0;
+			for (std::size_t docId = 0; docId < forwardIndex.size(); docId++) {
+				if (removedUrls.find(forwardIndex[docId]._url.str()) != removedUrls.end())
+					continue;
+				newIds[docId] = liveCount;
+				if (liveCount != docId)
+					forwardIndex[liveCount] = std::move(forwardIndex[docId]);
+				forwardIndex[liveCount]._docId = liveCount;
+				liveCount++;
+			}
+			std::size_t removedCount = forwardIndex.size() - liveCount;
+			forwardIndex.resize(liveCount);
+
+			// 2. 有文档被删除时, 重写倒排拉链. 文档id 的相对顺序没有变, 所以新的倒排拉链依旧是递增的
+			// 倒排拉链变为空的关键字 要从词典中去掉, 所以 将其余的关键字和倒排拉链 放入一个新的倒排索引中
+			if (removedCount > 0) {
+				invertedIndex_t compacted;
+				std::vector<std::uint32_t> positions;
+				for (std::uint32_t termId = 0; termId < invertedIndex._lists.size(); termId++) {
+					invertedList_t list;
+					for (invertedList_t::iterator it = invertedIndex._lists[termId].begin(); it.valid(); ++it) {
+						if (newIds[it->_docId] == removedId)
+							continue;
+						it.positions(&positions);
+						list.append(newIds[it->_docId], it->_weight, positions);
+					}
+					if (!list.empty()) {
+						std::uint32_t newTermId = compacted.insert(invertedIndex._terms.term(termId),
+																	invertedIndex._terms.termLength(termId));
+						compacted._lists[newTermId] = std::move(list);
+					}
+				}
+				invertedIndex = std::move(compacted);
+			}
+
+			// 3. 新增的文档 文档id 都大于已有的文档, 直接追加到倒排拉链末尾即可
+			for (const std::string& doc : addedDocs) {
+				docInfo_t* docInfo = buildForwardIndex(doc);
+				if (nullptr == docInfo || !buildInvertedIndex(*docInfo, &invertedIndex)) {
+					LOG(WARNING, "Failed to build index for %s", doc.c_str());
+					continue;
+				}
+			}
+			computeScores(liveCount);
+			shrinkInvertedIndex();
+			_generation = toGeneration;
+			LOG(NOTICE, "已应用增量文件: %s, 删除文档: %lu, 新增文档: %lu", deltaPath.c_str(), removedCount, addedDocs.size());
 
 			return true;
 		}
 
 	private:
+		bool loadSnapshotFrom(const char* data, std::size_t size, bool verify) {
+			snapshotHeader_t header;
+			memcpy(&header, data, sizeof(header));
+			if (memcmp(header._magic, SNAPSHOT_MAGIC, sizeof(header._magic)) != 0 || header._version != SNAPSHOT_VERSION ||
+				header._endian != SNAPSHOT_ENDIAN || header._size != size - sizeof(header) ||
+				header._directory > header._size) {
+				return false;
+			}
+			const char* begin = data + sizeof(header);
+			const char* directoryBegin = begin + header._directory;
+			// 接下来只读取目录, 提示内核预读目录所在的页. madvise 的地址需要按页对齐
+			const std::uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+			const std::uintptr_t adviseBegin = reinterpret_cast<std::uintptr_t>(directoryBegin) / pageSize * pageSize;
+			if (madvise(reinterpret_cast<void*>(adviseBegin), reinterpret_cast<std::uintptr_t>(data + size) - adviseBegin,
+						MADV_WILLNEED) != 0)
+				LOG(DEBUG, "madvise error: %s", strerror(errno));
+			if (ns_util::hashUtil::hash64(directoryBegin, header._size - header._directory) != header._directoryChecksum)
+				return false;
+			if (verify && ns_util::hashUtil::hash64(begin, header._size) != header._checksum)
+				return false;
+
+			snapshotReader reader(begin, header._size);
+			arrayRef<snapshotDirectory_t> directoryRef;
+			if (!reader.readArray(header._directory, 1, &directoryRef))
+				return false;
+			const snapshotDirectory_t& directory = directoryRef[0];
+			arrayRef<snapshotDoc_t> docs;
+			arrayRef<snapshotList_t> lists;
+			textRef arena;
+			arrayRef<std::uint32_t> termOffsets;
+			arrayRef<std::uint32_t> slots;
+			if (!reader.readArray(directory._docs, directory._docCount, &docs) ||
+				!reader.readArray(directory._lists, directory._termCount, &lists) ||
+				!reader.readArray(directory._arena, directory._arenaSize, &arena) ||
+				!reader.readArray(directory._termOffsets, lists.size() + 1, &termOffsets) ||
+				!reader.readArray(directory._slots, directory._slotCount, &slots))
+				return false;
+
+			_generation = header._generation;
+
+			// 正排索引 只记录文本在映射中的位置
+			forwardIndex.resize(docs.size());
+			for (std::size_t docId = 0; docId < docs.size(); docId++) {
+				const snapshotDoc_t& record = docs[docId];
+				docInfo_t& doc = forwardIndex[docId];
+				textRef text;
+				if (!reader.readArray(record._text,
+									  static_cast<std::uint64_t>(record._titleSize) + record._urlSize + record._contentSize,
+									  &text) ||
+					!reader.readArray(record._contentOffsets, record._contentOffsetCount, &doc._contentOffsets))
+					return false;
+				doc._title = textRef(text.data(), record._titleSize);
+				doc._url = textRef(doc._title.end(), record._urlSize);
+				doc._content = textRef(doc._url.end(), record._contentSize);
+				doc._titleLength = record._titleLength;
+				doc._contentLength = record._contentLength;
+				doc._docId = docId;
+			}
+
+			// 词典 和按 termId 顺序的倒排拉链
+			if (!invertedIndex._terms.map(arena, termOffsets, slots))
+				return false;
+			invertedIndex._lists.resize(lists.size());
+			for (std::size_t termId = 0; termId < lists.size(); termId++) {
+				const snapshotList_t& record = lists[termId];
+				arrayRef<postingBlock_t> blocks;
+				arrayRef<std::uint8_t> listData;
+				arrayRef<std::uint8_t> positions;
+				if (!reader.readArray(record._blocks, (record._size + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE, &blocks) ||
+					!reader.readArray(record._data, record._dataSize, &listData) ||
+					!reader.readArray(record._positions, record._positionsSize, &positions))
+					return false;
+				if (!blocks.empty() && blocks.back()._lastDocId >= docs.size())
+					return false;
+				if (!invertedIndex._lists[termId].map(record._size, blocks, listData, positions))
+					return false;
+			}
+
+			return true;
+		}
+
+		// 并行建立索引
+		// 正排索引的建立只是切分字符串, 很快, 所以先串行建立所有文档的正排索引
+		// 耗时的是倒排索引建立时的分词. 将所有文档按文档id 顺序切分为若干块, 多个线程通过原子计数 领取块
+		// 每一块都建立一个局部的倒排索引, 块内文档是按id 递增处理的
+		// 最后按块的顺序 将局部倒排索引合并到 invertedIndex 中, 这样每条倒排拉链中的文档id 依旧是递增的, 与串行建立的结果完全相同
+		bool buildIndexParallel(std::ifstream& in, std::size_t threadNum) {
+			std::string line;
+			while (std::getline(in, line)) {
+				if (nullptr == buildForwardIndex(line)) {
+					LOG(WARNING, "Failed to buildForwardIndex for %s", line.c_str());
+					continue;
+				}
+			}
+
+			// 块数多于线程数, 避免个别线程领到的大文档过多 导致其他线程空闲
+			const std::size_t chunkSize = std::max<std::size_t>(1, forwardIndex.size() / (threadNum * 8));
+			const std::size_t chunkNum = (forwardIndex.size() + chunkSize - 1) / chunkSize;
+			std::vector<invertedIndex_t> partialIndexes(chunkNum);
+			std::atomic<std::size_t> nextChunk(0);
+			std::atomic<std::size_t> count(0);
+
+			// 在创建线程之前获取分词单例, 防止多个线程同时初始化
+			ns_util::jiebaUtil::getInstance();
+
+			auto worker = [&]() {
+				std::size_t chunk;
+				while ((chunk = nextChunk++) < chunkNum) {
+					std::size_t begin = chunk * chunkSize;
+					std::size_t end = std::min(begin + chunkSize, forwardIndex.size());
+					for (std::size_t docId = begin; docId < end; docId++) {
+						if (!buildInvertedIndex(forwardIndex[docId], &partialIndexes[chunk])) {
+							LOG(WARNING, "Failed to buildInvertedIndex for %.*s", (int)forwardIndex[docId]._url.size(),
+								forwardIndex[docId]._url.data());
+						}
+					}
+					// 一个块 可能跨过多个打印点, 只打印一次
+					std::size_t done = count += end - begin;
+					if (done / BUILD_PROGRESS_INTERVAL != (done - (end - begin)) / BUILD_PROGRESS_INTERVAL)
+						LOG(NOTICE, "当前已建立文档索引: %lu ", done);
+				}
+			};
+
+			std::vector<std::thread> threads;
+			for (std::size_t i = 0; i < threadNum; i++) {
+				threads.emplace_back(worker);
+			}
+			for (auto& thread : threads) {
+				thread.join();
+			}
+			LOG(NOTICE, "已建立文档索引: %lu ", count.load());
+
+			// 按块的顺序合并, 保证倒排拉链中 文档id 递增
+			// 局部倒排索引的 termId 只在块内有效, 合并时 通过关键字重新映射为全局的 termId
+			for (auto& partial : partialIndexes) {
+				for (std::uint32_t termId = 0; termId < partial._lists.size(); termId++) {
+					invertedList_t& list =
+						invertedIndex._lists[invertedIndex.insert(partial._terms.term(termId), partial._terms.termLength(termId))];
+					if (list.empty()) {
+						list = std::move(partial._lists[termId]);
+					}
+					else {
+						list.append(partial._lists[termId]);
+					}
+				}
+				// 合并后就释放局部倒排索引, 降低内存峰值
+				partial = invertedIndex_t();
+			}
+			computeScores(0);
+			shrinkInvertedIndex();
+
+			return true;
+		}
+
+		// 将文档id >= firstDocId 的倒排元素中 打包的词频, 替换为 BM25F 权重
+		void computeScores(std::uint32_t firstDocId) {
+			if (forwardIndex.empty())
+				return;
+			double titleLength = 0, contentLength = 0;
+			for (const docInfo_t& doc : forwardIndex) {
+				titleLength += doc._titleLength;
+				contentLength += doc._contentLength;
+			}
+			const double avgTitleLength = std::max(1.0, titleLength / forwardIndex.size());
+			const double avgContentLength = std::max(1.0, contentLength / forwardIndex.size());
+
+			// 每个文档两个字段的 1 / B, 乘以 WORD_WEIGHT 使普通的词 词频为1
+			if (firstDocId >= forwardIndex.size())
+				return;
+			std::vector<std::pair<double, double>> norms(forwardIndex.size() - firstDocId);
+			for (std::size_t i = 0; i < norms.size(); i++) {
+				const docInfo_t& doc = forwardIndex[firstDocId + i];
+				norms[i].first = BM25_TITLE_WEIGHT / ns_util::WORD_WEIGHT /
+								 (1 - BM25_TITLE_B + BM25_TITLE_B * doc._titleLength / avgTitleLength);
+				norms[i].second =
+					1.0 / ns_util::WORD_WEIGHT / (1 - BM25_CONTENT_B + BM25_CONTENT_B * doc._contentLength / avgContentLength);
+			}
+
+			for (invertedList_t& list : invertedIndex._lists) {
+				list.rescore(firstDocId, [&norms, firstDocId](std::uint32_t docId, std::uint32_t rawTf) {
+					const std::pair<double, double>& norm = norms[docId - firstDocId];
+					double tf = (rawTf >> RAW_TF_BITS) * norm.first + (rawTf & RAW_TF_MAX) * norm.second;
+					std::uint32_t score = static_cast<std::uint32_t>(tf / (BM25_K1 + tf) * BM25_QUANT_MAX + 0.5);
+					return std::max<std::uint32_t>(1, score);
+				});
+			}
+		}
+
+		// 倒排拉链建立时 vector 按倍数扩容, 建立完成后释放多余的容量
+		void shrinkInvertedIndex() {
+			invertedIndex._terms.shrink();
+			invertedIndex._lists.shrink_to_fit();
+			for (invertedList_t& list : invertedIndex._lists) {
+				list.shrink();
+			}
+		}
+
 		// 对一个文档建立正排索引
 		docInfo_t* buildForwardIndex(const std::string& file) {
 			// 一个文档的 正排索引的建立, 是将 title\3content\3url (file) 中title content url 提取出来
@@ -175,10 +917,18 @@ namespace ns_index {
 			// stringUtil::split() 字符串通用工具接口, 分割字符串
 			ns_util::stringUtil::split(file, &fileResult, sep);
 
+			// 文本保存在 _docTexts 中, 正排索引只记录位置
+			_docTexts.emplace_back();
+			docText_t& text = _docTexts.back();
+			text._title = std::move(fileResult[0]);
+			text._content = std::move(fileResult[1]);
+			text._url = std::move(fileResult[2]);
+
 			docInfo_t doc;
-			doc._title = fileResult[0];
-			doc._content = fileResult[1];
-			doc._url = fileResult[2];
+			doc._title = text._title;
+			doc._content = text._content;
+			doc._url = text._url;
+			doc._text = &text;
 
 			// 因为doc是需要存储到 forwardIndex中的, 存储之前 forwardIndex的size 就是存储之后 doc所在的位置
 			doc._docId = forwardIndex.size();
@@ -190,8 +940,8 @@ namespace ns_index {
 
 		// 对一个文档建立倒排索引
 		// 倒排索引是用来通过关键词定位文档的.
-		// 倒排索引的结构是 std::unordered_map<std::string, invertedList_t> invertedIndex;
-		// keyword值就是关键字, value值则是关键字所映射到的文档的倒排拉链
+		// 倒排索引的结构是 invertedIndex_t invertedIndex;
+		// 词典将关键字映射为 termId, termId 再映射到 关键字所在文档的倒排拉链
 		// 对一个文档建立倒排索引的原理是:
 		//  1. 首先对文档的标题 和 内容进行分词, 并记录分词
 		//  2. 分别统计整理标题分析的词频 和 内容分词的词频
@@ -204,53 +954,54 @@ namespace ns_index {
 		// 注意, 搜索引擎一般不区分大小写, 所以可以将分词出来的所有的关键字, 在倒排索引中均以小写的形式映射. 在搜索时 同样将搜索请求分词出的关键字小写化, 在进行检索. 就可以实现搜索不区分大小写.
 
 		// 关于分词 使用 cppjieba 中文分词库
-		bool buildInvertedIndex(const docInfo_t& doc) {
-			// 用来映射关键字 和 关键字的词频
-			std::unordered_map<std::string, keywordCnt_t> keywordsMap;
+		// 倒排索引会建立到 invertedIndexOut 中, 并行建立索引时 每个线程都有自己的局部倒排索引
+		// 同时记录文档 标题和内容的长度
+		// 只用于刚建立正排索引的文档, 这样的文档 文本都在 doc._text 中
+		bool buildInvertedIndex(docInfo_t& doc, invertedIndex_t* invertedIndexOut) {
+			docText_t& text = *doc._text;
+			// 用来映射关键字 和 关键字的词频, 关键字直接加入词典, 以 termId 表示
+			std::unordered_map<std::uint32_t, keywordCnt_t> keywordsMap;
 			ns_util::jiebaUtil* jiebaIns = ns_util::jiebaUtil::getInstance();
 
 			// 标题分词
-			std::vector<std::string> titleKeywords;
-			jiebaIns->cutStringNoStop(doc._title, &titleKeywords);
-			// jiebaIns->cutString(doc._title, &titleKeywords);
-			// 标题词频统计 与 转换 记录
-			for (auto keyword : titleKeywords) {
-				boost::to_lower(keyword);		  // 关键字转小写
-				keywordsMap[keyword]._titleCnt++; // 记录关键字 并统计标题中词频
-												  // unordered_map 的 [], 是用来通过keyword值 访问value的. 如果keyword值已经存在, 则返回对应的value, 如果keyword值不存在, 则会插入keyword并创建对应的value
+			// 使用代码感知分词, C++ 名字会输出 完整的限定名、标识符、子词等不同种类的词, 词频按词的种类加权统计
+			std::vector<ns_util::term_t> titleTerms;
+			std::uint32_t titlePositions = jiebaIns->analyze(text._title, true, &titleTerms);
+			doc._titleLength = titlePositions;
+			// 标题词频统计 与 记录, 分词结果已经是小写
+			for (const ns_util::term_t& term : titleTerms) {
+				// unordered_map 的 [], 是用来通过keyword值 访问value的. 如果keyword值已经存在, 则返回对应的value, 如果keyword值不存在, 则会插入keyword并创建对应的value
+				keywordCnt_t& cnt = keywordsMap[invertedIndexOut->insert(term._word)];
+				cnt._titleCnt += term._weight; // 记录关键字 并统计标题中词频
+				cnt._positions.push_back(term._position);
 			}
 
 			// 内容分词
-			std::vector<std::string> contentKeywords;
-			jiebaIns->cutStringNoStop(doc._content, &contentKeywords);
-			// jiebaIns->cutString(doc._content, &contentKeywords);
-			// 内容词频统计 与 转换 记录
-			for (auto keyword : contentKeywords) {
-				boost::to_lower(keyword);			// 关键字转小写
-				keywordsMap[keyword]._contentCnt++; // 记录关键字 并统计内容中词频
-			}
-
-			// 这两个const 变量是用来计算 关键字在文档中的权重的.
-			// 并且, 关键字出现在标题中  文档与关键字的相关性大概率是要高的, 所以 可以把titleWeight 设置的大一些
-			const int titleWeight = 40;
-			const int contentWeight = 1;
+			std::vector<ns_util::term_t> contentTerms;
+			doc._contentLength = jiebaIns->analyze(text._content, true, &contentTerms, &text._contentOffsets);
+			doc._contentOffsets = text._contentOffsets;
+			// 内容词频统计 与 记录, 内容中的位置 接在标题之后
+			const std::uint32_t contentStart = titlePositions + CONTENT_POSITION_GAP;
+			for (const ns_util::term_t& term : contentTerms) {
+				keywordCnt_t& cnt = keywordsMap[invertedIndexOut->insert(term._word)];
+				cnt._contentCnt += term._weight; // 记录关键字 并统计内容中词频
+				cnt._positions.push_back(contentStart + term._position);
+			}
+
 			// 分词并统计词频之后, keywordsMap 中已经存储的当前文档的所有关键字, 以及对应的在标题 和 内容中 出现的频率
 			// 就可以遍历 keywordsMap 获取关键字信息, 构建 invertedElem 并添加到 invertedIndex中 关键词的倒排拉链 invertedList中了
+			// 权重需要字段的平均长度, 所以先打包存储两个字段的词频, 所有文档建立完成之后 由 computeScores 计算 BM25F 权重
 			for (auto& keywordInfo : keywordsMap) {
-				invertedElem_t item;
-				item._docId = doc._docId;		   // 本文档id
-				item._keyword = keywordInfo.first; // 关键字
-				item._weight = keywordInfo.second._titleCnt * titleWeight + keywordInfo.second._contentCnt * contentWeight;
+				std::uint64_t weight = std::min<std::size_t>(keywordInfo.second._titleCnt, RAW_TF_MAX) << RAW_TF_BITS |
+									   std::min<std::size_t>(keywordInfo.second._contentCnt, RAW_TF_MAX);
 
-				// 上面构建好了 invertedElem, 下面就要将 invertedElem 添加到对应关键字的 倒排拉链中, 构建倒排索引
-				invertedList_t& list = invertedIndex[keywordInfo.first]; // 获取关键字对应的倒排拉链
-				list.push_back(std::move(item));
+				// 计算出权重之后, 就要将 文档id 和 权重 添加到对应关键字的 倒排拉链中, 构建倒排索引
+				invertedList_t& list = invertedIndexOut->_lists[keywordInfo.first]; // 获取关键字对应的倒排拉链
+				list.append(doc._docId, weight, keywordInfo.second._positions);
 			}
 
 			return true;
 		}
 	};
-	// 单例相关
-	index* index::_instance = nullptr;
-	std::mutex index::_mtx;
+	std::atomic<std::uint64_t> index::_nextId(1);
 } // namespace ns_index
@@ -0,0 +1,65 @@
+// 词典编译程序
+// 将 cppjieba 的文本词典(词典 和 用户词典) 与 HMM模型, 编译为一个二进制文件(格式见 cppjieba/CompiledDict.hpp)
+// 编译词典中保存的是 加载完成之后的内存结构: 双数组词典树、每个词的权重和词性、HMM模型的概率表
+// 服务器启动时 只需要 mmap 编译词典, 不需要再解析文本词典、计算权重和建立词典树
+// 并且 多个服务器进程 mmap 同一个编译词典时, 共享同一份物理内存
+//
+// 编译词典中记录了 文本词典的哈希. 修改文本词典之后 需要重新运行本程序, 否则编译词典被视为过期, 仍然使用文本词典
+//
+// 用法: ./jiebaCompile [输出文件]
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "util.hpp"
+
+typedef std::chrono::steady_clock compileClock;
+
+static double secondsSince(const compileClock::time_point& start) {
+	return std::chrono::duration<double>(compileClock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+	const std::string output = argc > 1 ? argv[1] : ns_util::COMPILED_DICT_PATH;
+
+	std::uint64_t sourceHash = 0;
+	if (!cppjieba::CompiledDict::HashSources(ns_util::DICT_PATH, ns_util::USER_DICT_PATH, ns_util::HMM_PATH,
+											 &sourceHash)) {
+		std::cerr << "Failed to read " << ns_util::DICT_PATH << ", " << ns_util::USER_DICT_PATH << " or "
+				  << ns_util::HMM_PATH << std::endl;
+		return 1;
+	}
+
+	// 与 jiebaUtil 加载文本词典的方式相同
+	compileClock::time_point start = compileClock::now();
+	cppjieba::DictTrie dictTrie(ns_util::DICT_PATH, ns_util::USER_DICT_PATH);
+	cppjieba::HMMModel model(ns_util::HMM_PATH);
+	double textLoad = secondsSince(start);
+
+	cppjieba::CompiledDictBuilder builder;
+	dictTrie.Save(builder);
+	model.Save(builder);
+	if (!builder.Write(output, sourceHash)) {
+		std::cerr << "Failed to write " << output << std::endl;
+		return 1;
+	}
+
+	// 重新加载一次, 确认编译词典可用
+	start = compileClock::now();
+	cppjieba::CompiledDict compiled;
+	if (!compiled.Load(output, sourceHash)) {
+		std::cerr << "Failed to load " << output << std::endl;
+		return 1;
+	}
+	cppjieba::DictTrie compiledTrie(compiled);
+	cppjieba::HMMModel compiledModel(compiled);
+	double compiledLoad = secondsSince(start);
+
+	std::ifstream in(output, std::ios::in | std::ios::binary | std::ios::ate);
+	printf("%s: %.1f MB\n", output.c_str(), static_cast<double>(in.tellg()) / 1048576);
+	printf("load: text %.3f s, compiled %.3f s\n", textLoad, compiledLoad);
+
+	return 0;
+}
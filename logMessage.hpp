@@ -1,15 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 // 宏定义 四个日志等级
@@ -22,6 +32,334 @@
 
 const char* log_level[] = {"DEBUG", "NOTICE", "WARNING", "FATAL"};
 
+// 异步日志
+// 每条日志都 fflush + fsync 的话, 打印日志的线程就要等待磁盘写入完成, 建立索引和处理请求都会被拖慢
+// 所以 打印日志的线程只负责格式化日志, 并将日志放入环形缓冲区
+// 由一个后台线程 从缓冲区中批量取出日志, 通过 writev 一次写入, 并按一定的时间间隔 fsync
+//
+// 环形缓冲区是无锁的多生产者单消费者队列:
+//  每个槽位有一个序号 _seq, 生产者通过 CAS 抢占写入位置 _enqueuePos, 槽位的 _seq == 写入位置时 表示槽位空闲
+//  生产者写完日志后 将 _seq 置为 写入位置+1, 表示槽位中的日志可以被读取
+//  消费者写出日志后 将 _seq 置为 读取位置+槽位数, 表示槽位可以被下一轮的生产者使用
+// 缓冲区满时, DEBUG 和 NOTICE 日志默认直接丢弃并计数, WARNING 和 FATAL 日志等待缓冲区有空闲
+// FATAL 日志 会等待日志写入并 fsync 之后才返回
+class asyncLogger {
+public:
+	enum fullPolicy {
+		DROP, // 缓冲区满时 丢弃日志
+		BLOCK // 缓冲区满时 等待
+	};
+
+	static asyncLogger& getInstance() {
+		static asyncLogger instance;
+		return instance;
+	}
+
+	// 后台线程 fsync 的时间间隔, 可以在任意线程中 随时修改
+	void setFsyncInterval(int ms) { _fsyncIntervalMs.store(ms, std::memory_order_relaxed); }
+	// 缓冲区满时, WARNING 以下等级日志的处理方式, 可以在任意线程中 随时修改
+	void setFullPolicy(fullPolicy policy) { _policy.store(policy, std::memory_order_relaxed); }
+
+	// 因缓冲区满 被丢弃的日志条数
+	std::uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+	// 已经写入文件的日志条数
+	std::uint64_t written() const { return _dequeuePos.load(std::memory_order_acquire); }
+
+	// 将一条格式化好的日志 放入缓冲区
+	void append(int level, const char* line, std::size_t len) {
+		start();
+
+		int fd = (level == FATAL) ? STDERR_FILENO : STDOUT_FILENO;
+		if (len > slotDataSize)
+			len = slotDataSize;
+
+		std::uint64_t pos = 0;
+		while (!tryEnqueue(fd, line, len, &pos)) {
+			if (level < WARNING && _policy.load(std::memory_order_relaxed) == DROP) {
+				_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			wakeWriter();
+			std::this_thread::yield();
+		}
+		wakeWriter();
+
+		if (level == FATAL) {
+			flush(pos + 1);
+		}
+	}
+
+	// 等待已放入缓冲区的日志 全部写入文件并 fsync
+	void flush() { flush(_enqueuePos.load(std::memory_order_acquire)); }
+
+private:
+	static const std::size_t slotNum = 2048; // 必须是2的幂
+	static const std::size_t slotDataSize = 1200;
+	static const std::size_t maxBatch = 64; // 一次 writev 最多写入的日志条数
+
+	typedef struct slot {
+		std::atomic<std::uint64_t> _seq;
+		int _fd;
+		std::uint32_t _len;
+		char _data[slotDataSize];
+	} slot_t;
+
+	asyncLogger()
+		: _slots(new slot_t[slotNum])
+		, _fsyncIntervalMs(1000)
+		, _policy(DROP)
+		, _dropped(0)
+		, _started(false)
+		, _running(false)
+		, _writerSleeping(false) {
+		reset();
+	}
+
+	~asyncLogger() {
+		stop();
+		delete[] _slots;
+	}
+
+	asyncLogger(const asyncLogger&) = delete;
+	asyncLogger& operator=(const asyncLogger&) = delete;
+
+	void reset() {
+		for (std::size_t i = 0; i < slotNum; i++) {
+			_slots[i]._seq.store(i, std::memory_order_relaxed);
+		}
+		_enqueuePos.store(0, std::memory_order_relaxed);
+		_dequeuePos.store(0, std::memory_order_relaxed);
+		_syncedPos = 0;
+		_flushTarget = 0;
+	}
+
+	// 第一次打印日志时 才启动后台线程
+	// 守护进程 fork 之后, 子进程中没有父进程的后台线程, 所以需要在子进程中重置状态, 之后再次打印日志时 重新启动
+	void start() {
+		if (_started.load(std::memory_order_acquire))
+			return;
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_started.load(std::memory_order_relaxed))
+			return;
+		static bool registered = false;
+		if (!registered) {
+			pthread_atfork(nullptr, nullptr, &asyncLogger::afterFork);
+			registered = true;
+		}
+		_running = true;
+		_writer = std::thread(&asyncLogger::writerRoutine, this);
+		_started.store(true, std::memory_order_release);
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			if (!_started.load(std::memory_order_relaxed))
+				return;
+			_running = false;
+			_cond.notify_one();
+		}
+		_writer.join();
+		_started.store(false, std::memory_order_release);
+	}
+
+	static void afterFork() {
+		asyncLogger& logger = getInstance();
+		// 父进程的线程 在子进程中都不存在了, 缓冲区中未写出的日志也一并丢弃
+		// 锁可能被父进程中的其他线程持有, 直接重新构造; 后台线程对象也直接覆盖, 不能 join
+		new (&logger._mtx) std::mutex;
+		new (&logger._cond) std::condition_variable;
+		new (&logger._flushCond) std::condition_variable;
+		new (&logger._writer) std::thread;
+		logger._started.store(false, std::memory_order_relaxed);
+		logger._writerSleeping.store(false, std::memory_order_relaxed);
+		logger.reset();
+	}
+
+	bool tryEnqueue(int fd, const char* line, std::size_t len, std::uint64_t* outPos) {
+		std::uint64_t pos = _enqueuePos.load(std::memory_order_relaxed);
+		slot_t* s;
+		while (true) {
+			s = &_slots[pos & (slotNum - 1)];
+			std::uint64_t seq = s->_seq.load(std::memory_order_acquire);
+			std::int64_t diff = static_cast<std::int64_t>(seq) - static_cast<std::int64_t>(pos);
+			if (diff == 0) {
+				if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				return false; // 缓冲区满
+			}
+			else {
+				pos = _enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		s->_fd = fd;
+		s->_len = len;
+		memcpy(s->_data, line, len);
+		s->_seq.store(pos + 1, std::memory_order_release);
+		*outPos = pos;
+		return true;
+	}
+
+	void wakeWriter() {
+		// 与后台线程 "设置_writerSleeping 后检查缓冲区" 相对应, 保证两边至少有一方看到对方的写入
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (_writerSleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(_mtx);
+			_cond.notify_one();
+		}
+	}
+
+	void flush(std::uint64_t pos) {
+		if (!_started.load(std::memory_order_acquire))
+			return;
+		std::unique_lock<std::mutex> lock(_mtx);
+		_flushTarget = std::max(_flushTarget, pos);
+		_cond.notify_one();
+		_flushCond.wait(lock, [this, pos]() { return _syncedPos >= pos || !_running; });
+	}
+
+	// 从 _dequeuePos 开始 取出已经写好的连续槽位, 通过 writev 批量写入
+	// 相邻的日志 文件描述符相同时 才能合并写入
+	std::size_t writeBatch() {
+		std::uint64_t pos = _dequeuePos.load(std::memory_order_relaxed);
+		struct iovec iov[maxBatch];
+		std::size_t count = 0;
+		int fd = -1;
+		while (count < maxBatch) {
+			slot_t& s = _slots[(pos + count) & (slotNum - 1)];
+			if (s._seq.load(std::memory_order_acquire) != pos + count + 1)
+				break;
+			if (count > 0 && s._fd != fd)
+				break;
+			fd = s._fd;
+			iov[count].iov_base = s._data;
+			iov[count].iov_len = s._len;
+			count++;
+		}
+		if (count == 0)
+			return 0;
+
+		writeAll(fd, iov, count);
+		_dirty |= (fd == STDOUT_FILENO ? 1 : 2);
+
+		for (std::size_t i = 0; i < count; i++) {
+			_slots[(pos + i) & (slotNum - 1)]._seq.store(pos + i + slotNum, std::memory_order_release);
+		}
+		_dequeuePos.store(pos + count, std::memory_order_release);
+		return count;
+	}
+
+	static void writeAll(int fd, struct iovec* iov, int count) {
+		while (count > 0) {
+			ssize_t n = writev(fd, iov, count);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return; // 写入失败时 放弃这批日志, 不能阻塞后台线程
+			}
+			while (count > 0 && static_cast<std::size_t>(n) >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov++;
+				count--;
+			}
+			if (count > 0) {
+				iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+				iov->iov_len -= n;
+			}
+		}
+	}
+
+	void sync() {
+		if (_dirty & 1)
+			fsync(STDOUT_FILENO);
+		if (_dirty & 2)
+			fsync(STDERR_FILENO);
+		_dirty = 0;
+		_lastSync = std::chrono::steady_clock::now();
+	}
+
+	// 有日志被丢弃时, 写一条日志说明丢弃的条数
+	void reportDropped() {
+		std::uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+		if (dropped == _reportedDropped)
+			return;
+		char line[128];
+		int len = snprintf(line, sizeof(line), "%s | asyncLogger dropped %llu lines\n", log_level[WARNING],
+						   static_cast<unsigned long long>(dropped - _reportedDropped));
+		struct iovec iov;
+		iov.iov_base = line;
+		iov.iov_len = len;
+		writeAll(STDOUT_FILENO, &iov, 1);
+		_dirty |= 1;
+		_reportedDropped = dropped;
+	}
+
+	void writerRoutine() {
+		_lastSync = std::chrono::steady_clock::now();
+		_dirty = 0;
+		while (true) {
+			while (writeBatch() > 0) {
+			}
+			reportDropped();
+
+			auto now = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(_mtx);
+			bool flushRequested = _flushTarget > _syncedPos;
+			const std::chrono::milliseconds fsyncInterval(_fsyncIntervalMs.load(std::memory_order_relaxed));
+			if (_dirty && (flushRequested || !_running || now - _lastSync >= fsyncInterval)) {
+				lock.unlock();
+				sync();
+				lock.lock();
+			}
+			// 已写出的日志都 fsync 之后, 才能通知 flush() 的等待者
+			if (!_dirty) {
+				_syncedPos = _dequeuePos.load(std::memory_order_acquire);
+				_flushCond.notify_all();
+			}
+
+			if (!_running && _syncedPos == _enqueuePos.load(std::memory_order_acquire))
+				break;
+			if (_flushTarget > _syncedPos || !_running)
+				continue;
+
+			// 没有日志时休眠, 生产者发现 _writerSleeping 时会唤醒
+			// 设置 _writerSleeping 之后需要再检查一次缓冲区, 防止错过唤醒
+			_writerSleeping.store(true, std::memory_order_seq_cst);
+			std::uint64_t next = _dequeuePos.load(std::memory_order_relaxed);
+			if (_slots[next & (slotNum - 1)]._seq.load(std::memory_order_acquire) != next + 1) {
+				_cond.wait_for(lock, _dirty ? fsyncInterval : std::chrono::milliseconds(1000));
+			}
+			_writerSleeping.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	slot_t* _slots;
+	std::atomic<std::uint64_t> _enqueuePos; // 下一条日志的写入位置
+	std::atomic<std::uint64_t> _dequeuePos; // 下一条日志的读取位置, 也是已写出的日志条数
+	std::uint64_t _syncedPos = 0;			// 已经 fsync 的日志条数, 受 _mtx 保护
+	std::uint64_t _flushTarget = 0;			// flush() 等待的位置, 受 _mtx 保护
+
+	std::atomic<int> _fsyncIntervalMs;
+	std::atomic<fullPolicy> _policy;
+	std::atomic<std::uint64_t> _dropped;
+
+	std::mutex _mtx;
+	std::condition_variable _cond;		// 唤醒后台线程
+	std::condition_variable _flushCond; // 通知 flush() 的等待者
+	std::thread _writer;
+	std::atomic<bool> _started;
+	bool _running; // 受 _mtx 保护
+	std::atomic<bool> _writerSleeping;
+
+	// 以下只由后台线程访问
+	int _dirty = 0; // 写入后还未 fsync 的文件描述符, 1: 标准输出 2: 标准错误
+	std::uint64_t _reportedDropped = 0;
+	std::chrono::steady_clock::time_point _lastSync;
+};
+
 class log {
 public:
 	log()
@@ -38,7 +376,8 @@ public:
 
 	~log() {
 		if (_logFd != -1) {
-			// 将系统缓冲区内容刷入文件
+			// 先等待缓冲区中的日志全部写入, 再将系统缓冲区内容刷入文件
+			asyncLogger::getInstance().flush();
 			fsync(_logFd);
 			close(_logFd);
 		}
@@ -58,8 +397,8 @@ void logMessage(int level, const char* file, int line, const char* format, ...)
 	assert(level >= DEBUG);
 	assert(level <= FATAL);
 
-	// 获取当前用户名
-	char* name = getenv("USER");
+	// 获取当前用户名, 进程运行期间不会改变 只需要获取一次
+	static const char* name = getenv("USER");
 
 	// 简单的定义log缓冲区
 	char logInfo[1024];
@@ -76,22 +415,28 @@ void logMessage(int level, const char* file, int line, const char* format, ...)
 	// ap 使用完之后, 再将 ap置空
 	va_end(ap); // ap = NULL
 
-	// 通过判断日志等级, 来选择是标准输出流还是标准错误流
-	FILE* out = (level == FATAL) ? stderr : stdout;
-
-	// 获取本地时间
+	// 获取本地时间, 格式与 asctime() 相同
+	// localtime() 和 asctime() 使用静态缓冲区, 多线程下不安全. 同一秒内的日志 复用上一次格式化的时间
+	static thread_local time_t lastTm = 0;
+	static thread_local char localTmStr[32];
 	time_t tm = time(nullptr);
-	struct tm* localTm = localtime(&tm);
-	char* localTmStr = asctime(localTm);
-	char* nC = strstr(localTmStr, "\n");
-	if (nC) {
-		*nC = '\0';
-	}
-	fprintf(out, "%s | %s | %s | %s | %s:%d\n", log_level[level], localTmStr,
-			name == nullptr ? "unknow" : name, logInfo, file, line);
-
-	// 将C缓冲区的内容 刷入系统
-	fflush(out);
-	// 将系统缓冲区的内容 刷入文件
-	fsync(fileno(out));
+	if (tm != lastTm) {
+		struct tm localTm;
+		localtime_r(&tm, &localTm);
+		strftime(localTmStr, sizeof(localTmStr), "%a %b %e %H:%M:%S %Y", &localTm);
+		lastTm = tm;
+	}
+
+	// 格式化出完整的一行日志, 交给异步日志写入
+	char logLine[1200];
+	int len = snprintf(logLine, sizeof(logLine), "%s | %s | %s | %s | %s:%d\n", log_level[level], localTmStr,
+					   name == nullptr ? "unknow" : name, logInfo, file, line);
+	if (len < 0)
+		return;
+	if (static_cast<std::size_t>(len) >= sizeof(logLine)) {
+		len = sizeof(logLine) - 1;
+		logLine[len - 1] = '\n';
+	}
+
+	asyncLogger::getInstance().append(level, logLine, len);
 }
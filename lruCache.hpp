@@ -0,0 +1,160 @@
+// 本文件实现 分片的 LRU 缓存
+
+// 查询日志中 少数几百个查询 占了大部分请求, 缓存这些查询的结果 就可以省去大部分搜索
+// 缓存由多个分片组成, 键的哈希值决定所在的分片, 每个分片有自己的锁, 不同分片的读写互不阻塞
+// 每个分片都是一个 LRU: 链表按最近访问的顺序排列, 哈希表通过键找到链表节点
+//  按字节数限制容量, 超出时 从链表尾部淘汰最久没有访问的条目
+//  条目超过 ttl 没有更新 就视为过期, 读取时发现过期 直接删除
+// 索引更新后 旧的结果都不再有效, 通过 clear() 清空所有分片
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "util.hpp"
+
+namespace ns_cache {
+	// 链表节点 和 哈希表节点 的大致开销, 计入条目的字节数
+	const std::size_t ENTRY_OVERHEAD = 96;
+
+	// 缓存的统计信息
+	typedef struct cacheStats {
+		std::uint64_t _hits;
+		std::uint64_t _misses;
+		std::uint64_t _evictions;  // 因容量不足被淘汰的条目数
+		std::uint64_t _expirations; // 因过期被删除的条目数
+		std::size_t _entries;
+		std::size_t _bytes;
+	} cacheStats_t;
+
+	template <class V>
+	class shardedLruCache {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// capacityBytes 平均分给 shardNum 个分片, ttlSeconds 为0 表示不过期
+		shardedLruCache(std::size_t shardNum, std::size_t capacityBytes, std::uint32_t ttlSeconds)
+			: _shards(shardNum > 0 ? shardNum : 1)
+			, _shardCapacity(capacityBytes / _shards.size())
+			, _ttl(std::chrono::seconds(ttlSeconds))
+			, _hits(0)
+			, _misses(0)
+			, _evictions(0)
+			, _expirations(0) {}
+
+		shardedLruCache(const shardedLruCache&) = delete;
+		shardedLruCache& operator=(const shardedLruCache&) = delete;
+
+		// 查找 key, 命中时将值复制到 value, 并把条目移到链表头部
+		bool get(const std::string& key, V* value) {
+			shard_t& shard = shardOf(key);
+			std::lock_guard<std::mutex> lock(shard._mtx);
+			auto it = shard._map.find(key);
+			if (it == shard._map.end()) {
+				_misses++;
+				return false;
+			}
+			typename std::list<entry_t>::iterator entry = it->second;
+			if (_ttl.count() > 0 && clock::now() - entry->_time > _ttl) {
+				erase(shard, entry);
+				_expirations++;
+				_misses++;
+				return false;
+			}
+			shard._lru.splice(shard._lru.begin(), shard._lru, entry);
+			*value = entry->_value;
+			_hits++;
+			return true;
+		}
+
+		// 插入或更新 key, bytes 为值占用的字节数. 单个条目超过分片容量时 不缓存
+		void put(const std::string& key, V value, std::size_t bytes) {
+			bytes += key.size() + ENTRY_OVERHEAD;
+			if (bytes > _shardCapacity)
+				return;
+			shard_t& shard = shardOf(key);
+			std::lock_guard<std::mutex> lock(shard._mtx);
+			auto it = shard._map.find(key);
+			if (it != shard._map.end())
+				erase(shard, it->second);
+
+			shard._lru.push_front({key, std::move(value), bytes, clock::now()});
+			shard._map[key] = shard._lru.begin();
+			shard._bytes += bytes;
+			while (shard._bytes > _shardCapacity) {
+				erase(shard, std::prev(shard._lru.end()));
+				_evictions++;
+			}
+		}
+
+		// 清空所有分片, 统计的计数不清零
+		void clear() {
+			for (shard_t& shard : _shards) {
+				std::lock_guard<std::mutex> lock(shard._mtx);
+				shard._map.clear();
+				shard._lru.clear();
+				shard._bytes = 0;
+			}
+		}
+
+		cacheStats_t stats() {
+			cacheStats_t stats;
+			stats._hits = _hits;
+			stats._misses = _misses;
+			stats._evictions = _evictions;
+			stats._expirations = _expirations;
+			stats._entries = 0;
+			stats._bytes = 0;
+			for (shard_t& shard : _shards) {
+				std::lock_guard<std::mutex> lock(shard._mtx);
+				stats._entries += shard._map.size();
+				stats._bytes += shard._bytes;
+			}
+			return stats;
+		}
+
+	private:
+		typedef struct entry {
+			std::string _key;
+			V _value;
+			std::size_t _bytes;
+			clock::time_point _time; // 写入时间
+		} entry_t;
+
+		typedef struct shard {
+			std::mutex _mtx;
+			std::list<entry_t> _lru; // 头部是最近访问的条目
+			std::unordered_map<std::string, typename std::list<entry_t>::iterator> _map;
+			std::size_t _bytes;
+
+			shard()
+				: _bytes(0) {}
+		} shard_t;
+
+		shard_t& shardOf(const std::string& key) {
+			return _shards[ns_util::hashUtil::hash64(key.data(), key.size()) % _shards.size()];
+		}
+
+		static void erase(shard_t& shard, typename std::list<entry_t>::iterator entry) {
+			shard._bytes -= entry->_bytes;
+			shard._map.erase(entry->_key);
+			shard._lru.erase(entry);
+		}
+
+		std::vector<shard_t> _shards;
+		std::size_t _shardCapacity;
+		clock::duration _ttl;
+		std::atomic<std::uint64_t> _hits;
+		std::atomic<std::uint64_t> _misses;
+		std::atomic<std::uint64_t> _evictions;
+		std::atomic<std::uint64_t> _expirations;
+	};
+} // namespace ns_cache
@@ -0,0 +1,174 @@
+// 本文件定义 parser 增量解析所使用的 清单文件 和 增量文件
+//
+// 清单文件(data/output/raw.manifest) 记录上一次解析时 每个文档html文件的状态:
+//  路径 修改时间 文件大小 内容哈希, 以及 此文件解析出的记录 在 raw 中的偏移和长度
+// 再次解析时, 修改时间和大小都没有变化的文件 直接复用 raw 中已有的记录, 不需要再读取和去标签
+// 修改时间变化 但内容哈希没变的文件, 也只需要读取并计算哈希
+//
+// 每次解析 都会为生成的 raw 分配一个新的 版本号(generation), 记录在清单文件的第一行
+// 增量解析时, 还会生成增量文件(data/output/raw.delta), 记录 从上一版本的 raw 到新版本的 raw 的变化:
+//  D\3url\n                  删除url 对应的文档(文件被删除 或 内容改变)
+//  A\3title\3content\3url\n  添加一个文档(新增 或 内容改变的文件)
+// 索引快照中 也记录了建立索引时 raw 的版本号
+// 快照的版本号 与增量文件的起始版本号相同时, 索引只需要应用增量文件, 不需要对所有文档重新分词
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+namespace ns_manifest {
+	const char* const MANIFEST_SUFFIX = ".manifest";
+	const char* const DELTA_SUFFIX = ".delta";
+
+	const char* const MANIFEST_MAGIC = "BDSMANIFEST";
+	const char* const DELTA_MAGIC = "BDSDELTA";
+	const std::uint32_t MANIFEST_VERSION = 1;
+
+	const char SEP = '\3';
+	const char DELTA_ADD = 'A';
+	const char DELTA_DEL = 'D';
+
+	// 清单中 一个文件的记录
+	typedef struct fileEntry {
+		std::string _path;	   // 文件路径
+		std::int64_t _mtime;   // 修改时间, 单位纳秒
+		std::uint64_t _size;   // 文件大小
+		std::uint64_t _hash;   // 文件内容的哈希
+		std::uint64_t _offset; // 解析出的记录 在 raw 中的偏移
+		std::uint64_t _length; // 记录的长度(包括末尾的\n), 为0 表示此文件解析失败, 没有记录
+
+		fileEntry()
+			: _mtime(0)
+			, _size(0)
+			, _hash(0)
+			, _offset(0)
+			, _length(0) {}
+	} fileEntry_t;
+
+	typedef struct manifest {
+		std::uint64_t _generation; // raw 的版本号
+		std::uint64_t _rawSize;	   // raw 的大小, 用于检查 raw 是否与清单匹配
+		std::unordered_map<std::string, fileEntry_t> _entries;
+
+		manifest()
+			: _generation(0)
+			, _rawSize(0) {}
+	} manifest_t;
+
+	// 将以 SEP 分隔的一行 切分为若干字段
+	inline void splitFields(const std::string& line, std::vector<std::string>* fields) {
+		fields->clear();
+		std::size_t begin = 0;
+		while (true) {
+			std::size_t end = line.find(SEP, begin);
+			if (end == std::string::npos) {
+				fields->push_back(line.substr(begin));
+				return;
+			}
+			fields->push_back(line.substr(begin, end - begin));
+			begin = end + 1;
+		}
+	}
+
+	// 解析无符号整数字段, 字段为空 或 含有非数字字符时返回false
+	inline bool parseNumber(const std::string& field, std::uint64_t* value) {
+		if (field.empty())
+			return false;
+		char* end = nullptr;
+		*value = std::strtoull(field.c_str(), &end, 10);
+		return *end == '\0';
+	}
+
+	// 生成新的版本号
+	// 版本号只用来判断 快照、增量文件、raw 是否对应, 不需要递增, 只需要不与之前的重复
+	inline std::uint64_t newGeneration() {
+		std::random_device rd;
+		std::uint64_t generation = (static_cast<std::uint64_t>(rd()) << 32) ^ rd();
+		generation ^= static_cast<std::uint64_t>(time(nullptr)) << 20 ^ getpid();
+		// 0 表示没有版本号
+		return generation == 0 ? 1 : generation;
+	}
+
+	inline std::string manifestHeaderLine(std::uint64_t generation, std::uint64_t rawSize) {
+		return std::string(MANIFEST_MAGIC) + SEP + std::to_string(MANIFEST_VERSION) + SEP + std::to_string(generation) +
+			   SEP + std::to_string(rawSize) + '\n';
+	}
+
+	inline std::string manifestEntryLine(const fileEntry_t& entry) {
+		return entry._path + SEP + std::to_string(entry._mtime) + SEP + std::to_string(entry._size) + SEP +
+			   std::to_string(entry._hash) + SEP + std::to_string(entry._offset) + SEP + std::to_string(entry._length) +
+			   '\n';
+	}
+
+	inline std::string deltaHeaderLine(std::uint64_t fromGeneration, std::uint64_t toGeneration) {
+		return std::string(DELTA_MAGIC) + SEP + std::to_string(MANIFEST_VERSION) + SEP + std::to_string(fromGeneration) +
+			   SEP + std::to_string(toGeneration) + '\n';
+	}
+
+	// 读取清单文件的第一行, 获取 raw 的版本号和大小
+	inline bool readManifestHeader(std::istream& in, std::uint64_t* generation, std::uint64_t* rawSize) {
+		std::string line;
+		std::vector<std::string> fields;
+		std::uint64_t version = 0;
+		if (!std::getline(in, line))
+			return false;
+		splitFields(line, &fields);
+		return fields.size() == 4 && fields[0] == MANIFEST_MAGIC && parseNumber(fields[1], &version) &&
+			   version == MANIFEST_VERSION && parseNumber(fields[2], generation) && parseNumber(fields[3], rawSize);
+	}
+
+	// 获取 raw 的版本号, 清单文件不存在或无效时返回false
+	inline bool readGeneration(const std::string& manifestPath, std::uint64_t* generation) {
+		std::ifstream in(manifestPath, std::ios::in | std::ios::binary);
+		std::uint64_t rawSize = 0;
+		return in.is_open() && readManifestHeader(in, generation, &rawSize);
+	}
+
+	// 加载整个清单文件, 文件不存在或任何一行无效时返回false
+	inline bool loadManifest(const std::string& manifestPath, manifest_t* out) {
+		std::ifstream in(manifestPath, std::ios::in | std::ios::binary);
+		if (!in.is_open() || !readManifestHeader(in, &out->_generation, &out->_rawSize))
+			return false;
+
+		std::string line;
+		std::vector<std::string> fields;
+		while (std::getline(in, line)) {
+			splitFields(line, &fields);
+			fileEntry_t entry;
+			std::uint64_t mtime = 0;
+			if (fields.size() != 6 || !parseNumber(fields[1], &mtime) || !parseNumber(fields[2], &entry._size) ||
+				!parseNumber(fields[3], &entry._hash) || !parseNumber(fields[4], &entry._offset) ||
+				!parseNumber(fields[5], &entry._length))
+				return false;
+			// 记录必须在 raw 的范围内
+			if (entry._offset > out->_rawSize || entry._length > out->_rawSize - entry._offset)
+				return false;
+			entry._path = fields[0];
+			entry._mtime = mtime;
+			out->_entries[entry._path] = entry;
+		}
+
+		return true;
+	}
+
+	// 读取增量文件的第一行, 获取增量的起始版本号和目标版本号
+	inline bool readDeltaHeader(std::istream& in, std::uint64_t* fromGeneration, std::uint64_t* toGeneration) {
+		std::string line;
+		std::vector<std::string> fields;
+		std::uint64_t version = 0;
+		if (!std::getline(in, line))
+			return false;
+		splitFields(line, &fields);
+		return fields.size() == 4 && fields[0] == DELTA_MAGIC && parseNumber(fields[1], &version) &&
+			   version == MANIFEST_VERSION && parseNumber(fields[2], fromGeneration) &&
+			   parseNumber(fields[3], toGeneration);
+	}
+} // namespace ns_manifest
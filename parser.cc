@@ -1,22 +1,51 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "manifest.hpp"
 #include "util.hpp"
 
 // 此程序是一个文档解析器
 // boost文档的html文件中, 有许多的各种<>标签. 这些都是对搜索无关的内容, 所以需要清除掉
 // 本程序实现以下功能:
-//  1. 使用boost库提供的容器, 递归遍历 ./data/input 目录下(包括子目录)的所有文档html, 并保存其文件名到 vector中
-//  2. 通过 vector 中保存的 文档名, 找到文档 并对 所有文档的内容去标签
-//  3. 还是通过 vector中保存的文档名
-//     读取所有文档的内容,  以每个文档 标题 内容 url 结构构成一个docInfo结构体. 并以 vector 存储起来
-//  4. 将用vector 存储起来的所有文档的docInfo 存储到 ./data/output/raw 文件中, 每个文档的info用 \n 分割
+//  1. 使用boost库提供的容器, 递归遍历 ./data/input 目录下(包括子目录)的所有文档html
+//  2. 对 所有文档的内容去标签
+//  3. 以每个文档 标题 内容 url 结构构成一个docInfo结构体
+//  4. 将所有文档的docInfo 存储到 ./data/output/raw 文件中, 每个文档的info用 \n 分割
 // 至此 完成对所有文档的 解析
 
-//  为提高解析效率, 可以将 2 3 步骤合并为一个函数:
-//  每对一个文档html文件去标签之后, 就获取文档内容构成docInfo结构体, 并存储到 vector 中
+// 如果先获取所有文档名, 再解析所有文档并保存在 vector 中, 最后统一写入文件
+// 那么 整个文档库的内容 都要同时存在于内存中, 并且解析只能在一个线程中进行
+// 所以 将上面的步骤组织成流水线, 各个步骤同时进行:
+//  遍历线程: 递归遍历目录, 将 (序号, 文件名) 放入有界的任务队列中
+//  N个解析线程: 从任务队列中获取文件名, 读取文件 并解析 title content url
+//  写入线程(主线程): 按照序号 依次将解析结果写入文件
+// 解析线程完成的顺序是不确定的, 所以解析结果先放入 重排窗口 中, 写入线程按序号取出
+// 序号超出窗口的解析结果 需要等待写入线程写入之前的文档, 所以 内存中最多只会存在 窗口大小 个文档
+// 输出文件中 文档的顺序与遍历的顺序一致, 与单线程解析的结果相同
+
+// 增量解析
+// 文档库更新时, 通常只有少部分文件发生了变化, 但每次都要重新读取所有文件并去标签
+// 所以 每次解析都会同时写入清单文件 raw.manifest, 记录每个文件的 修改时间 大小 内容哈希 以及记录在 raw 中的位置
+// 下一次解析时:
+//  修改时间和大小都没变的文件, 直接从旧的 raw 中复制记录
+//  修改时间变了的文件, 读取并计算内容哈希, 哈希没变则同样复制旧记录, 否则重新解析
+//  清单中有 但已经不存在的文件, 它的记录不会再写入新的 raw
+// 同时生成增量文件 raw.delta, 记录被删除和新添加的文档, 索引可以只应用这些变化 而不需要重新建立
+// 清单文件的格式 见 manifest.hpp
 
 // 代码规范
 //  const & 表示输入型参数: const std::string&
@@ -31,38 +60,264 @@
 const std::string srcPath = "data/input";	  // 存放所有文档的目录
 const std::string output = "data/output/raw"; // 保存文档所有信息的文件
 
+const std::size_t TASK_QUEUE_DEPTH = 256;  // 任务队列 最多存放的文件名个数
+const std::size_t REORDER_WINDOW_PER_THREAD = 16; // 每个解析线程 对应的重排窗口大小
+
 typedef struct docInfo {
 	std::string _title;	  // 文档的标题
 	std::string _content; // 文档内容
 	std::string _url;	  // 该文档在官网中的url
 } docInfo_t;
 
-bool enumFile(const std::string& srcPath, std::vector<std::string>* filesList);
-bool parseDocInfo(const std::vector<std::string>& filesList, std::vector<docInfo_t>* docResults);
-bool saveDocInfo(const std::vector<docInfo_t>& docResults, const std::string& output);
+// 遍历线程 交给解析线程的任务
+typedef struct parseTask {
+	std::size_t _seq;							 // 文件的遍历序号, 写入时按此序号排序
+	ns_manifest::fileEntry_t _entry;			 // 文件路径 修改时间 大小
+	const ns_manifest::fileEntry_t* _oldEntry; // 上一次解析时 此文件在清单中的记录, 没有则为nullptr
+} parseTask_t;
+
+// 解析线程 交给写入线程的结果
+typedef struct parseResult {
+	enum status {
+		FAILED, // 读取或解析失败, 不写入记录
+		REUSED, // 文件没有变化, 复用旧 raw 中的记录
+		PARSED	// 重新解析得到的记录
+	};
+
+	status _status;
+	ns_manifest::fileEntry_t _entry;
+	const ns_manifest::fileEntry_t* _oldEntry;
+	bool _readOk; // 文件读取失败时 不写入清单, 下一次解析时重试
+	docInfo_t _doc;
+
+	parseResult()
+		: _status(FAILED)
+		, _oldEntry(nullptr)
+		, _readOk(false) {}
+} parseResult_t;
+
+// 上一次解析的结果: 清单 以及 mmap 映射的旧 raw
+// 清单无效 或 与 raw 的大小不匹配时, valid() 为false, 此时所有文件都需要重新解析
+class previousOutput {
+public:
+	previousOutput()
+		: _data(nullptr)
+		, _size(0) {}
+
+	~previousOutput() {
+		if (_data != nullptr)
+			munmap(const_cast<char*>(_data), _size);
+	}
+
+	bool load(const std::string& output) {
+		if (!ns_manifest::loadManifest(output + ns_manifest::MANIFEST_SUFFIX, &_manifest)) {
+			_manifest = ns_manifest::manifest_t();
+			return false;
+		}
+
+		int fd = open(output.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || static_cast<std::uint64_t>(st.st_size) != _manifest._rawSize || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+			return false;
+		_data = static_cast<const char*>(addr);
+		_size = st.st_size;
+
+		return true;
+	}
+
+	bool valid() const { return _data != nullptr; }
+	const ns_manifest::manifest_t& manifest() const { return _manifest; }
+
+	const ns_manifest::fileEntry_t* find(const std::string& path) const {
+		if (!valid())
+			return nullptr;
+		auto it = _manifest._entries.find(path);
+		return it == _manifest._entries.end() ? nullptr : &it->second;
+	}
+
+	// 旧 raw 中 entry 对应的记录
+	const char* record(const ns_manifest::fileEntry_t& entry) const { return _data + entry._offset; }
+
+private:
+	ns_manifest::manifest_t _manifest;
+	const char* _data;
+	std::size_t _size;
+};
+
+// 有界阻塞队列: 队列满时 push 阻塞, 队列空时 pop 阻塞
+// close() 之后, push 失败, pop 在取完剩余元素后返回false
+template <class T>
+class boundedQueue {
+public:
+	explicit boundedQueue(std::size_t capacity)
+		: _capacity(capacity)
+		, _closed(false) {}
+
+	bool push(T&& item) {
+		std::unique_lock<std::mutex> lock(_mtx);
+		_notFull.wait(lock, [this] { return _closed || _queue.size() < _capacity; });
+		if (_closed)
+			return false;
+		_queue.push_back(std::move(item));
+		_notEmpty.notify_one();
+		return true;
+	}
+
+	bool pop(T* item) {
+		std::unique_lock<std::mutex> lock(_mtx);
+		_notEmpty.wait(lock, [this] { return _closed || !_queue.empty(); });
+		if (_queue.empty())
+			return false;
+		*item = std::move(_queue.front());
+		_queue.pop_front();
+		_notFull.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(_mtx);
+		_closed = true;
+		_notFull.notify_all();
+		_notEmpty.notify_all();
+	}
+
+private:
+	std::deque<T> _queue;
+	std::size_t _capacity;
+	bool _closed;
+	std::mutex _mtx;
+	std::condition_variable _notFull;
+	std::condition_variable _notEmpty;
+};
+
+// 重排窗口: 解析线程以任意顺序放入解析结果, 写入线程按序号从小到大取出
+// 只接收序号在 [_next, _next + _window) 中的结果, 超出的需要等待
+// 任务队列是先进先出的, 序号为 _next 的任务一定已经被某个解析线程取走, 且它放入时不会等待, 所以不会死锁
+class reorderWindow {
+public:
+	explicit reorderWindow(std::size_t window)
+		: _window(window)
+		, _next(0)
+		, _total(0)
+		, _totalKnown(false) {}
+
+	// 放入序号为 seq 的解析结果
+	void put(std::size_t seq, parseResult_t&& result) {
+		std::unique_lock<std::mutex> lock(_mtx);
+		_notFull.wait(lock, [this, seq] { return seq < _next + _window; });
+		_pending[seq] = std::move(result);
+		if (seq == _next)
+			_ready.notify_one();
+	}
+
+	// 遍历结束后 设置文档总数
+	void setTotal(std::size_t total) {
+		std::lock_guard<std::mutex> lock(_mtx);
+		_total = total;
+		_totalKnown = true;
+		_ready.notify_one();
+	}
+
+	// 按序号取出下一个解析结果, 所有结果都已取出时返回false
+	bool take(parseResult_t* result) {
+		std::unique_lock<std::mutex> lock(_mtx);
+		_ready.wait(lock, [this] {
+			return (_totalKnown && _next == _total) || (!_pending.empty() && _pending.begin()->first == _next);
+		});
+		if (_totalKnown && _next == _total)
+			return false;
+
+		auto it = _pending.begin();
+		*result = std::move(it->second);
+		_pending.erase(it);
+		_next++;
+		_notFull.notify_all();
+		return true;
+	}
+
+private:
+	std::map<std::size_t, parseResult_t> _pending; // 已解析 但还未写入的文档
+	std::size_t _window;
+	std::size_t _next;	// 下一个要写入的文档序号
+	std::size_t _total; // 遍历到的文档总数
+	bool _totalKnown;
+	std::mutex _mtx;
+	std::condition_variable _notFull;
+	std::condition_variable _ready;
+};
+
+bool enumFile(const std::string& srcPath, const previousOutput& previous, boundedQueue<parseTask_t>* taskQueue,
+			  std::size_t* total);
+bool parseDocInfo(const std::string& filePath, const std::string& fileContent, docInfo_t* doc);
+void parseWorker(boundedQueue<parseTask_t>* taskQueue, reorderWindow* window);
+bool saveDocInfo(reorderWindow* window, const previousOutput& previous, const std::string& output);
+
+int main(int argc, char* argv[]) {
+	// 解析线程数 默认为CPU核心数, 也可以通过第一个参数指定
+	std::size_t threadNum = std::max(1u, std::thread::hardware_concurrency());
+	if (argc > 1 && std::atoi(argv[1]) > 0) {
+		threadNum = std::atoi(argv[1]);
+	}
 
-int main() {
-	std::vector<std::string> filesList;
-	// 1. 递归式的把每个html文件名带路径，保存到filesList中，方便后期进行一个一个的文件进行读取
-	if (!enumFile(srcPath, &filesList)) {
-		// 获取文档html文件名失败
+	if (!boost::filesystem::exists(srcPath)) {
+		// 指定的路径不存在
+		std::cerr << srcPath << " is not exists" << std::endl;
 		std::cerr << "Failed to enum file name!" << std::endl;
 		return ENUM_ERROR;
 	}
 
-	// 走到这里 获取所有文档html文件名成功
-	// 2. 按照filesList读取每个文档的内容，并进行去标签解析
-	// 3. 并获取文档的内容 以 标题 内容 url 构成docInfo结构体, 存储到vector中
-	std::vector<docInfo_t> docResults;
-	if (!parseDocInfo(filesList, &docResults)) {
-		// 解析文档内容失败
-		std::cerr << "Failed to parse document information!" << std::endl;
-		return PARSEINFO_ERROR;
+	// 加载上一次解析的清单, 加载成功则进行增量解析
+	previousOutput previous;
+	if (previous.load(output)) {
+		std::cout << "Incremental parse based on " << output << ns_manifest::MANIFEST_SUFFIX << std::endl;
+	}
+
+	boundedQueue<parseTask_t> taskQueue(TASK_QUEUE_DEPTH);
+	reorderWindow window(threadNum * REORDER_WINDOW_PER_THREAD);
+
+	// 1. 遍历线程: 递归式的把每个html文件名带路径，放入任务队列中
+	bool enumOk = true;
+	std::thread walker([&] {
+		std::size_t total = 0;
+		enumOk = enumFile(srcPath, previous, &taskQueue, &total);
+		taskQueue.close();
+		window.setTotal(total);
+	});
+
+	// 2. 解析线程: 从任务队列中获取文件名, 判断文件是否变化; 变化了则读取文件内容 去标签 并构成docInfo结构体, 放入重排窗口
+	std::vector<std::thread> workers;
+	for (std::size_t i = 0; i < threadNum; i++) {
+		workers.push_back(std::thread(parseWorker, &taskQueue, &window));
+	}
+
+	// 3. 写入(主线程): 把解析完毕的各个文件内容 按遍历顺序写入到output , 按照\3作为每个文档的分割符
+	bool saveOk = saveDocInfo(&window, previous, output);
+	if (!saveOk) {
+		// 写入失败时, 关闭任务队列 让遍历线程和解析线程尽快结束
+		taskQueue.close();
+		parseResult_t result;
+		while (window.take(&result)) {
+		}
+	}
+
+	walker.join();
+	for (std::thread& worker : workers) {
+		worker.join();
 	}
 
-	// 走到这里 获取所有文档内容 并以 docInfo 结构体形式存储到vector中成功
-	// 4: 把解析完毕的各个文件内容，写入到output , 按照\3作为每个文档的分割符
-	if (!saveDocInfo(docResults, output)) {
+	if (!enumOk) {
+		std::cerr << "Failed to enum file name!" << std::endl;
+		return ENUM_ERROR;
+	}
+	if (!saveOk) {
 		std::cerr << "Failed to save document information!" << std::endl;
 		return SAVEINFO_ERROR;
 	}
@@ -70,7 +325,8 @@ int main() {
 	return 0;
 }
 
-bool enumFile(const std::string& srcPath, std::vector<std::string>* filesList) {
+bool enumFile(const std::string& srcPath, const previousOutput& previous, boundedQueue<parseTask_t>* taskQueue,
+			  std::size_t* total) {
 	// 使用 boost库 来对路径下的文档html进行 递归遍历
 	namespace bs_fs = boost::filesystem;
 
@@ -100,8 +356,23 @@ bool enumFile(const std::string& srcPath, std::vector<std::string>* filesList) {
 		//		std::cout << "Debug:  " << iter->path().string() << std::endl;
 
 		// 走到这里的都是 .html 文件
-		// 将 文件名存储到 filesList 中
-		filesList->push_back(iter->path().string());
+		// 获取文件的修改时间和大小, 并查找上一次解析时的记录, 供解析线程判断文件是否变化
+		parseTask_t task;
+		task._seq = *total;
+		task._entry._path = iter->path().string();
+		struct stat st;
+		if (stat(task._entry._path.c_str(), &st) == 0) {
+			task._entry._mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+			task._entry._size = st.st_size;
+		}
+		task._oldEntry = previous.find(task._entry._path);
+
+		// 将 任务放入任务队列中, 队列满时会等待解析线程取走任务
+		if (!taskQueue->push(std::move(task))) {
+			// 任务队列已关闭, 不需要再遍历了
+			break;
+		}
+		(*total)++;
 	}
 
 	return true;
@@ -144,6 +415,7 @@ bool parseContent(const std::string& fileContent, std::string* content) {
 	};
 
 	enum status s = LABLE; // 因为首先的状态一定是在标签内
+	content->reserve(fileContent.size());
 	for (auto c : fileContent) {
 		switch (s) {
 			case LABLE: {
@@ -199,77 +471,220 @@ static void ShowDoc(const docInfo_t& doc) {
 	std::cout << "url: " << doc._url << std::endl;
 }
 
-bool parseDocInfo(const std::vector<std::string>& filesList, std::vector<docInfo_t>* docResults) {
+// 以二进制方式读取整个文件, 用于计算内容哈希
+bool readFileContent(const std::string& filePath, std::string* out) {
+	std::ifstream in(filePath, std::ios::in | std::ios::binary);
+	if (!in.is_open()) {
+		LOG(WARNING, "Failed to open %s !", filePath.c_str());
+		return false;
+	}
+	in.seekg(0, std::ios::end);
+	out->resize(in.tellg());
+	in.seekg(0, std::ios::beg);
+	in.read(&(*out)[0], out->size());
+
+	return static_cast<bool>(in);
+}
+
+bool parseDocInfo(const std::string& filePath, const std::string& fileContent, docInfo_t* doc) {
 	// parseDocInfo 是对文档html文件的内容做去标签化 并 获取 title content url 构成结构体
-	// 文档的路径都在 filesList 中存储着, 所以需要遍历 filesList 处理文件
-	for (const std::string& filePath : filesList) {
-		// 获取到文档html的路径之后, 就需要对 html文件进行去标签化等一系列解析操作了
 
-		// 1. 读取文件内容到 string 中
-		std::string fileContent;
-		if (!ns_util::fileUtil::readFile(filePath, &fileContent)) {
-			// 读取文件内容失败
-			continue;
-		}
+	// 读取到文档html文件内容之后, 就可以去标签 并且 获取 title content 和 url了
+	// 1. 解析并获取title, html文件中只有一个 title标签, 所以再去标签之前 获取title比较方便
+	if (!parseTitle(fileContent, &doc->_title)) {
+		// 解析title失败
+		return false;
+	}
 
-		// 读取到文档html文件内容之后, 就可以去标签 并且 获取 title content 和 url了
-		docInfo_t doc;
-		// 2. 解析并获取title, html文件中只有一个 title标签, 所以再去标签之前 获取title比较方便
-		if (!parseTitle(fileContent, &doc._title)) {
-			// 解析title失败
-			continue;
-		}
+	// 2. 解析并获取文档有效内容, 去标签的操作实际就是在这一步进行的
+	if (!parseContent(fileContent, &doc->_content)) {
+		// 解析文档有效内容失败
+		return false;
+	}
+
+	// 3. 获取 官网的对应文档的 url
+	if (!parseUrl(filePath, &doc->_url)) {
+		return false;
+	}
+
+	//	ShowDoc(*doc);
+	return true;
+}
 
-		// 3. 解析并获取文档有效内容, 去标签的操作实际就是在这一步进行的
-		if (!parseContent(fileContent, &doc._content)) {
-			// 解析文档有效内容失败
+void parseWorker(boundedQueue<parseTask_t>* taskQueue, reorderWindow* window) {
+	parseTask_t task;
+	while (taskQueue->pop(&task)) {
+		parseResult_t result;
+		result._entry = task._entry;
+		result._oldEntry = task._oldEntry;
+		const ns_manifest::fileEntry_t* oldEntry = task._oldEntry;
+
+		// 修改时间和大小都没有变化, 认为文件没有变化, 不需要读取
+		if (oldEntry != nullptr && oldEntry->_mtime == task._entry._mtime && oldEntry->_size == task._entry._size) {
+			result._status = parseResult_t::REUSED;
+			result._readOk = true;
+			result._entry._hash = oldEntry->_hash;
+			window->put(task._seq, std::move(result));
 			continue;
 		}
 
-		// 4. 获取 官网的对应文档的 url
-		if (!parseUrl(filePath, &doc._url)) {
-			continue;
+		// 1. 读取文件内容到 string 中
+		std::string fileContent;
+		result._readOk = readFileContent(task._entry._path, &fileContent);
+		if (result._readOk) {
+			result._entry._size = fileContent.size();
+			result._entry._hash = ns_util::hashUtil::hash64(fileContent.data(), fileContent.size());
+			if (oldEntry != nullptr && oldEntry->_size == result._entry._size && oldEntry->_hash == result._entry._hash) {
+				// 只是修改时间变了, 内容没有变化
+				result._status = parseResult_t::REUSED;
+			}
+			else {
+				// 与 fileUtil::readFile 按行读取拼接的结果保持一致, 去掉所有的 \n
+				fileContent.erase(std::remove(fileContent.begin(), fileContent.end(), '\n'), fileContent.end());
+				if (parseDocInfo(task._entry._path, fileContent, &result._doc))
+					result._status = parseResult_t::PARSED;
+			}
 		}
 
-		//		ShowDoc(doc);
-		// 做完上面的一系列操作 走到这里时 如果没有不过 doc 应该已经被填充完毕了
-		// doc出此次循环时就要被销毁了, 所以将doc 设置为将亡值 可以防止拷贝构造的发生 而使用移动语义来向 vector中添加元素
-		// 这里发生拷贝构造是非常的消耗资源的 因为 doc._content 非常的大
-		docResults->push_back(std::move(doc));
+		// 解析失败的文档 也需要放入重排窗口, 写入线程才能跳过它继续写入之后的文档
+		// doc._content 非常的大, 所以使用移动语义 防止拷贝
+		window->put(task._seq, std::move(result));
 	}
-
-	return true;
 }
 
-bool saveDocInfo(const std::vector<docInfo_t>& docResults, const std::string& output) {
+bool saveDocInfo(reorderWindow* window, const previousOutput& previous, const std::string& output) {
 	// 最后就是将 已经结构化的所有的文档数据, 以一定的格式存储在指定的文件中.
 	// 以什么格式存储呢? 每个文档都是结构化的数据: _title _content _url.
 	// 我们可以将 三个字段以'\3'分割, 不过 _url后不用'\3' 而是用'\n'
 	// 因为, 像文件中写入不能只关心写入, 还要考虑读取时的问题. 方便的 读取文本文件, 通常可以用 getline 来获取一行数据
 	// 所以, 当以这种格式 (_title\3_content\3_url\n) 将 文档数据存储到文件中时, getline() 成功读取一次文件内容, 获取的就是一个文档的所有有效内容.
 
+	// 同时写入新的清单文件, 如果是增量解析 还要写入增量文件
+	// 三个文件都先写入临时文件, 全部写入成功之后再 rename, 防止解析中断时 raw 与清单不匹配
+	const std::string manifestPath = output + ns_manifest::MANIFEST_SUFFIX;
+	const std::string deltaPath = output + ns_manifest::DELTA_SUFFIX;
+	const std::string tmpSuffix = ".tmp";
+
 	// 按照二进制方式进行写入, 二进制写入, 写入什么就是什么 转义字符也不会出现被优化改变的现象
-	std::ofstream out(output, std::ios::out | std::ios::binary);
+	std::ofstream out(output + tmpSuffix, std::ios::out | std::ios::binary | std::ios::trunc);
 	if (!out.is_open()) {
 		// 文件打开失败
-		std::cerr << "open " << output << " failed!" << std::endl;
+		std::cerr << "open " << output << tmpSuffix << " failed!" << std::endl;
 		return false;
 	}
 
+	const std::uint64_t generation = ns_manifest::newGeneration();
+	std::ofstream deltaOut;
+	if (previous.valid()) {
+		deltaOut.open(deltaPath + tmpSuffix, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!deltaOut.is_open()) {
+			std::cerr << "open " << deltaPath << tmpSuffix << " failed!" << std::endl;
+			return false;
+		}
+		deltaOut << ns_manifest::deltaHeaderLine(previous.manifest()._generation, generation);
+	}
+
+	// 清单的第一行需要记录 raw 的大小, 所以先将清单内容记录在 string 中, 最后再写入
+	std::string manifestBody;
+	std::unordered_set<std::string> seenPaths;
+	std::uint64_t rawSize = 0;
+	std::size_t parsedCnt = 0, reusedCnt = 0, failedCnt = 0, removedCnt = 0;
+
 	// 就可以进行文件内容的写入了
-	for (auto& item : docResults) {
-		std::string outStr;
-		outStr = item._title;
-		outStr += SEP;
-		outStr += item._content;
-		outStr += SEP;
-		outStr += item._url;
-		outStr += '\n';
+	// 按遍历顺序 从重排窗口中取出解析结果, 写入之后就可以释放
+	parseResult_t result;
+	std::string outStr;
+	std::string url;
+	while (window->take(&result)) {
+		ns_manifest::fileEntry_t& entry = result._entry;
+		const ns_manifest::fileEntry_t* oldEntry = result._oldEntry;
+		if (previous.valid())
+			seenPaths.insert(entry._path);
+
+		entry._offset = rawSize;
+		entry._length = 0;
+		if (result._status == parseResult_t::REUSED) {
+			// 文件没有变化, 直接复制旧 raw 中的记录
+			entry._length = oldEntry->_length;
+			out.write(previous.record(*oldEntry), oldEntry->_length);
+			reusedCnt++;
+		}
+		else {
+			// 文件是新增的 或 内容变化了, 旧记录需要从索引中删除
+			if (deltaOut.is_open() && oldEntry != nullptr && oldEntry->_length > 0) {
+				parseUrl(oldEntry->_path, &url);
+				deltaOut << ns_manifest::DELTA_DEL << SEP << url << '\n';
+			}
 
-		out.write(outStr.c_str(), outStr.size());
+			if (result._status == parseResult_t::PARSED) {
+				const docInfo_t& item = result._doc;
+				outStr = item._title;
+				outStr += SEP;
+				outStr += item._content;
+				outStr += SEP;
+				outStr += item._url;
+				outStr += '\n';
+
+				out.write(outStr.c_str(), outStr.size());
+				entry._length = outStr.size();
+				if (deltaOut.is_open())
+					deltaOut << ns_manifest::DELTA_ADD << SEP << outStr;
+				parsedCnt++;
+			}
+			else {
+				failedCnt++;
+			}
+		}
+		if (!out || (deltaOut.is_open() && !deltaOut)) {
+			std::cerr << "write " << output << " failed!" << std::endl;
+			return false;
+		}
+
+		rawSize += entry._length;
+		// 读取失败的文件 不记录在清单中, 下一次解析时会重新读取
+		if (result._readOk)
+			manifestBody += ns_manifest::manifestEntryLine(entry);
 	}
 
+	// 清单中有记录, 但这次没有遍历到的文件 已经被删除了
+	if (deltaOut.is_open()) {
+		for (const auto& oldEntry : previous.manifest()._entries) {
+			if (oldEntry.second._length > 0 && seenPaths.find(oldEntry.first) == seenPaths.end()) {
+				parseUrl(oldEntry.first, &url);
+				deltaOut << ns_manifest::DELTA_DEL << SEP << url << '\n';
+				removedCnt++;
+			}
+		}
+		deltaOut.close();
+	}
 	out.close();
 
+	std::ofstream manifestOut(manifestPath + tmpSuffix, std::ios::out | std::ios::binary | std::ios::trunc);
+	manifestOut << ns_manifest::manifestHeaderLine(generation, rawSize) << manifestBody;
+	manifestOut.close();
+	if (!out || !deltaOut || !manifestOut) {
+		std::cerr << "write " << output << " failed!" << std::endl;
+		return false;
+	}
+
+	// 没有增量文件时, 删除之前的增量文件, 它已经不能应用到新的 raw 上了
+	if (previous.valid()) {
+		if (rename((deltaPath + tmpSuffix).c_str(), deltaPath.c_str()) != 0) {
+			std::cerr << "rename " << deltaPath << " failed!" << std::endl;
+			return false;
+		}
+	}
+	else {
+		unlink(deltaPath.c_str());
+	}
+	if (rename((output + tmpSuffix).c_str(), output.c_str()) != 0 ||
+		rename((manifestPath + tmpSuffix).c_str(), manifestPath.c_str()) != 0) {
+		std::cerr << "rename " << output << " failed!" << std::endl;
+		return false;
+	}
+
+	std::cout << "parsed: " << parsedCnt << ", reused: " << reusedCnt << ", failed: " << failedCnt
+			  << ", removed: " << removedCnt << std::endl;
+
 	return true;
 }
@@ -0,0 +1,372 @@
+// 本文件实现 压缩存储的倒排拉链
+
+// 倒排拉链中的每个倒排元素都需要记录 文档id 和 权重
+// 如果直接用 vector 存储结构体, 每个元素都要占用十几甚至几十个字节, 倒排索引的内存占用会非常大
+// 而倒排拉链中的文档id 是递增的, 相邻文档id 之差通常很小; 权重通常也很小
+// 所以, 可以只存储相邻文档id 的差值(delta), 并将 差值和权重 都以 varint 编码:
+//  varint 每个字节的低7位存储数据, 最高位表示后面是否还有字节. 小于128的数只需要1个字节
+// 这样 大部分倒排元素只需要 2~3个字节
+//
+// 为了可以跳过不需要的部分, 倒排拉链每 POSTING_BLOCK_SIZE 个元素划分为一块
+// 每块记录 块中最后一个文档id 和 块数据在 _data 中的偏移. 块的第一个差值 是相对于前一块最后一个文档id 计算的
+// 这样 只要知道前一块的最后一个文档id, 就可以从任意一块开始解码
+// 每块还记录了块中的最大权重, 搜索时 可以据此判断整块文档是否有可能进入结果, 不可能的块直接跳过
+//
+// 短语查询还需要知道 关键字在文档中出现的位置. 位置信息单独存储在 _positions 中, 不与 文档id和权重 交错存储
+// 这样 普通查询遍历倒排拉链时 完全不需要读取位置信息
+// 每个倒排元素的位置信息为: 位置个数, 以及 各位置与前一个位置的差值(第一个位置直接存储), 都以 varint 编码
+// 每块记录 块中第一个倒排元素的位置信息 在 _positions 中的偏移, 读取时 只需要从块的起点 跳过块内前面的元素
+//
+// 从索引快照加载的倒排拉链 不复制数据, 块信息、编码数据 和位置信息 都直接指向快照的映射(见 index.hpp 的 loadSnapshot)
+// 这样的倒排拉链 在第一次修改(追加元素 或 重新计算权重)之前, 才将数据复制到自己的 vector 中
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+#include "arrayRef.hpp"
+
+namespace ns_index {
+	const std::size_t POSTING_BLOCK_SIZE = 128;
+
+
+	// 用于倒排索引中 记录关键字对应的文档id和权重
+	// 关键字本身就是倒排索引的 key, 所以不需要在每个倒排元素中重复存储
+	typedef struct invertedElem {
+		std::size_t _docId;	   // 文档id
+		std::uint64_t _weight; // 搜索此关键字, 此文档id 所占权重
+
+		invertedElem() // 权重初始化为0
+			: _docId(0)
+			, _weight(0) {}
+	} invertedElem_t;
+
+	// 倒排拉链中 块的信息
+	typedef struct postingBlock {
+		std::uint32_t _lastDocId; // 块中最后一个文档id
+		std::uint32_t _offset;	  // 块数据在 _data 中的起始偏移
+		std::uint32_t _maxWeight; // 块中的最大权重
+		std::uint32_t _posOffset; // 块中第一个倒排元素的位置信息 在 _positions 中的起始偏移
+	} postingBlock_t;
+
+	inline void encodeVarint(std::uint32_t value, std::vector<std::uint8_t>* out) {
+		while (value >= 0x80) {
+			out->push_back(static_cast<std::uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		out->push_back(static_cast<std::uint8_t>(value));
+	}
+
+	inline std::uint32_t decodeVarint(const std::uint8_t*& p) {
+		std::uint32_t value = *p & 0x7f;
+		int shift = 7;
+		while (*p++ & 0x80) {
+			value |= static_cast<std::uint32_t>(*p & 0x7f) << shift;
+			shift += 7;
+		}
+
+		return value;
+	}
+
+	// 跳过一个倒排元素的位置信息
+	inline void skipPositions(const std::uint8_t*& p) {
+		std::uint32_t count = decodeVarint(p);
+		for (std::uint32_t i = 0; i < count; i++) {
+			while (*p++ & 0x80) {
+			}
+		}
+	}
+
+	class postingList {
+	public:
+		// 倒排拉链的迭代器, 在遍历时解码, 不需要将整条倒排拉链解码出来
+		class iterator {
+		public:
+			typedef std::input_iterator_tag iterator_category;
+			typedef invertedElem_t value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef const invertedElem_t* pointer;
+			typedef const invertedElem_t& reference;
+
+			iterator(const postingList* list, std::size_t pos)
+				: _list(list)
+				, _blocks(list->blocks())
+				, _data(list->data().data())
+				, _positions(list->positions().data())
+				, _pos(pos)
+				, _p(nullptr)
+				, _posIndex(0)
+				, _posP(nullptr) {
+				if (_pos < _list->_size) {
+					_p = _data;
+					_elem._docId = 0;
+					decode();
+				}
+			}
+
+			const invertedElem_t& operator*() const { return _elem; }
+			const invertedElem_t* operator->() const { return &_elem; }
+
+			iterator& operator++() {
+				if (++_pos < _list->_size) {
+					decode();
+				}
+				return *this;
+			}
+
+			bool operator==(const iterator& it) const { return _pos == it._pos; }
+			bool operator!=(const iterator& it) const { return _pos != it._pos; }
+
+			// 是否还指向有效的倒排元素
+			bool valid() const { return _pos < _list->_size; }
+
+			// 移动到第一个 文档id >= target 的倒排元素, 没有则移动到末尾
+			// 当前块的最后一个文档id 小于target 时, 通过块信息直接跳到目标块, 不需要解码中间的块
+			void nextGEQ(std::uint32_t target) {
+				if (!valid() || _elem._docId >= target)
+					return;
+
+				std::size_t block = _pos / POSTING_BLOCK_SIZE;
+				if (_blocks[block]._lastDocId < target) {
+					block = findBlock(block + 1, target);
+					if (block == _blocks.size()) {
+						_pos = _list->_size;
+						return;
+					}
+					_pos = block * POSTING_BLOCK_SIZE;
+					_p = _data + _blocks[block]._offset;
+					_elem._docId = _blocks[block - 1]._lastDocId;
+					decode();
+				}
+				// 目标块的最后一个文档id >= target, 所以一定会在块内停下
+				while (_elem._docId < target) {
+					++*this;
+				}
+			}
+
+			// 获取 target 所在的块(即当前位置之后 第一个最后文档id >= target 的块) 的信息, 不移动迭代器
+			// 用于估计 target 附近文档的权重上限, 没有这样的块时返回nullptr
+			const postingBlock_t* shallowBlock(std::uint32_t target) const {
+				if (!valid())
+					return nullptr;
+				std::size_t block = _pos / POSTING_BLOCK_SIZE;
+				if (_blocks[block]._lastDocId < target) {
+					block = findBlock(block + 1, target);
+				}
+				return block == _blocks.size() ? nullptr : &_blocks[block];
+			}
+
+			// 解码当前倒排元素的 所有位置, 位置是递增的
+			// 记录了上一次读取到的位置信息, 迭代器在同一块内 向后移动时, 只需要从上一次读取的地方继续跳过
+			void positions(std::vector<std::uint32_t>* out) {
+				out->clear();
+				std::size_t block = _pos / POSTING_BLOCK_SIZE;
+				if (nullptr == _posP || _posIndex > _pos || _posIndex / POSTING_BLOCK_SIZE != block) {
+					_posIndex = block * POSTING_BLOCK_SIZE;
+					_posP = _positions + _blocks[block]._posOffset;
+				}
+				for (; _posIndex < _pos; _posIndex++) {
+					skipPositions(_posP);
+				}
+
+				std::uint32_t count = decodeVarint(_posP);
+				std::uint32_t position = 0;
+				for (std::uint32_t i = 0; i < count; i++) {
+					position += decodeVarint(_posP);
+					out->push_back(position);
+				}
+				_posIndex++;
+			}
+
+		private:
+			// 在 [from, 块数) 中查找 第一个最后文档id >= target 的块
+			// 求交集时 target 通常就在当前块之后不远, 所以先从 from 开始 以 1 2 4 8 ... 的步长向后试探(galloping)
+			// 找到包含目标的范围之后 再在范围内二分, 比较次数与 跳过的块数 的对数成正比, 而不是与 总块数 的对数成正比
+			std::size_t findBlock(std::size_t from, std::uint32_t target) const {
+				std::size_t low = from, step = 1, high = from;
+				while (high < _blocks.size() && _blocks[high]._lastDocId < target) {
+					low = high + 1;
+					high += step;
+					step <<= 1;
+				}
+				high = std::min(high, _blocks.size());
+				return std::lower_bound(_blocks.begin() + low, _blocks.begin() + high, target,
+										[](const postingBlock_t& block, std::uint32_t docId) {
+											return block._lastDocId < docId;
+										}) -
+					   _blocks.begin();
+			}
+
+			void decode() {
+				_elem._docId += decodeVarint(_p);
+				_elem._weight = decodeVarint(_p);
+			}
+
+			const postingList* _list;
+			// 迭代期间 倒排拉链不会被修改, 所以在创建时 取得数据的位置, 不需要每次都判断数据是否来自快照
+			arrayRef<postingBlock_t> _blocks;
+			const std::uint8_t* _data;
+			const std::uint8_t* _positions;
+			std::size_t _pos;		 // 当前倒排元素 在倒排拉链中的序号
+			const std::uint8_t* _p;	 // 下一个倒排元素的编码位置
+			invertedElem_t _elem;	 // 当前倒排元素
+			std::size_t _posIndex;	 // _posP 指向的是 第几个倒排元素的位置信息
+			const std::uint8_t* _posP;
+		};
+
+		postingList()
+			: _size(0)
+			, _lastDocId(0)
+			, _maxWeight(0)
+			, _mapped(false) {}
+
+		// 向倒排拉链末尾添加倒排元素, docId 必须大于已有的所有文档id, positions 为关键字在文档中出现的位置 必须递增
+		void append(std::uint32_t docId, std::uint64_t weight, const std::vector<std::uint32_t>& positions) {
+			own();
+			if (_size % POSTING_BLOCK_SIZE == 0) {
+				postingBlock_t block;
+				block._lastDocId = docId;
+				block._offset = _data.size();
+				block._maxWeight = 0;
+				block._posOffset = _positions.size();
+				_blocks.push_back(block);
+			}
+			std::uint32_t quantized =
+				weight < std::numeric_limits<std::uint32_t>::max() ? weight : std::numeric_limits<std::uint32_t>::max();
+			encodeVarint(docId - _lastDocId, &_data);
+			encodeVarint(quantized, &_data);
+			encodeVarint(positions.size(), &_positions);
+			std::uint32_t lastPosition = 0;
+			for (std::uint32_t position : positions) {
+				encodeVarint(position - lastPosition, &_positions);
+				lastPosition = position;
+			}
+			_blocks.back()._lastDocId = docId;
+			_blocks.back()._maxWeight = std::max(_blocks.back()._maxWeight, quantized);
+			_maxWeight = std::max(_maxWeight, quantized);
+			_lastDocId = docId;
+			_size++;
+		}
+
+		// 将另一条倒排拉链 追加到末尾, list 的文档id 必须都大于本拉链的文档id
+		void append(const postingList& list) {
+			std::vector<std::uint32_t> positions;
+			for (iterator it = list.begin(); it.valid(); ++it) {
+				it.positions(&positions);
+				append(it->_docId, it->_weight, positions);
+			}
+		}
+
+		// 将文档id >= firstDocId 的倒排元素的权重 替换为 rescore(docId, 原权重), 并重新计算块的最大权重
+		// 只需要重新编码 文档id差值与权重, 位置信息 与 块中的位置偏移 都不变
+		template <class Fn>
+		void rescore(std::uint32_t firstDocId, Fn rescore) {
+			if (_size == 0 || _lastDocId < firstDocId)
+				return;
+			own();
+			std::vector<std::uint8_t> data;
+			data.reserve(_data.size());
+			const std::uint8_t* p = _data.data();
+			std::uint32_t docId = 0;
+			_maxWeight = 0;
+			for (std::size_t i = 0; i < _size; i++) {
+				postingBlock_t& block = _blocks[i / POSTING_BLOCK_SIZE];
+				if (i % POSTING_BLOCK_SIZE == 0) {
+					block._offset = data.size();
+					block._maxWeight = 0;
+				}
+				std::uint32_t delta = decodeVarint(p);
+				std::uint32_t weight = decodeVarint(p);
+				docId += delta;
+				if (docId >= firstDocId)
+					weight = rescore(docId, weight);
+				encodeVarint(delta, &data);
+				encodeVarint(weight, &data);
+				block._maxWeight = std::max(block._maxWeight, weight);
+				_maxWeight = std::max(_maxWeight, weight);
+			}
+			_data.swap(data);
+		}
+
+		// 建立完成之后, 释放 vector 多余的容量
+		void shrink() {
+			_data.shrink_to_fit();
+			_blocks.shrink_to_fit();
+			_positions.shrink_to_fit();
+		}
+
+		iterator begin() const { return iterator(this, 0); }
+		iterator end() const { return iterator(this, _size); }
+
+		std::size_t size() const { return _size; }
+		bool empty() const { return _size == 0; }
+		// 整条倒排拉链中的最大权重
+		std::uint32_t maxWeight() const { return _maxWeight; }
+
+		// 编码后的数据, 指向快照的映射 或 自己的 vector. 也用于 保存索引快照
+		arrayRef<std::uint8_t> data() const { return _mapped ? _mappedData : arrayRef<std::uint8_t>(_data); }
+		arrayRef<postingBlock_t> blocks() const { return _mapped ? _mappedBlocks : arrayRef<postingBlock_t>(_blocks); }
+		arrayRef<std::uint8_t> positions() const {
+			return _mapped ? _mappedPositions : arrayRef<std::uint8_t>(_positions);
+		}
+
+		// 直接使用快照映射中 已编码的数据, 不复制. 映射必须比倒排拉链存活得更久
+		// 只检查块信息, 不读取编码数据, 块信息无效时返回false
+		// 编码数据本身 由快照的校验和保证, 见 index.hpp 的 loadSnapshot
+		bool map(std::uint32_t size, arrayRef<postingBlock_t> blocks, arrayRef<std::uint8_t> data,
+				 arrayRef<std::uint8_t> positions) {
+			if (blocks.size() != (size + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE)
+				return false;
+			for (std::size_t i = 0; i < blocks.size(); i++) {
+				if (blocks[i]._offset >= data.size() || blocks[i]._posOffset >= positions.size() ||
+					(i > 0 && blocks[i]._lastDocId <= blocks[i - 1]._lastDocId))
+					return false;
+			}
+
+			_data.clear();
+			_blocks.clear();
+			_positions.clear();
+			_mappedBlocks = blocks;
+			_mappedData = data;
+			_mappedPositions = positions;
+			_mapped = true;
+			_size = size;
+			_lastDocId = blocks.empty() ? 0 : blocks.back()._lastDocId;
+			_maxWeight = 0;
+			for (const postingBlock_t& block : blocks) {
+				_maxWeight = std::max(_maxWeight, block._maxWeight);
+			}
+			return true;
+		}
+
+	private:
+		// 写时复制: 数据来自快照映射时, 修改之前 先复制到自己的 vector 中
+		void own() {
+			if (!_mapped)
+				return;
+			_blocks.assign(_mappedBlocks.begin(), _mappedBlocks.end());
+			_data.assign(_mappedData.begin(), _mappedData.end());
+			_positions.assign(_mappedPositions.begin(), _mappedPositions.end());
+			_mappedBlocks = arrayRef<postingBlock_t>();
+			_mappedData = arrayRef<std::uint8_t>();
+			_mappedPositions = arrayRef<std::uint8_t>();
+			_mapped = false;
+		}
+
+		std::vector<std::uint8_t> _data;	  // 编码后的 文档id差值 与 权重
+		std::vector<postingBlock_t> _blocks; // 块信息
+		std::vector<std::uint8_t> _positions; // 编码后的 位置信息
+		std::uint32_t _size;				  // 倒排元素个数
+		std::uint32_t _lastDocId;			  // 最后一个文档id, 用于计算追加元素的差值
+		std::uint32_t _maxWeight;			  // 最大权重
+		// _mapped 为 true 时, 数据在快照的映射中, 三个 vector 都为空
+		bool _mapped;
+		arrayRef<postingBlock_t> _mappedBlocks;
+		arrayRef<std::uint8_t> _mappedData;
+		arrayRef<std::uint8_t> _mappedPositions;
+	};
+} // namespace ns_index
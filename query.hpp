@@ -0,0 +1,631 @@
+// 本文件实现 布尔查询: 查询语法的解析, 以及在倒排拉链上 按文档id 递增的顺序求值的文档迭代器
+
+// 查询语法:
+//  a b           默认为 或: 包含 a 或 b 的文档, 两者都包含的文档 权重更高
+//  +a -b         + 表示文档必须包含 a, - 表示文档不能包含 b
+//  a AND b       文档必须同时包含 a 和 b
+//  a OR b        文档包含 a 或 b
+//  NOT a         文档不包含 a
+//  ( )           分组
+//  "a b" "a b"~N 短语 和 邻近查询, 短语前没有 - 时 文档必须包含短语
+// 优先级: NOT + - 最高, 其次是 AND, 再次是 OR, 空格分隔的各项 最低. 如 a b AND c OR d 即 a ((b AND c) OR d)
+// AND OR NOT 必须大写, 小写的 and or not 是普通的词
+// 一个词 经过代码感知分词之后 可能得到多个词, 如 io_context 得到 io_context io context
+// 文档必须包含 除拆分出的子词以外的 所有词, 才算包含这个词. 子词只参与计算权重
+//
+// 求值时 每个语法树节点都对应一个文档迭代器, 迭代器按文档id 递增的顺序 输出匹配的文档, 并且可以通过 nextGEQ 向后跳
+//  交集(AND): 从文档数最少的子迭代器开始, 其他子迭代器 nextGEQ 到它的文档, 不一致时 再让最少的跳到更大的文档
+//            所以 交集的开销 取决于最稀有的关键词, 而不是所有倒排拉链的总长度
+//  并集(OR):  输出所有子迭代器中 最小的文档
+//  排除(NOT): 跳过 排除迭代器中也有的文档
+// 倒排拉链的 nextGEQ 通过块信息 直接跳过不需要的块, 不需要解码. 块信息就是跳表指针, 目标块 以 galloping 查找
+// 倒排拉链是 varint 差值压缩的, 块内只能顺序解码, 不能直接对文档id 数组做 SIMD 求交集 或在块内 galloping
+// 所以交集依靠 跳块 和 从最稀有的关键词开始 来减少解码
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "postingList.hpp"
+
+namespace ns_query {
+	// 邻近查询允许的最大位置偏差, 必须小于 ns_index::CONTENT_POSITION_GAP
+	const std::uint32_t MAX_PHRASE_SLOP = 64;
+
+	// 查询语法树的节点
+	typedef struct queryNode {
+		enum nodeType {
+			WORD,	// 词
+			PHRASE, // 短语
+			AND,	// 子节点的交集
+			OR,		// 子节点的并集
+			NOT,	// 不包含唯一的子节点
+			LIST	// 空格分隔的各项: 带 + 的项和短语 必须匹配, NOT 的项 不能匹配, 没有必须匹配的项时 至少匹配其他项中的一项
+		};
+
+		nodeType _type;
+		std::string _text;	 // WORD PHRASE: 原文
+		std::uint32_t _slop; // PHRASE: 允许的位置偏差
+		bool _required;		 // 以 + 开头
+		std::vector<std::unique_ptr<queryNode>> _children;
+
+		queryNode(nodeType type)
+			: _type(type)
+			, _slop(0)
+			, _required(false) {}
+	} queryNode_t;
+
+	class queryParser {
+	public:
+		// 解析查询, 返回语法树的根节点(LIST)
+		// hasOperators 输出查询中 是否使用了 引号 + - AND OR NOT 括号, 没有使用时 查询就是所有词的 或
+		static std::unique_ptr<queryNode_t> parse(const std::string& query, bool* hasOperators) {
+			queryParser parser;
+			parser.tokenize(query);
+			*hasOperators = false;
+			for (const token_t& token : parser._tokens) {
+				if (token._type != TOKEN_WORD)
+					*hasOperators = true;
+			}
+
+			std::unique_ptr<queryNode_t> root(new queryNode_t(queryNode_t::LIST));
+			while (parser._pos < parser._tokens.size()) {
+				// 多余的右括号 直接忽略
+				if (parser.peek(TOKEN_RPAREN)) {
+					parser._pos++;
+					continue;
+				}
+				parser.parseList(root.get());
+			}
+			return root;
+		}
+
+	private:
+		enum tokenType {
+			TOKEN_WORD,
+			TOKEN_PHRASE,
+			TOKEN_AND,
+			TOKEN_OR,
+			TOKEN_NOT,
+			TOKEN_PLUS,
+			TOKEN_MINUS,
+			TOKEN_LPAREN,
+			TOKEN_RPAREN
+		};
+
+		typedef struct token {
+			tokenType _type;
+			std::string _text;
+			std::uint32_t _slop;
+		} token_t;
+
+		queryParser()
+			: _pos(0) {}
+
+		static bool isDelimiter(char c) {
+			return isspace(static_cast<unsigned char>(c)) || c == '(' || c == ')' || c == '"';
+		}
+
+		void addToken(tokenType type, std::string text = std::string(), std::uint32_t slop = 0) {
+			_tokens.push_back({type, std::move(text), slop});
+		}
+
+		void tokenize(const std::string& query) {
+			std::size_t pos = 0;
+			while (pos < query.size()) {
+				char c = query[pos];
+				if (isspace(static_cast<unsigned char>(c))) {
+					pos++;
+				}
+				else if (c == '(' || c == ')') {
+					addToken(c == '(' ? TOKEN_LPAREN : TOKEN_RPAREN);
+					pos++;
+				}
+				else if (c == '"') {
+					// 缺少右引号时, 左引号之后的全部内容 都作为短语
+					std::size_t close = query.find('"', pos + 1);
+					if (close == std::string::npos)
+						close = query.size();
+					std::string text = query.substr(pos + 1, close - pos - 1);
+					std::uint32_t slop = 0;
+					pos = close + 1;
+					if (pos + 1 < query.size() && query[pos] == '~' &&
+						isdigit(static_cast<unsigned char>(query[pos + 1]))) {
+						for (pos++; pos < query.size() && isdigit(static_cast<unsigned char>(query[pos])); pos++) {
+							slop = std::min<std::uint32_t>(slop * 10 + (query[pos] - '0'), MAX_PHRASE_SLOP);
+						}
+					}
+					addToken(TOKEN_PHRASE, std::move(text), slop);
+				}
+				else if ((c == '+' || c == '-') && pos + 1 < query.size() &&
+						 !isspace(static_cast<unsigned char>(query[pos + 1])) && query[pos + 1] != ')') {
+					// 只有在词 短语 分组的开头 才是 + -, lock-free 中的 - 是词的一部分
+					addToken(c == '+' ? TOKEN_PLUS : TOKEN_MINUS);
+					pos++;
+				}
+				else {
+					std::size_t end = pos;
+					while (end < query.size() && !isDelimiter(query[end]))
+						end++;
+					std::string word = query.substr(pos, end - pos);
+					if (word == "AND")
+						addToken(TOKEN_AND);
+					else if (word == "OR")
+						addToken(TOKEN_OR);
+					else if (word == "NOT")
+						addToken(TOKEN_NOT);
+					else
+						addToken(TOKEN_WORD, std::move(word));
+					pos = end;
+				}
+			}
+		}
+
+		bool peek(tokenType type) const {
+			return _pos < _tokens.size() && _tokens[_pos]._type == type;
+		}
+
+		// 空格分隔的各项, 直到右括号或结束
+		void parseList(queryNode_t* list) {
+			while (_pos < _tokens.size() && !peek(TOKEN_RPAREN)) {
+				std::unique_ptr<queryNode_t> item = parseOr();
+				if (item)
+					list->_children.push_back(std::move(item));
+			}
+		}
+
+		std::unique_ptr<queryNode_t> parseOr() {
+			std::unique_ptr<queryNode_t> left = parseAnd();
+			while (peek(TOKEN_OR)) {
+				_pos++;
+				std::unique_ptr<queryNode_t> right = parseAnd();
+				left = combine(queryNode_t::OR, std::move(left), std::move(right));
+			}
+			return left;
+		}
+
+		std::unique_ptr<queryNode_t> parseAnd() {
+			std::unique_ptr<queryNode_t> left = parseUnary();
+			while (peek(TOKEN_AND)) {
+				_pos++;
+				std::unique_ptr<queryNode_t> right = parseUnary();
+				left = combine(queryNode_t::AND, std::move(left), std::move(right));
+			}
+			return left;
+		}
+
+		std::unique_ptr<queryNode_t> parseUnary() {
+			if (peek(TOKEN_NOT) || peek(TOKEN_MINUS)) {
+				_pos++;
+				std::unique_ptr<queryNode_t> child = parseUnary();
+				if (!child)
+					return child;
+				std::unique_ptr<queryNode_t> node(new queryNode_t(queryNode_t::NOT));
+				node->_children.push_back(std::move(child));
+				return node;
+			}
+			if (peek(TOKEN_PLUS)) {
+				_pos++;
+				std::unique_ptr<queryNode_t> node = parseUnary();
+				if (node)
+					node->_required = true;
+				return node;
+			}
+			return parsePrimary();
+		}
+
+		std::unique_ptr<queryNode_t> parsePrimary() {
+			if (_pos >= _tokens.size())
+				return nullptr;
+			const token_t& token = _tokens[_pos++];
+			switch (token._type) {
+			case TOKEN_WORD:
+			case TOKEN_PHRASE: {
+				std::unique_ptr<queryNode_t> node(
+					new queryNode_t(token._type == TOKEN_WORD ? queryNode_t::WORD : queryNode_t::PHRASE));
+				node->_text = token._text;
+				node->_slop = token._slop;
+				return node;
+			}
+			case TOKEN_LPAREN: {
+				std::unique_ptr<queryNode_t> node(new queryNode_t(queryNode_t::LIST));
+				parseList(node.get());
+				if (peek(TOKEN_RPAREN))
+					_pos++;
+				return node;
+			}
+			default:
+				// 位置不对的 AND OR 右括号, 忽略
+				if (token._type == TOKEN_RPAREN)
+					_pos--;
+				return nullptr;
+			}
+		}
+
+		// 合并 AND 或 OR 的两个操作数, 缺少一个操作数时 直接返回另一个
+		static std::unique_ptr<queryNode_t> combine(queryNode_t::nodeType type, std::unique_ptr<queryNode_t> left,
+													std::unique_ptr<queryNode_t> right) {
+			if (!left)
+				return right;
+			if (!right)
+				return left;
+			std::unique_ptr<queryNode_t> node;
+			if (left->_type == type && !left->_required) {
+				node = std::move(left);
+			}
+			else {
+				node.reset(new queryNode_t(type));
+				node->_children.push_back(std::move(left));
+			}
+			node->_children.push_back(std::move(right));
+			return node;
+		}
+
+		std::vector<token_t> _tokens;
+		std::size_t _pos;
+	};
+
+	// 语法树的规范形式, 用作结果缓存的键
+	// 分词会将英文转为小写, 所以词和短语 转为小写后 结果不变; 交集 并集 的子节点顺序不影响结果, 所以排序
+	inline void canonicalForm(const queryNode_t& node, std::string* out) {
+		if (node._required)
+			out->push_back('+');
+		switch (node._type) {
+		case queryNode_t::WORD:
+		case queryNode_t::PHRASE:
+			out->push_back(node._type == queryNode_t::WORD ? 'w' : 'p');
+			if (node._type == queryNode_t::PHRASE)
+				out->append(std::to_string(node._slop));
+			out->push_back('"');
+			for (char c : node._text) {
+				out->push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+			}
+			out->push_back('"');
+			break;
+		default: {
+			const char* names = "??aonl";
+			out->push_back(names[node._type]);
+			std::vector<std::string> children;
+			for (const std::unique_ptr<queryNode_t>& child : node._children) {
+				children.emplace_back();
+				canonicalForm(*child, &children.back());
+			}
+			if (node._type != queryNode_t::NOT)
+				std::sort(children.begin(), children.end());
+			out->push_back('(');
+			for (const std::string& child : children) {
+				out->append(child);
+				out->push_back(' ');
+			}
+			out->push_back(')');
+			break;
+		}
+		}
+	}
+
+	// 遍历结束的迭代器 文档id 为 END_DOC
+	const std::uint32_t END_DOC = std::numeric_limits<std::uint32_t>::max();
+
+	// 文档迭代器, 按文档id 递增的顺序 输出匹配的文档. 创建之后 就指向第一个匹配的文档
+	class docIterator {
+	public:
+		virtual ~docIterator() {}
+
+		// 当前文档id
+		std::uint32_t doc() const { return _doc; }
+		// 移动到第一个 文档id >= target 的匹配文档, 当前文档已经 >= target 时不移动
+		virtual void nextGEQ(std::uint32_t target) = 0;
+		// 估计的匹配文档数, 交集从最小的开始遍历
+		virtual std::size_t cost() const = 0;
+
+	protected:
+		docIterator()
+			: _doc(END_DOC) {}
+
+		std::uint32_t _doc;
+	};
+	typedef std::unique_ptr<docIterator> docIteratorPtr;
+
+	// 不匹配任何文档, 如 不存在的关键词
+	class emptyIterator : public docIterator {
+	public:
+		void nextGEQ(std::uint32_t) {}
+		std::size_t cost() const { return 0; }
+	};
+
+	// 匹配所有文档, 用于 只有排除条件的查询
+	class allDocsIterator : public docIterator {
+	public:
+		allDocsIterator(std::size_t docCount)
+			: _docCount(docCount) {
+			_doc = docCount > 0 ? 0 : END_DOC;
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target)
+				_doc = target < _docCount ? target : END_DOC;
+		}
+		std::size_t cost() const { return _docCount; }
+
+	private:
+		std::size_t _docCount;
+	};
+
+	// 一条倒排拉链中的文档
+	// 迭代器输出文档 d 之前, 所有子迭代器 nextGEQ 的目标都不超过 d, 之后的目标都大于 d
+	// 所以 输出 d 之后, 可以直接将 termIterator nextGEQ 到 d 读取权重, 不影响之后的求值
+	class termIterator : public docIterator {
+	public:
+		termIterator(const ns_index::postingList* list)
+			: _it(list->begin())
+			, _size(list->size()) {
+			update();
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target) {
+				_it.nextGEQ(target);
+				update();
+			}
+		}
+		std::size_t cost() const { return _size; }
+		// 当前文档中 关键词的权重
+		std::uint64_t weight() const { return _it->_weight; }
+
+	private:
+		void update() { _doc = _it.valid() ? static_cast<std::uint32_t>(_it->_docId) : END_DOC; }
+
+		ns_index::postingList::iterator _it;
+		std::size_t _size;
+	};
+
+	// 交集
+	class andIterator : public docIterator {
+	public:
+		andIterator(std::vector<docIteratorPtr>&& children)
+			: _children(std::move(children)) {
+			std::sort(_children.begin(), _children.end(),
+					  [](const docIteratorPtr& a, const docIteratorPtr& b) { return a->cost() < b->cost(); });
+			align();
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target) {
+				_children[0]->nextGEQ(target);
+				align();
+			}
+		}
+		std::size_t cost() const { return _children[0]->cost(); }
+
+	private:
+		// 从最稀有的子迭代器的文档开始, 找到所有子迭代器都包含的文档
+		void align() {
+			std::uint32_t candidate = _children[0]->doc();
+			std::size_t i = 1;
+			while (candidate != END_DOC && i < _children.size()) {
+				_children[i]->nextGEQ(candidate);
+				std::uint32_t doc = _children[i]->doc();
+				if (doc == candidate) {
+					i++;
+					continue;
+				}
+				_children[0]->nextGEQ(doc);
+				candidate = _children[0]->doc();
+				i = 1;
+			}
+			_doc = candidate;
+		}
+
+		std::vector<docIteratorPtr> _children;
+	};
+
+	// 并集
+	class orIterator : public docIterator {
+	public:
+		orIterator(std::vector<docIteratorPtr>&& children)
+			: _children(std::move(children))
+			, _cost(0) {
+			for (const docIteratorPtr& child : _children) {
+				_cost += child->cost();
+			}
+			update();
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target) {
+				for (docIteratorPtr& child : _children) {
+					child->nextGEQ(target);
+				}
+				update();
+			}
+		}
+		std::size_t cost() const { return _cost; }
+
+	private:
+		void update() {
+			_doc = END_DOC;
+			for (const docIteratorPtr& child : _children) {
+				_doc = std::min(_doc, child->doc());
+			}
+		}
+
+		std::vector<docIteratorPtr> _children;
+		std::size_t _cost;
+	};
+
+	// 有必须匹配的条件时, 其他条件只影响权重, 不影响匹配: 输出 required 的文档
+	// optional 中的迭代器 在计算权重时 由调用者 nextGEQ 到匹配的文档 读取权重, 所以保存在这里 与 required 一同释放
+	class reqOptIterator : public docIterator {
+	public:
+		reqOptIterator(docIteratorPtr required, std::vector<docIteratorPtr>&& optional)
+			: _required(std::move(required))
+			, _optional(std::move(optional)) {
+			_doc = _required->doc();
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target) {
+				_required->nextGEQ(target);
+				_doc = _required->doc();
+			}
+		}
+		std::size_t cost() const { return _required->cost(); }
+
+	private:
+		docIteratorPtr _required;
+		std::vector<docIteratorPtr> _optional;
+	};
+
+	// include 中 不在 exclude 中的文档
+	class andNotIterator : public docIterator {
+	public:
+		andNotIterator(docIteratorPtr include, docIteratorPtr exclude)
+			: _include(std::move(include))
+			, _exclude(std::move(exclude)) {
+			skipExcluded();
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target) {
+				_include->nextGEQ(target);
+				skipExcluded();
+			}
+		}
+		std::size_t cost() const { return _include->cost(); }
+
+	private:
+		void skipExcluded() {
+			while (_include->doc() != END_DOC) {
+				_exclude->nextGEQ(_include->doc());
+				if (_exclude->doc() != _include->doc())
+					break;
+				_include->nextGEQ(_include->doc() + 1);
+			}
+			_doc = _include->doc();
+		}
+
+		docIteratorPtr _include;
+		docIteratorPtr _exclude;
+	};
+
+	// 短语中的一个关键词
+	typedef struct phraseTerm {
+		const ns_index::postingList* _list; // 关键词的倒排拉链
+		std::uint32_t _offset;				 // 关键词在短语中的相对位置, 第一个词为0
+	} phraseTerm_t;
+
+	// 在一个文档中 判断短语是否出现, positions[i] 为短语中第i个关键词 在文档中的所有位置
+	// 关键词i 出现在位置 p 时, 短语的起点就是 p - offset_i. 每个关键词选一个位置, 所有起点 最多相差 slop 时短语出现
+	// 每个关键词一个游标, 每次将起点最小的游标 移动到 起点 >= 最大起点 - slop 的位置, 直到所有起点足够接近
+	// 位置列表是递增的, 游标的移动使用 galloping: 步长按 1 2 4 ... 倍增, 越过目标后再二分
+	// 这样 常见词的位置列表很长时, 也只需要访问少量位置
+	inline bool matchPositions(const std::vector<phraseTerm_t>& terms, std::uint32_t slop,
+							   const std::vector<std::vector<std::uint32_t>>& positions) {
+		const std::size_t n = terms.size();
+		static thread_local std::vector<std::size_t> cursors;
+		cursors.assign(n, 0);
+		auto start = [&](std::size_t i) {
+			return static_cast<std::int64_t>(positions[i][cursors[i]]) - terms[i]._offset;
+		};
+
+		while (true) {
+			std::size_t minTerm = 0;
+			std::int64_t maxStart = start(0);
+			for (std::size_t i = 1; i < n; i++) {
+				if (start(i) < start(minTerm))
+					minTerm = i;
+				maxStart = std::max(maxStart, start(i));
+			}
+			if (maxStart - start(minTerm) <= slop)
+				return true;
+
+			// 起点最小的关键词 跳到 位置 >= maxStart - slop + offset 的地方
+			const std::vector<std::uint32_t>& list = positions[minTerm];
+			const std::int64_t target = maxStart - slop + terms[minTerm]._offset;
+			std::size_t lo = cursors[minTerm] + 1, step = 1;
+			while (lo + step < list.size() && list[lo + step] < target) {
+				lo += step;
+				step *= 2;
+			}
+			std::size_t hi = std::min(lo + step + 1, list.size());
+			cursors[minTerm] =
+				std::lower_bound(list.begin() + lo, list.begin() + hi, target,
+								 [](std::uint32_t position, std::int64_t value) { return position < value; }) -
+				list.begin();
+			if (cursors[minTerm] == list.size())
+				return false;
+		}
+	}
+
+	// 包含短语的文档
+	// 与交集一样 以最短的倒排拉链为基准, 所有关键词都出现的文档 才需要读取位置信息
+	class phraseIterator : public docIterator {
+	public:
+		phraseIterator(std::vector<phraseTerm_t>&& terms, std::uint32_t slop)
+			: _terms(std::move(terms))
+			, _slop(slop)
+			, _lead(0)
+			, _positions(_terms.size()) {
+			for (std::size_t i = 0; i < _terms.size(); i++) {
+				_its.push_back(_terms[i]._list->begin());
+				if (_terms[i]._list->size() < _terms[_lead]._list->size())
+					_lead = i;
+			}
+			advance(0);
+		}
+
+		void nextGEQ(std::uint32_t target) {
+			if (_doc < target)
+				advance(target);
+		}
+		std::size_t cost() const { return _terms[_lead]._list->size(); }
+
+	private:
+		void advance(std::uint32_t target) {
+			while (true) {
+				_its[_lead].nextGEQ(target);
+				if (!_its[_lead].valid()) {
+					_doc = END_DOC;
+					return;
+				}
+				const std::uint32_t docId = _its[_lead]->_docId;
+				std::uint32_t next = docId;
+				for (std::size_t i = 0; i < _its.size(); i++) {
+					_its[i].nextGEQ(docId);
+					if (!_its[i].valid()) {
+						_doc = END_DOC;
+						return;
+					}
+					next = std::max(next, static_cast<std::uint32_t>(_its[i]->_docId));
+				}
+				if (next != docId) {
+					target = next;
+					continue;
+				}
+
+				bool hasPositions = true;
+				for (std::size_t i = 0; i < _its.size(); i++) {
+					_its[i].positions(&_positions[i]);
+					hasPositions = hasPositions && !_positions[i].empty();
+				}
+				if (hasPositions && matchPositions(_terms, _slop, _positions)) {
+					_doc = docId;
+					return;
+				}
+				target = docId + 1;
+			}
+		}
+
+		std::vector<phraseTerm_t> _terms;
+		std::uint32_t _slop;
+		std::size_t _lead;
+		std::vector<ns_index::postingList::iterator> _its;
+		std::vector<std::vector<std::uint32_t>> _positions;
+	};
+} // namespace ns_query
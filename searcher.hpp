@@ -6,51 +6,391 @@
 //  3. 然后再通过倒排拉链中 倒排元素的对应文档id, 在正排索引中获取文件内容
 
 // 不过在正式开始搜索之前, 要先构建索引
-// 而索引的构建, 在整个程序中只需要构建一次, 所以可以将索引设计为单例模式
+// 搜索器通过 shared_ptr 持有当前的索引, 更换索引时 在后台建立新索引 再原子地替换指针
+// 每次搜索开始时 取得当前索引的 shared_ptr, 正在进行的搜索 在旧索引上完成, 最后一个使用者结束时 旧索引被释放
 #pragma once
 
 #include <algorithm>
 #include <cctype>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 #include <algorithm>
 #include <boost/algorithm/string.hpp>
-#include <json/json.h>
+#include <malloc.h>
+#include <sys/stat.h>
 #include "logMessage.hpp"
 #include "util.hpp"
 #include "index.hpp"
+#include "lruCache.hpp"
+#include "manifest.hpp"
+#include "query.hpp"
 
 namespace ns_searcher {
 	typedef struct invertedElemOut {
 		std::size_t _docId;
 		std::uint64_t _weight;
-		std::vector<std::string> _keywords;
+		std::uint64_t _termMask; // 此文档命中的查询关键词, 第i位 对应第i个关键词
 	} invertedElemOut_t;
 
+	// _termMask 最多记录64个关键词, 之后的关键词共用最高位
+	const std::size_t MAX_TERM_BITS = 64;
+
+	// 打分累加器
+	// 文档id 就是正排索引的下标, 是稠密的, 所以可以直接用 以文档id为下标的数组 累加每个文档的权重
+	// 同时用 _touched 记录本次搜索累加过的文档id, 搜索结束后只需要清零这些位置, 数组就可以被下一次搜索复用
+	// 每个线程一个累加器, 搜索过程中 不需要为命中的文档分配任何内存
+	class scoreAccumulator {
+	public:
+		// 清除上一次搜索的结果, 并保证数组可以容纳 docCount 个文档
+		void reset(std::size_t docCount) {
+			for (std::uint32_t docId : _touched) {
+				_weights[docId] = 0;
+				_termMasks[docId] = 0;
+			}
+			_touched.clear();
+			if (_weights.size() < docCount) {
+				_weights.resize(docCount, 0);
+				_termMasks.resize(docCount, 0);
+			}
+		}
+
+		// termBit 不为0, 所以 _termMasks 为0 就表示此文档还没有被累加过
+		void add(std::uint32_t docId, std::uint64_t weight, std::uint64_t termBit) {
+			if (_termMasks[docId] == 0) {
+				_touched.push_back(docId);
+			}
+			_weights[docId] += weight;
+			_termMasks[docId] |= termBit;
+		}
+
+		const std::vector<std::uint32_t>& touched() const { return _touched; }
+		std::uint64_t weight(std::uint32_t docId) const { return _weights[docId]; }
+		std::uint64_t termMask(std::uint32_t docId) const { return _termMasks[docId]; }
+
+	private:
+		std::vector<std::uint64_t> _weights;
+		std::vector<std::uint64_t> _termMasks;
+		std::vector<std::uint32_t> _touched;
+	};
+
+	// 去重之后的查询关键词
+	typedef struct queryTerm {
+		std::uint32_t _termId;					   // 关键词在词典中的 termId
+		const ns_index::invertedList_t* _list;	   // 关键词的倒排拉链
+		std::uint64_t _count;					   // 关键词在查询中出现的次数
+		std::uint64_t _idf;						   // 关键词的 idf, 乘以 IDF_SCALE 取整
+		std::uint64_t _scale;					   // 倒排元素的权重 要乘以的系数, 即 idf * 次数
+		std::uint64_t _termBit;					   // 关键词在 _termMask 中对应的位
+		ns_query::termIterator* _matcher;		   // 布尔查询中 此关键词的文档迭代器, 计算权重时复用, 避免再解码一遍倒排拉链
+	} queryTerm_t;
+
+	// 选出排名前 need 的文档
+	// 堆顶是已选出文档中 排名最靠后的, 新文档比堆顶排名靠前时 就替换掉堆顶. 复杂度为 O(n log need)
+	// 权重相同时 按文档id 排序, 保证翻页时结果稳定
+	class topKCollector {
+	public:
+		topKCollector(std::size_t need)
+			: _need(need) {}
+
+		static bool better(const invertedElemOut_t& elem1, const invertedElemOut_t& elem2) {
+			return elem1._weight > elem2._weight || (elem1._weight == elem2._weight && elem1._docId < elem2._docId);
+		}
+
+		void push(const invertedElemOut_t& elemOut) {
+			if (_heap.size() < _need) {
+				_heap.push_back(elemOut);
+				std::push_heap(_heap.begin(), _heap.end(), better);
+			}
+			else if (_need > 0 && better(elemOut, _heap.front())) {
+				std::pop_heap(_heap.begin(), _heap.end(), better);
+				_heap.back() = elemOut;
+				std::push_heap(_heap.begin(), _heap.end(), better);
+			}
+		}
+
+		// 进入结果所需超过的权重: 堆满之前为0, 堆满之后为堆顶文档的权重
+		std::uint64_t threshold() const {
+			if (_need == 0)
+				return std::numeric_limits<std::uint64_t>::max();
+			return _heap.size() < _need ? 0 : _heap.front()._weight;
+		}
+
+		// 按排名顺序输出选出的文档
+		void finish(std::vector<invertedElemOut_t>* out) {
+			std::sort_heap(_heap.begin(), _heap.end(), better);
+			out->swap(_heap);
+		}
+
+	private:
+		std::size_t _need;
+		std::vector<invertedElemOut_t> _heap;
+	};
+
+	// 搜索结果的 json 序列化
+	// 搜索结果是 对象的数组, 每个对象只有 url title desc 三个字符串字段
+	// 格式是固定的, 所以不需要先建立 Json::Value 树 再输出, 直接将转义后的字段 追加到输出字符串中
+	// 输出紧凑的 json, 不包含缩进和换行. 摘要可以分多段追加, 不需要先拼接成一个字符串
+	class resultWriter {
+	public:
+		explicit resultWriter(std::string* out)
+			: _out(out)
+			, _count(0)
+			, _fieldCount(0) {
+			_out->clear();
+		}
+
+		void beginObject() {
+			_out->append(_count++ == 0 ? "[{" : ",{");
+			_fieldCount = 0;
+		}
+		void endObject() { _out->push_back('}'); }
+
+		void field(const char* name, const char* value, std::size_t len) {
+			beginField(name);
+			appendEscaped(value, len);
+			endField();
+		}
+		void field(const char* name, const std::string& value) { field(name, value.data(), value.size()); }
+		void field(const char* name, ns_index::textRef value) { field(name, value.data(), value.size()); }
+
+		// 字段值 由多次 appendEscaped() 追加
+		void beginField(const char* name) {
+			if (_fieldCount++ > 0)
+				_out->push_back(',');
+			_out->push_back('"');
+			_out->append(name);
+			_out->append("\":\"");
+		}
+		void endField() { _out->push_back('"'); }
+
+		// 字段值不是字符串时(如数组), 由 appendRaw() appendNumber() 直接写入
+		void beginRawField(const char* name) {
+			if (_fieldCount++ > 0)
+				_out->push_back(',');
+			_out->push_back('"');
+			_out->append(name);
+			_out->append("\":");
+		}
+		void appendRaw(char c) { _out->push_back(c); }
+		void appendNumber(std::uint64_t n) {
+			char digits[20];
+			int len = 0;
+			do {
+				digits[len++] = '0' + n % 10;
+				n /= 10;
+			} while (n > 0);
+			while (len > 0) {
+				_out->push_back(digits[--len]);
+			}
+		}
+
+		// 追加字符串, 并按 json 的规则转义: '"' '\' 和 小于0x20的控制字符 需要转义, 其他字节原样输出
+		// 正文中需要转义的字节很少, 所以每次找出 下一个需要转义的字节, 之前的字节整段追加
+		void appendEscaped(const char* s, std::size_t len) {
+			const char* end = s + len;
+			while (s < end) {
+				const char* special = findSpecial(s, end);
+				_out->append(s, special);
+				if (special == end)
+					break;
+				appendEscape(*special);
+				s = special + 1;
+			}
+		}
+
+		// 结束数组, 没有结果时 输出空数组
+		void finish() { _out->append(_count == 0 ? "[]" : "]"); }
+
+	private:
+		static bool isSpecial(unsigned char c) { return c == '"' || c == '\\' || c < 0x20; }
+
+		// 从 s 开始 第一个需要转义的字节的位置
+		static const char* findSpecial(const char* s, const char* end) {
+#ifdef __SSE2__
+			const __m128i quote = _mm_set1_epi8('"');
+			const __m128i backslash = _mm_set1_epi8('\\');
+			const __m128i control = _mm_set1_epi8(0x1f);
+			for (; s + 16 <= end; s += 16) {
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+				// 无符号比较: max(byte, 0x1f) == 0x1f 就表示 byte <= 0x1f, 非ASCII字节不会误判
+				__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+											   _mm_cmpeq_epi8(_mm_max_epu8(bytes, control), control));
+				int mask = _mm_movemask_epi8(special);
+				if (mask != 0)
+					return s + __builtin_ctz(mask);
+			}
+#endif
+			while (s < end && !isSpecial(*s))
+				s++;
+			return s;
+		}
+
+		void appendEscape(char c) {
+			switch (c) {
+			case '"':
+				_out->append("\\\"");
+				break;
+			case '\\':
+				_out->append("\\\\");
+				break;
+			case '\b':
+				_out->append("\\b");
+				break;
+			case '\f':
+				_out->append("\\f");
+				break;
+			case '\n':
+				_out->append("\\n");
+				break;
+			case '\r':
+				_out->append("\\r");
+				break;
+			case '\t':
+				_out->append("\\t");
+				break;
+			default:
+				static const char hex[] = "0123456789abcdef";
+				_out->append("\\u00");
+				_out->push_back(hex[(c >> 4) & 0xf]);
+				_out->push_back(hex[c & 0xf]);
+				break;
+			}
+		}
+
+		std::string* _out;
+		std::size_t _count;		 // 已输出的对象数
+		std::size_t _fieldCount; // 当前对象 已输出的字段数
+	};
+
+	// 查询关键词的倒排拉链总长度 达到此值时, 才使用 WAND 动态剪枝
+	// WAND 每处理一个文档 都要移动并重新排序游标, 开销比在稠密数组中累加权重大得多
+	// 只有倒排拉链很长、可以整块跳过时 才能抵消这部分开销
+	const std::size_t WAND_MIN_POSTINGS = 1 << 17;
+
+	// idf 乘以此值后 取整, 与倒排拉链中量化的权重相乘, 整数运算 结果不会溢出
+	const double IDF_SCALE = 1024;
+
+	// 每页默认 和 最多返回的搜索结果数
+	const std::size_t DEFAULT_TOPK = 10;
+	const std::size_t MAX_TOPK = 100;
+
+	// 每个搜索结果 预先为 json 分配的字节数, 大于大多数结果的 url title 和摘要 转义后的长度
+	const std::size_t RESULT_JSON_RESERVE = 512;
+
+	// 结果缓存: 分片数, 总字节数, 条目的有效时间(秒)
+	const std::size_t RESULT_CACHE_SHARDS = 16;
+	const std::size_t RESULT_CACHE_BYTES = 32 << 20;
+	const std::uint32_t RESULT_CACHE_TTL = 600;
+
+	// 摘要
+	// 摘要是内容中 包含最多不同关键词的一段: 在关键词的位置上 滑动 SNIPPET_WINDOW 个位置宽的窗口, 选出覆盖关键词种类最多的窗口
+	// 再以窗口中第一个关键词为锚点, 截取它之前 SNIPPET_BEFORE 字节开始的 SNIPPET_LENGTH 字节
+	// 截取的边界 不会切断 UTF-8 字符, 也尽量不切断英文单词
+	const std::uint32_t SNIPPET_WINDOW = 16;
+	const std::size_t SNIPPET_BEFORE = 50;
+	const std::size_t SNIPPET_LENGTH = 160;
+	// 每个关键词 最多使用的位置数, 限制 关键词在文档中出现很多次时 选择窗口的开销
+	const std::size_t SNIPPET_MAX_POSITIONS = 64;
+	// 调整边界 不切断英文单词时, 最多移动的字节数. 超过时 说明单词太长, 直接切断
+	const std::size_t SNIPPET_MAX_SNAP = 16;
+
+	// 摘要中 需要高亮的关键词, 在文档内容中的字节范围 [_begin, _end)
+	typedef struct highlight {
+		std::uint32_t _begin;
+		std::uint32_t _end;
+	} highlight_t;
+
+	// 一页搜索结果中的一个文档
+	// 摘要的范围 和高亮的关键词 在搜索时就已经确定, 缓存命中时 只需要从内容中截取
+	typedef struct searchResult {
+		std::uint32_t _docId;
+		std::uint32_t _descBegin; // 摘要在文档内容中的字节范围 [_descBegin, _descEnd)
+		std::uint32_t _descEnd;
+		std::uint32_t _highlightBegin; // 摘要中的高亮 在 resultPage_t::_highlights 中的下标范围
+		std::uint32_t _highlightEnd;
+	} searchResult_t;
+
+	// 一页搜索结果, 结果缓存中存储的就是 resultPage_t
+	// 所有结果的高亮 都存放在同一个 vector 中, 不需要为每个结果单独分配内存
+	typedef struct resultPage {
+		std::vector<searchResult_t> _results;
+		std::vector<highlight_t> _highlights;
+	} resultPage_t;
+
+	typedef std::shared_ptr<ns_index::index> indexPtr;
+
 	class searcher {
 	private:
-		ns_index::index* _index; // 建立索引的类
+		// 当前使用的索引, 只通过 std::atomic_load 和 std::atomic_store 读取和替换
+		indexPtr _index;
+		// 同一时间 只进行一次索引的加载, 防止同时写快照文件
+		std::mutex _loadMtx;
+		// 加载快照时 是否校验整个快照的校验和, 见 ns_index::index::loadSnapshot()
+		bool _verifySnapshot;
 
 		ns_util::jiebaUtil* _jiebaIns;
 
+		// 以规范化的查询和分页参数为键, 缓存一页搜索结果. 命中时 不需要再查找和合并倒排拉链
+		ns_cache::shardedLruCache<resultPage_t> _resultCache;
+
 	public:
-		void initSearcher(const std::string& input) {
+		searcher()
+			: _verifySnapshot(false)
+			, _jiebaIns(nullptr)
+			, _resultCache(RESULT_CACHE_SHARDS, RESULT_CACHE_BYTES, RESULT_CACHE_TTL) {}
+
+		// 在 initSearcher() 之前调用
+		void setVerifySnapshot(bool verify) { _verifySnapshot = verify; }
+
+		// input 为 parser模块处理好的文档数据, snapshot 为索引快照文件, 加载方式见 loadIndex()
+		// 加载失败时 使用空索引, 之后可以通过 reloadIndex() 重新加载
+		void initSearcher(const std::string& input, const std::string& snapshot) {
 			// 搜索前的初始化操作
-			// 获取单例
-			_index = ns_index::index::getInstance();
+			// 获取分词单例
 			_jiebaIns = ns_util::jiebaUtil::getInstance();
 
-			LOG(NOTICE, "获取索引单例成功...");
-			// std::cout << "获取单例成功 ..." << std::endl;
-			// 建立索引
-			_index->buildIndex(input);
-			LOG(NOTICE, "构建正派索引、倒排索引成功 ...");
-			// std::cout << "构建正排索引、倒排索引成功 ..." << std::endl;
+			std::lock_guard<std::mutex> lock(_loadMtx);
+			indexPtr index = loadIndex(input, snapshot);
+			if (!index) {
+				LOG(FATAL, "加载索引失败, 使用空索引");
+				index = newIndex();
+			}
+			std::atomic_store(&_index, index);
+			_resultCache.clear();
 		}
 
+		// 重新加载索引, 加载期间 搜索继续使用当前的索引, 加载成功后 替换当前索引
+		// 加载失败时 保留当前索引 并返回 false
+		bool reloadIndex(const std::string& input, const std::string& snapshot) {
+			std::lock_guard<std::mutex> lock(_loadMtx);
+			indexPtr index = loadIndex(input, snapshot);
+			if (!index) {
+				LOG(WARNING, "重新加载索引失败, 继续使用当前索引");
+				return false;
+			}
+			std::atomic_store(&_index, index);
+			// 结果缓存的键中 带有索引编号, 旧索引的条目不会再被命中, 清空只是为了尽早释放内存
+			_resultCache.clear();
+			LOG(NOTICE, "索引已更换, 文档数: %lu", index->docCount());
+			return true;
+		}
+
+		// 当前索引的编号, 上层的缓存 以它区分不同的索引
+		std::uint64_t indexId() const { return std::atomic_load(&_index)->id(); }
+
+		// 当前索引的文档数 和 raw 的版本号
+		std::size_t docCount() const { return std::atomic_load(&_index)->docCount(); }
+		std::uint64_t generation() const { return std::atomic_load(&_index)->generation(); }
+
 		// 搜索接口
 		// 搜索需要实现什么功能?
 		// 首先参数部分需要怎么实现?
@@ -62,162 +402,769 @@ namespace ns_searcher {
 		//  4. 然后再遍历所有的 invertedElem, 根据 invertedElem中存储的 文档id, 在正排索引中获取到文档内容
 		//  5. 然后将获取到的文档内容使用jsoncpp 进行序列化, 存储到输出型参数中
 		// 直到遍历完invertedElem
-		void search(const std::string& query, std::string* jsonString) {
-			// 1. 对需要搜索的句子或关键词进行分词
-			std::vector<std::string> keywords;
+		// 搜索结果是分页返回的, offset 为跳过的结果数, topK 为本页最多返回的结果数
+		void search(const std::string& query, std::string* jsonString, std::size_t offset = 0,
+					std::size_t topK = DEFAULT_TOPK) {
+			// 1. 解析查询
+			// 查询中没有 引号 + - AND OR NOT 括号 时, 就是所有关键词的 或, 使用下面的 WAND 或 遍历累加
+			// 否则按布尔查询求值, 见 query.hpp
+			bool hasOperators = false;
+			std::unique_ptr<ns_query::queryNode_t> queryTree = ns_query::queryParser::parse(query, &hasOperators);
+			// 本次搜索 从头到尾使用同一个索引, 搜索期间索引被更换 也不影响
+			indexPtr index = std::atomic_load(&_index);
 
-			_jiebaIns->cutString(query, &keywords);
-			// _jiebaIns->cutStringNoStop(query, &keywords);
-			// ns_util::jiebaUtil::cutString(query, &keywords);
+			// 2. 对需要搜索的句子或关键词进行分词, 根据分词获取倒排索引中的倒排拉链
+			// 与建立索引时一样 使用代码感知分词, 搜索 boost::asio::io_context 时 可以直接查找完整限定名的倒排拉链
+			// 相同的关键词只保留一个 并记录出现次数, 文档的 _termMask 中第i位 表示文档包含 terms[i]
+			// 同时生成结果缓存的键:
+			//  普通查询 结果只取决于 关键词及其次数, 与顺序和大小写无关, 所以键为 排序后的 termId 和次数,
+			//  不存在的关键词 和停止词 没有倒排拉链, 不影响结果, 也不出现在键中
+			//  布尔查询 键为语法树的规范形式(见 ns_query::canonicalForm), 命中时 不需要再建立文档迭代器
+			std::vector<queryTerm_t> terms;
+			std::string cacheKey;
+			if (hasOperators) {
+				cacheKey = "b";
+				ns_query::canonicalForm(*queryTree, &cacheKey);
+			}
+			else {
+				std::vector<ns_util::term_t> keywords;
+				_jiebaIns->analyze(query, false, &keywords);
+				// 关键词只在词典中查找一次, 之后 去重和获取摘要 都通过 termId, 不需要复制关键词
+				for (const ns_util::term_t& keyword : keywords) {
+					std::uint32_t termId = index->findTerm(keyword._word);
+					if (termId == ns_index::NO_TERM) {
+						// 没有这个关键词
+						continue;
+					}
 
-			// std::vector<invertedElemOut_t> allInvertedElemOut;
-			// std::vector<ns_index::invertedElem_t> allInvertedElem;
+					addQueryTerm(index.get(), termId, &terms);
+				}
 
-			// 统计文档用, 因为可能存在不同的分词 在倒排索引中指向同一个文档的情况
-			// 如果不去重, 会重复展示
-			// std::unordered_map<std::size_t, ns_index::invertedElem_t> invertedElemMap;
-			std::unordered_map<std::size_t, invertedElemOut_t> invertedElemOutMap;
-			// 2. 根据分词获取倒排索引中的倒排拉链, 并汇总去重 invertedElem
-			for (std::string word : keywords) {
-				boost::to_lower(word);
-
-				ns_index::invertedList_t* tmpInvertedList = _index->getInvertedList(word);
-				if (nullptr == tmpInvertedList) {
-					// 没有这个关键词
-					continue;
+				std::vector<std::pair<std::uint32_t, std::uint32_t>> sortedTerms;
+				for (const queryTerm_t& term : terms) {
+					sortedTerms.emplace_back(term._termId, term._count);
 				}
+				std::sort(sortedTerms.begin(), sortedTerms.end());
+				cacheKey = "p";
+				for (const auto& term : sortedTerms) {
+					cacheKey.append(std::to_string(term.first)).append("*").append(std::to_string(term.second)).append(" ");
+				}
+			}
+			cacheKey.append("@").append(std::to_string(offset)).append(",").append(std::to_string(topK));
+			// 文档id 和 termId 只对生成它们的索引有效
+			cacheKey.append("#").append(std::to_string(index->id()));
 
-				for (auto& elem : *tmpInvertedList) {
-					// 遍历倒排拉链, 根据文档id 对invertedElem 去重
-					auto& item = invertedElemOutMap[elem._docId]; // 在map中获取 或 创建对应文档id的 invertedElem
-					item._docId = elem._docId;
-					item._weight += elem._weight;
-					// 权重需要+= 是因为多个关键词指向了同一个文档 那么就说明此文档的与搜索内容的相关性更高
-					// 所以, 就可以将多个关键字关于此文档的权重相加, 表示搜索相关性高
-					// 最好还将 此文档相关的关键词 也存储起来, 因为在客户端搜索结果中, 需要对网页中有的关键字进行高亮
-					// 但是 invertedElem 的第三个成员是 单独的一个string对象, 不太合适
-					// 所以, 可以定义一个与invertedElem 相似的, 但是第三个成员是一个 vector 的类, 比如 invertedElemOut
-					item._keywords.push_back(elem._keyword);
-					// 此时就将当前invertedElem 去重到了 invertedElemMap 中
-				}
-			}
-
-			// vector 存储 文档相关信息, 方便排序
-			std::vector<invertedElemOut_t> allInvertedElemOut;
-			// 出循环之后, 就将搜索到的 文档的 id、权重和相关关键词 存储到了 invertedElemMap
-			// 然后将文档的相关信息 invertedElemOut 都存储到 vector 中
-			for (const auto& elemOut : invertedElemOutMap) {
-				// map中的second: elemOut, 在执行此操作之后, 就没用了
-				// 所以使用移动语义, 防止发生拷贝
-				allInvertedElemOut.push_back(std::move(elemOut.second));
-			}
-
-			// 执行到这里, 可以搜索到的文档id 权重 和 相关关键词的信息, 已经都在allInvertedElemOut 中了.
-			// 但是, 还不能直接 根据文档id 在正排索引中检索
-			// 因为, 此时如果直接进行文档内容的索引, 在找到文档内容之后, 就要直接进行序列化并输出了. 而客户端显示的时候, 反序列化出来的文档顺序, 就是显示的文档顺序
-			// 但是现在找到的文档还是乱序的. 还需要将allInvertedElemOut中的相关文档, 通过_weight 进行倒序排列
-			// 这样, 序列化就是按照倒序排列的, 反序列化也会如此, 显示同样如此
-			std::sort(allInvertedElemOut.begin(), allInvertedElemOut.end(),
-					  [](const invertedElemOut_t& elem1, const invertedElemOut_t& elem2) {
-						  return elem1._weight > elem2._weight;
-					  });
-
-			// 排序之后, allInvertedElemOut 中文档的排序就是倒序了
+			resultPage_t page;
+			if (!_resultCache.get(cacheKey, &page)) {
+				searchPage(index.get(), hasOperators ? queryTree.get() : nullptr, &terms, offset, topK, &page);
+				_resultCache.put(cacheKey, page,
+								 page._results.capacity() * sizeof(searchResult_t) +
+									 page._highlights.capacity() * sizeof(highlight_t));
+			}
+			const std::vector<searchResult_t>& results = page._results;
+
+			// results 中的文档 已经按权重倒序排列了
 			// 然后 通过遍历此数组, 获取文档id, 根据id获取文档在正排索引中的内容
-			// 然后再将 所有内容序列化
-			Json::Value root;
-			if (allInvertedElemOut.empty()) {
-				Json::Value elem;
-				elem["url"] = "http://119.3.223.238:8080";
-				elem["title"] = "Search nothing!";
+			// 然后再将 所有内容序列化, 字段直接从正排索引中 转义后写入 jsonString, 不需要复制
+			jsonString->reserve(RESULT_JSON_RESERVE * std::max<std::size_t>(results.size(), 1));
+			resultWriter writer(jsonString);
+			if (results.empty()) {
+				writer.beginObject();
+				writer.field("url", "http://119.3.223.238:8080");
+				writer.field("title", "Search nothing!");
 				// 关于文档的内容, 搜索结果中是不展示文档的全部内容的, 应该只显示包含关键词的摘要, 点进文档才显示相关内容
-				// 而docInfo中存储的是文档去除标签之后的所有内容, 所以不能直接将 doc._content 存储到elem对应key:value中
-				elem["desc"] = "Search nothing!";
-				root.append(elem);
+				// 而docInfo中存储的是文档去除标签之后的所有内容, 所以不能直接将 doc._content 作为摘要
+				writer.field("desc", "Search nothing!");
+				writer.beginRawField("highlights");
+				writer.appendRaw('[');
+				writer.appendRaw(']');
+				writer.endObject();
 			}
 			else {
-				for (auto& elemOut : allInvertedElemOut) {
-					// 通过Json::Value 对象, 存储文档内容
-					Json::Value elem;
-					// 通过elemOut._docId 获取正排索引中 文档的内容信息
-					ns_index::docInfo_t* doc = _index->getForwardIndex(elemOut._docId);
-					// elem赋值
-					elem["url"] = doc->_url;
-					elem["title"] = doc->_title;
-					if (doc->_title.empty()) {
-						elem["title"] = "TITLE";
-					}
+				for (const searchResult_t& result : results) {
+					// 通过result._docId 获取正排索引中 文档的内容信息
+					ns_index::docInfo_t* doc = index->getForwardIndex(result._docId);
+					writer.beginObject();
+					writer.field("url", doc->_url);
+					if (doc->_title.empty())
+						writer.field("title", "TITLE");
+					else
+						writer.field("title", doc->_title);
 					// 关于文档的内容, 搜索结果中是不展示文档的全部内容的, 应该只显示包含关键词的摘要, 点进文档才显示相关内容
-					// 而docInfo中存储的是文档去除标签之后的所有内容, 所以不能直接将 doc._content 存储到elem对应key:value中
-					elem["desc"] = getDesc(doc->_content, elemOut._keywords[0]); // 只根据第一个关键词来获取摘要
-					// for Debug
-					// 这里有一个bug, jsoncpp 0.10.5.2 是不支持long或long long 相关类型的, 所以需要转换成 double
-					// 这里转换成 double不会有什么影响, 因为这两个参数只是本地调试显示用的.
-					// elem["docId"] = (double)doc->_docId;
-					// elem["weight"] = (double)elemOut._weight;
+					// 而docInfo中存储的是文档去除标签之后的所有内容, 所以不能直接将 doc._content 作为摘要
+					// 摘要的范围 和需要高亮的关键词 已经由 searchPage() 确定
+					writeDesc(doc->_content, result, page._highlights, &writer);
+					writer.endObject();
+				}
+			}
+			writer.finish();
+		}
+
+		// 结果缓存的统计信息
+		ns_cache::cacheStats_t cacheStats() { return _resultCache.stats(); }
 
-					root.append(elem);
+	private:
+		// 搜索一页结果: 选出权重最高的 offset + topK 个文档, 输出其中 [offset, offset + topK) 这一段
+		// queryTree 不为空时 按布尔查询求值, 否则 terms 为普通查询的关键词
+		void searchPage(ns_index::index* index, const ns_query::queryNode_t* queryTree, std::vector<queryTerm_t>* terms,
+						std::size_t offset, std::size_t topK, resultPage_t* page) {
+			topKCollector collector(offset + topK);
+			if (nullptr != queryTree) {
+				// 布尔查询的关键词 在建立文档迭代器时 加入 terms
+				ns_query::docIteratorPtr matcher = buildIterator(index, *queryTree, false, terms);
+				if (matcher)
+					searchBoolean(matcher.get(), *terms, &collector);
+			}
+			else {
+				// 3. 汇总所有关键词的倒排拉链, 选出权重最高的 offset + topK 个文档
+				// 一次请求只需要展示一页结果, 即排序后的 [offset, offset + topK) 这一段, 没有必要对所有文档排序
+				// 多个关键词 且倒排拉链足够长时, 使用 Block-Max WAND 跳过不可能进入结果的文档
+				// 倒排拉链较短时, 直接遍历倒排拉链在稠密数组中累加权重 反而更快
+				std::size_t totalPostings = 0;
+				for (const queryTerm_t& term : *terms) {
+					totalPostings += term._list->size();
+				}
+				if (terms->size() > 1 && totalPostings >= WAND_MIN_POSTINGS) {
+					searchWand(*terms, &collector);
+				}
+				else {
+					searchExhaustive(index, *terms, &collector);
 				}
 			}
+			// 执行到这里, 可以搜索到的文档id 权重 和 相关关键词的信息, 已经按权重倒序排列在 topElemOut 中了
+			std::vector<invertedElemOut_t> topElemOut;
+			collector.finish(&topElemOut);
 
-			// 序列化完成之后将相关内容写入字符串
-			// for Debug 用 styledWriter
-			Json::StyledWriter writer;
-			*jsonString = writer.write(root);
-			LOG(NOTICE, "User request has been finished");
-			// std::cout << "User request has been finished" << std::endl;
+			// 只保留请求的这一页, 并为每个文档 根据它命中的关键词 选出摘要
+			page->_results.clear();
+			page->_highlights.clear();
+			if (topElemOut.size() > offset)
+				page->_results.reserve(topElemOut.size() - offset);
+			for (std::size_t i = offset; i < topElemOut.size(); i++) {
+				searchResult_t result;
+				result._docId = topElemOut[i]._docId;
+				buildSnippet(index, *index->getForwardIndex(result._docId), *terms, topElemOut[i]._termMask, &result,
+							 &page->_highlights);
+				page->_results.push_back(result);
+			}
 		}
 
-		std::string getDesc(const std::string& content, const std::string& keyword) {
-			// 如何获取摘要呢?
-			// 我们尝试获取正文中 第一个keyword 的前50个字节和后100个字节的内容 作为摘要
-			const std::size_t prevStep = 50;
-			const std::size_t nextStep = 100;
-			// 获取正文中 第一个 keyword 的位置
+		// 将关键词加入查询关键词中, 已经存在时 只增加出现次数
+		queryTerm_t* addQueryTerm(ns_index::index* index, std::uint32_t termId, std::vector<queryTerm_t>* terms) {
+			auto termIt = std::find_if(terms->begin(), terms->end(),
+									   [termId](const queryTerm_t& term) { return term._termId == termId; });
+			if (termIt != terms->end()) {
+				termIt->_count++;
+				termIt->_scale = termIt->_idf * termIt->_count;
+				return &*termIt;
+			}
 
-			// std::size_t pos = content.find(keyword);
-			// if (pos == std::string::npos)
-			// 	return "keyword does not exist!";
-			// 直接这样处理, 会出现一个问题:
-			// keyword是有大小写的. 倒排索引中查找 我们实现的是忽略大小写, 所以可以找到文档
-			// 而 string::find() 是区分大小写的查找, 可能无法在内容中找到对应的关键词
-			// string容器也没有提供不区分大小写的查找方法
-			// 此时, 可以用std::search()
-			// std::search(it1, it2, it3, it4, pred);
-			// 可以在[it1, it2)中 查找第一个[it3, it4)(词语)的出现位置.
-			// 并且, 如果使用第5个参数, 就可以传入 带有两个参数的仿函数, 这两个参数就是需要比较的字符
-			// 可以在仿函数内设置这两个字符的比较方式
-			// 最终会返回找到的找到的单次第一个字符位置的迭代器, 否则返回it2
-
-			auto iter = std::search(content.begin(), content.end(), keyword.begin(), keyword.end(),
-									[](int x, int y) {
-										return std::tolower(x) == std::tolower(y);
-									});
-			if (iter == content.end())
-				return "keyword does not exist!";
-			std::size_t pos = std::distance(content.begin(), iter);
+			queryTerm_t term;
+			term._termId = termId;
+			term._list = index->getInvertedList(termId);
+			term._count = 1;
+			// BM25 的 idf = ln(1 + (N - df + 0.5) / (df + 0.5)), 倒排拉链中的权重 已经是 BM25F 中与文档相关的部分
+			double docCount = index->docCount(), df = index->documentFrequency(termId);
+			double idf = std::log(1 + (docCount - df + 0.5) / (df + 0.5));
+			term._idf = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(idf * IDF_SCALE + 0.5));
+			term._scale = term._idf;
+			term._termBit = 1ULL << std::min(terms->size(), MAX_TERM_BITS - 1);
+			term._matcher = nullptr;
+			terms->push_back(term);
+			return &terms->back();
+		}
 
-			std::size_t begin = 0;
-			std::size_t end = content.size() - 1;
+		// 释放索引时 将空闲内存归还给系统, 否则 索引的大量小块内存 会一直留在 malloc 的空闲链表中
+		static indexPtr newIndex() {
+			return indexPtr(new ns_index::index, [](ns_index::index* index) {
+				delete index;
+				malloc_trim(0);
+			});
+		}
+
+		// 建立一个新的索引对象:
+		// parser 生成了清单文件时, 通过 raw 的版本号判断快照是否可用:
+		//  快照的版本号与 raw 相同, 直接加载快照
+		//  快照的版本号是增量文件的起始版本号, 加载快照后应用增量文件, 并保存新的快照
+		// 没有清单文件时, 快照存在 且 不比 input 旧, 直接加载快照
+		// 否则重新建立索引 并保存快照, 供下次启动使用. input 无法读取时 返回空指针
+		indexPtr loadIndex(const std::string& input, const std::string& snapshot) {
+			indexPtr index = newIndex();
+			std::uint64_t generation = 0;
+			if (ns_manifest::readGeneration(input + ns_manifest::MANIFEST_SUFFIX, &generation)) {
+				if (loadWithDelta(index.get(), input, snapshot, generation))
+					return index;
+			}
+			else {
+				struct stat inputSt, snapshotSt;
+				bool snapshotFresh = stat(snapshot.c_str(), &snapshotSt) == 0 &&
+									 (stat(input.c_str(), &inputSt) != 0 || inputSt.st_mtime <= snapshotSt.st_mtime);
+				if (snapshotFresh && index->loadSnapshot(snapshot, _verifySnapshot)) {
+					LOG(NOTICE, "加载索引快照成功 ...");
+					return index;
+				}
+			}
 
-			// 获取前50字节 和 后100字节的迭代器位置
-			if (pos > begin + prevStep)
-				begin += (pos - prevStep);
-			if (pos + nextStep < end)
-				end = pos + nextStep;
+			// 建立索引, 分词是CPU密集的, 所以使用与CPU核数相同的线程 并行建立
+			index->clear();
+			if (!index->buildIndex(input, std::max(1u, std::thread::hardware_concurrency())))
+				return nullptr;
+			index->setGeneration(generation);
+			LOG(NOTICE, "构建正派索引、倒排索引成功 ...");
+			// std::cout << "构建正排索引、倒排索引成功 ..." << std::endl;
+			index->saveSnapshot(snapshot);
+			return index;
+		}
+
+		// 加载版本号为 generation 的快照, 或加载旧快照 再应用增量文件, 都不可用时返回false
+		bool loadWithDelta(ns_index::index* index, const std::string& input, const std::string& snapshot,
+						   std::uint64_t generation) {
+			if (!index->loadSnapshot(snapshot, _verifySnapshot))
+				return false;
+			if (index->generation() == generation) {
+				LOG(NOTICE, "加载索引快照成功 ...");
+				return true;
+			}
+
+			const std::string delta = input + ns_manifest::DELTA_SUFFIX;
+			if (index->applyDelta(delta, index->generation(), generation)) {
+				LOG(NOTICE, "加载索引快照 并应用增量文件成功 ...");
+				index->saveSnapshot(snapshot);
+				return true;
+			}
+
+			return false;
+		}
+
+		// 遍历所有关键词的全部倒排拉链, 在打分累加器中汇总每个文档的权重
+		void searchExhaustive(ns_index::index* index, const std::vector<queryTerm_t>& terms, topKCollector* collector) {
+			// 统计文档用, 因为可能存在不同的分词 在倒排索引中指向同一个文档的情况
+			// 如果不去重, 会重复展示
+			// 所以使用打分累加器, 以文档id 为下标 汇总每个文档的权重
+			static thread_local scoreAccumulator accumulator;
+			accumulator.reset(index->docCount());
+			for (const queryTerm_t& term : terms) {
+				// 倒排拉链是压缩存储的, 遍历时由迭代器逐个解码
+				for (const auto& elem : *term._list) {
+					// 权重需要+= 是因为多个关键词指向了同一个文档 那么就说明此文档的与搜索内容的相关性更高
+					// 所以, 就可以将多个关键字关于此文档的权重相加, 表示搜索相关性高
+					// 最好还将 此文档相关的关键词 也记录下来, 因为在客户端搜索结果中, 需要对网页中有的关键字进行高亮
+					// 关键词通过 termBit 记录, 不需要拷贝字符串
+					accumulator.add(elem._docId, elem._weight * term._scale, term._termBit);
+				}
+			}
+
+			for (std::uint32_t docId : accumulator.touched()) {
+				invertedElemOut_t elemOut;
+				elemOut._docId = docId;
+				elemOut._weight = accumulator.weight(docId);
+				elemOut._termMask = accumulator.termMask(docId);
+				collector->push(elemOut);
+			}
+		}
+
+		// 由查询语法树 建立文档迭代器, 同时将参与计算权重的关键词 加入 terms
+		// negated 表示节点在 NOT 或 - 之下, 其中的关键词 不参与计算权重
+		// 返回 nullptr 表示节点不限制结果, 如 只有停止词的词, 上层节点忽略它
+		ns_query::docIteratorPtr buildIterator(ns_index::index* index, const ns_query::queryNode_t& node, bool negated,
+											   std::vector<queryTerm_t>* terms) {
+			typedef ns_query::queryNode_t queryNode_t;
+			std::vector<ns_util::term_t> keywords;
+			std::vector<ns_query::docIteratorPtr> must, should, mustNot;
+			switch (node._type) {
+			case queryNode_t::WORD: {
+				// 文档必须包含 分词得到的 除子词以外的所有词, 子词只参与计算权重
+				_jiebaIns->analyze(node._text, true, &keywords);
+				std::vector<std::uint32_t> required;
+				for (const ns_util::term_t& keyword : keywords) {
+					std::uint32_t termId = index->findTerm(keyword._word);
+					if (keyword._weight == ns_util::SUBWORD_WEIGHT) {
+						if (termId != ns_index::NO_TERM && !negated)
+							addQueryTerm(index, termId, terms);
+						continue;
+					}
+					if (termId == ns_index::NO_TERM)
+						return ns_query::docIteratorPtr(new ns_query::emptyIterator());
+					if (std::find(required.begin(), required.end(), termId) == required.end())
+						required.push_back(termId);
+				}
+				for (std::uint32_t termId : required) {
+					ns_query::termIterator* it = new ns_query::termIterator(index->getInvertedList(termId));
+					must.emplace_back(it);
+					if (negated)
+						continue;
+					queryTerm_t* term = addQueryTerm(index, termId, terms);
+					if (nullptr == term->_matcher)
+						term->_matcher = it;
+				}
+				break;
+			}
+			case queryNode_t::PHRASE: {
+				// 短语分词时 消除停止词, 停止词没有倒排拉链, 但仍然占一个位置, 所以 "a of b" 中 a 与 b 的相对位置是2
+				_jiebaIns->analyze(node._text, true, &keywords);
+				if (keywords.empty()) // 短语中只有停止词
+					return nullptr;
+				std::uint32_t first = keywords[0]._position;
+				for (const ns_util::term_t& keyword : keywords) {
+					first = std::min(first, keyword._position);
+				}
+				std::vector<ns_query::phraseTerm_t> phraseTerms;
+				for (const ns_util::term_t& keyword : keywords) {
+					std::uint32_t termId = index->findTerm(keyword._word);
+					if (termId == ns_index::NO_TERM)
+						return ns_query::docIteratorPtr(new ns_query::emptyIterator());
+					if (!negated)
+						addQueryTerm(index, termId, terms);
+					phraseTerms.push_back({index->getInvertedList(termId), keyword._position - first});
+				}
+				return ns_query::docIteratorPtr(new ns_query::phraseIterator(std::move(phraseTerms), node._slop));
+			}
+			case queryNode_t::NOT: {
+				ns_query::docIteratorPtr child = buildIterator(index, *node._children[0], !negated, terms);
+				if (!child)
+					return nullptr;
+				return ns_query::docIteratorPtr(new ns_query::andNotIterator(
+					ns_query::docIteratorPtr(new ns_query::allDocsIterator(index->docCount())), std::move(child)));
+			}
+			default:
+				// AND 的子节点都必须匹配, OR 的子节点匹配一个即可
+				// LIST 中 带 + 的项和短语 必须匹配, 其他项 与 OR 相同
+				// 三者中 NOT 的子节点 都作为排除条件, 不需要先求补集
+				for (const std::unique_ptr<queryNode_t>& child : node._children) {
+					if (child->_type == queryNode_t::NOT && node._type != queryNode_t::OR) {
+						ns_query::docIteratorPtr excluded = buildIterator(index, *child->_children[0], !negated, terms);
+						if (excluded)
+							mustNot.push_back(std::move(excluded));
+						continue;
+					}
+					ns_query::docIteratorPtr it = buildIterator(index, *child, negated, terms);
+					if (!it)
+						continue;
+					if (node._type == queryNode_t::AND ||
+						(node._type == queryNode_t::LIST && (child->_required || child->_type == queryNode_t::PHRASE)))
+						must.push_back(std::move(it));
+					else
+						should.push_back(std::move(it));
+				}
+				break;
+			}
+
+			// 有必须匹配的条件时, 其他条件只影响权重
+			ns_query::docIteratorPtr matcher;
+			if (!must.empty()) {
+				if (must.size() == 1)
+					matcher = std::move(must[0]);
+				else
+					matcher.reset(new ns_query::andIterator(std::move(must)));
+				if (!should.empty())
+					matcher.reset(new ns_query::reqOptIterator(std::move(matcher), std::move(should)));
+			}
+			else if (should.size() == 1)
+				matcher = std::move(should[0]);
+			else if (!should.empty())
+				matcher.reset(new ns_query::orIterator(std::move(should)));
+			else if (!mustNot.empty())
+				matcher.reset(new ns_query::allDocsIterator(index->docCount())); // 只有排除条件
+			else
+				return nullptr;
+
+			if (mustNot.size() == 1)
+				matcher.reset(new ns_query::andNotIterator(std::move(matcher), std::move(mustNot[0])));
+			else if (!mustNot.empty())
+				matcher.reset(new ns_query::andNotIterator(
+					std::move(matcher), ns_query::docIteratorPtr(new ns_query::orIterator(std::move(mustNot)))));
+			return matcher;
+		}
+
+		// 布尔查询: matcher 按文档id 递增输出匹配的文档, 每条倒排拉链 用 nextGEQ 跳到这些文档 汇总权重
+		// 交集只遍历最稀有关键词的文档, 所以 +a +b 只需要访问两条倒排拉链中 很少的一部分
+		// 关键词在 matcher 中有 termIterator 时 直接从它读取权重, 否则(子词 短语中的词) 单独用一个迭代器
+		void searchBoolean(ns_query::docIterator* matcher, const std::vector<queryTerm_t>& terms,
+						   topKCollector* collector) {
+			std::vector<ns_index::postingList::iterator> its;
+			for (const queryTerm_t& term : terms) {
+				its.push_back(term._list->begin());
+			}
+			for (std::uint32_t docId = matcher->doc(); docId != ns_query::END_DOC; docId = matcher->doc()) {
+				invertedElemOut_t elemOut;
+				elemOut._docId = docId;
+				elemOut._weight = 0;
+				elemOut._termMask = 0;
+				for (std::size_t i = 0; i < terms.size(); i++) {
+					if (nullptr != terms[i]._matcher) {
+						terms[i]._matcher->nextGEQ(docId);
+						if (terms[i]._matcher->doc() == docId) {
+							elemOut._weight += terms[i]._matcher->weight() * terms[i]._scale;
+							elemOut._termMask |= terms[i]._termBit;
+						}
+						continue;
+					}
+					its[i].nextGEQ(docId);
+					if (its[i].valid() && its[i]->_docId == docId) {
+						elemOut._weight += its[i]->_weight * terms[i]._scale;
+						elemOut._termMask |= terms[i]._termBit;
+					}
+				}
+				collector->push(elemOut);
+				matcher->nextGEQ(docId + 1);
+			}
+		}
+
+		// WAND / Block-Max WAND
+		// 每个关键词一个游标, 所有游标按当前文档id 递增的顺序 同时遍历倒排拉链
+		// 每条倒排拉链都知道自己的最大权重, 所以 按当前文档id 排序游标后, 依次累加游标的最大权重
+		// 累加值第一次超过 进入结果所需的权重(threshold) 时, 对应游标的文档就是 pivot:
+		//  文档id 小于 pivot 的文档, 最多只能被 pivot 之前的游标命中, 权重上限不超过threshold, 不可能进入结果, 可以直接跳过
+		// 再用 pivot 所在块的最大权重 进一步估计上限, 仍不超过threshold时, 整块跳过
+		// 文档是按id 递增处理的, 已选出文档的id 都更小, 所以权重等于threshold 的文档也不可能进入结果
+		// 最终结果与 searchExhaustive 完全相同
+		void searchWand(const std::vector<queryTerm_t>& terms, topKCollector* collector) {
+			// 遍历完的游标 文档id 记为 endDoc, 总是排在最后
+			const std::uint32_t endDoc = std::numeric_limits<std::uint32_t>::max();
+			typedef struct cursor {
+				ns_index::postingList::iterator _it;
+				const queryTerm_t* _term;
+				std::uint64_t _maxWeight; // 此游标可能贡献的最大权重
+				std::uint32_t _docId;	  // 当前文档id
+			} cursor_t;
+
+			std::vector<cursor_t> cursors;
+			for (const queryTerm_t& term : terms) {
+				cursors.push_back({term._list->begin(), &term, term._list->maxWeight() * term._scale,
+								   static_cast<std::uint32_t>(term._list->begin()->_docId)});
+			}
+			auto update = [endDoc](cursor_t& cur) {
+				cur._docId = cur._it.valid() ? static_cast<std::uint32_t>(cur._it->_docId) : endDoc;
+			};
+			// 每轮只有少数游标移动, 游标基本有序, 插入排序即可
+			auto sortCursors = [&cursors]() {
+				for (std::size_t i = 1; i < cursors.size(); i++) {
+					for (std::size_t j = i; j > 0 && cursors[j]._docId < cursors[j - 1]._docId; j--) {
+						std::swap(cursors[j], cursors[j - 1]);
+					}
+				}
+			};
+
+			sortCursors();
+			while (cursors[0]._docId != endDoc) {
+				// 找 pivot
+				const std::uint64_t threshold = collector->threshold();
+				std::uint64_t upperBound = 0;
+				std::size_t pivot = 0;
+				for (; pivot < cursors.size() && cursors[pivot]._docId != endDoc; pivot++) {
+					upperBound += cursors[pivot]._maxWeight;
+					if (upperBound > threshold)
+						break;
+				}
+				if (pivot == cursors.size() || cursors[pivot]._docId == endDoc) // 剩下的文档都不可能进入结果了
+					break;
+				const std::uint32_t pivotDoc = cursors[pivot]._docId;
+				while (pivot + 1 < cursors.size() && cursors[pivot + 1]._docId == pivotDoc) {
+					pivot++;
+				}
+
+				// 已经选满结果时, 再用块的最大权重估计 [pivotDoc, nextDoc) 中文档的权重上限
+				if (threshold > 0) {
+					std::uint32_t nextDoc = pivot + 1 < cursors.size() ? cursors[pivot + 1]._docId : endDoc;
+					std::uint64_t blockUpperBound = 0;
+					for (std::size_t i = 0; i <= pivot; i++) {
+						const ns_index::postingBlock_t* block = cursors[i]._it.shallowBlock(pivotDoc);
+						if (nullptr == block)
+							continue;
+						blockUpperBound += block->_maxWeight * cursors[i]._term->_scale;
+						nextDoc = std::min(nextDoc, block->_lastDocId + 1);
+					}
+					if (blockUpperBound <= threshold) {
+						for (std::size_t i = 0; i <= pivot; i++) {
+							cursors[i]._it.nextGEQ(nextDoc);
+							update(cursors[i]);
+						}
+						sortCursors();
+						continue;
+					}
+				}
+
+				if (cursors[0]._docId == pivotDoc) {
+					// pivot 之前的游标 都已经指向了 pivotDoc, 计算 pivotDoc 的权重
+					invertedElemOut_t elemOut;
+					elemOut._docId = pivotDoc;
+					elemOut._weight = 0;
+					elemOut._termMask = 0;
+					for (std::size_t i = 0; i <= pivot; i++) {
+						elemOut._weight += cursors[i]._it->_weight * cursors[i]._term->_scale;
+						elemOut._termMask |= cursors[i]._term->_termBit;
+						++cursors[i]._it;
+						update(cursors[i]);
+					}
+					collector->push(elemOut);
+				}
+				else {
+					// 将 pivot 之前的游标 移动到 pivotDoc
+					for (std::size_t i = 0; i <= pivot && cursors[i]._docId < pivotDoc; i++) {
+						cursors[i]._it.nextGEQ(pivotDoc);
+						update(cursors[i]);
+					}
+				}
+				sortCursors();
+			}
+		}
+
+	public:
+		std::string getDesc(ns_index::textRef content, const std::string& keyword) {
+			return getDesc(content, keyword.data(), keyword.size());
+		}
+		// 关键词以 指针和长度 传入, 可以直接使用词典中的关键词
+		// 与搜索结果中的摘要相同, 以关键词在内容中 第一次出现的位置为锚点截取, 但只使用一个关键词, 也没有高亮
+		std::string getDesc(ns_index::textRef content, const char* keyword, std::size_t keywordLen) {
+			std::size_t pos = findKeyword(content, keyword, keywordLen, 0);
+			if (pos == std::string::npos)
+				return "keyword does not exist!";
 
+			std::size_t begin = 0;
+			std::size_t end = 0;
+			snippetRange(content, pos, &begin, &end);
 			if (begin >= end)
 				return "nothing!";
 
 			// 获取摘要
 			std::string desc;
-			if (content.begin() + begin > content.begin())
+			if (begin > 0)
 				desc = "...";
-			desc += content.substr(begin, end - begin);
-			if (content.begin() + end < content.end())
+			desc.append(content.data() + begin, end - begin);
+			if (end < content.size())
 				desc += "...";
 
 			return desc;
 		}
+
+	private:
+		// 为文档选出摘要, 并找出摘要中需要高亮的关键词. termMask 为文档命中的关键词, 第i位 对应 terms[i]
+		// 摘要的范围 写入 result, 高亮追加到 highlights 中
+		void buildSnippet(ns_index::index* index, const ns_index::docInfo_t& doc, const std::vector<queryTerm_t>& terms,
+						  std::uint64_t termMask, searchResult_t* result, std::vector<highlight_t>* highlights) {
+			// 选择窗口时使用的临时数组, 每个线程一个, 不需要为每个结果分配内存
+			static thread_local std::vector<std::pair<std::uint32_t, std::uint32_t>> hits; // (内容中的位置, 关键词下标)
+			static thread_local std::vector<std::uint32_t> positions;
+			const std::size_t termNum = std::min(terms.size(), MAX_TERM_BITS);
+
+			// 1. 汇总命中的关键词 在内容中的位置
+			hits.clear();
+			for (std::size_t i = 0; i < termNum; i++) {
+				if (!(termMask >> i & 1))
+					continue;
+				index->contentPositions(terms[i]._termId, doc, SNIPPET_MAX_POSITIONS, &positions);
+				for (std::uint32_t position : positions) {
+					hits.emplace_back(position, i);
+				}
+			}
+			std::sort(hits.begin(), hits.end());
+
+			// 2. 滑动窗口: 窗口 [hits[left], hits[right]] 的宽度小于 SNIPPET_WINDOW 个位置
+			// counts 记录窗口中每个关键词出现的次数, 选出 不同关键词最多的窗口, 相同时 选靠前的
+			std::uint8_t counts[MAX_TERM_BITS] = {0};
+			std::size_t distinct = 0, bestDistinct = 0, best = hits.size();
+			for (std::size_t left = 0, right = 0; right < hits.size(); right++) {
+				if (counts[hits[right].second]++ == 0)
+					distinct++;
+				while (hits[right].first - hits[left].first >= SNIPPET_WINDOW) {
+					if (--counts[hits[left].second] == 0)
+						distinct--;
+					left++;
+				}
+				if (distinct > bestDistinct) {
+					bestDistinct = distinct;
+					best = left;
+				}
+			}
+
+			// 3. 以窗口中的第一个关键词为锚点 截取摘要. 内容中没有命中的关键词时(只命中了标题, 或只由排除条件匹配), 从内容开头截取
+			std::size_t anchor = 0;
+			if (best < hits.size()) {
+				std::size_t keywordLen = 0;
+				const char* keyword = index->getTerm(terms[hits[best].second]._termId, &keywordLen);
+				std::size_t from = ns_index::index::contentOffset(doc, hits[best].first);
+				anchor = findWord(doc._content, from, doc._content.size(), keyword, keywordLen);
+				if (anchor == std::string::npos)
+					anchor = findKeyword(doc._content, keyword, keywordLen, from);
+				if (anchor == std::string::npos)
+					anchor = 0;
+			}
+			std::size_t begin = 0;
+			std::size_t end = 0;
+			snippetRange(doc._content, anchor, &begin, &end);
+			result->_descBegin = begin;
+			result->_descEnd = end;
+
+			// 4. 找出摘要中 所有命中的关键词, 按起始位置排序, 重叠时 只保留靠前的, 起始位置相同时 保留较长的
+			// 如 boost::asio::io_context 与其中的 io_context
+			const std::size_t first = highlights->size();
+			for (std::size_t i = 0; i < termNum; i++) {
+				if (!(termMask >> i & 1))
+					continue;
+				std::size_t keywordLen = 0;
+				const char* keyword = index->getTerm(terms[i]._termId, &keywordLen);
+				// 单个标点 到处都是, 不高亮
+				if (keywordLen == 1 && !isWordByte(keyword[0]))
+					continue;
+				std::size_t pos = begin;
+				while ((pos = findWord(doc._content, pos, end, keyword, keywordLen)) != std::string::npos) {
+					highlights->push_back({static_cast<std::uint32_t>(pos), static_cast<std::uint32_t>(pos + keywordLen)});
+					pos += keywordLen;
+				}
+			}
+			std::sort(highlights->begin() + first, highlights->end(), [](const highlight_t& a, const highlight_t& b) {
+				return a._begin < b._begin || (a._begin == b._begin && a._end > b._end);
+			});
+			std::size_t kept = first;
+			for (std::size_t i = first; i < highlights->size(); i++) {
+				if (kept > first && (*highlights)[i]._begin < (*highlights)[kept - 1]._end)
+					continue;
+				(*highlights)[kept++] = (*highlights)[i];
+			}
+			highlights->resize(kept);
+			result->_highlightBegin = first;
+			result->_highlightEnd = kept;
+		}
+
+		static bool isWordByte(char c) {
+			return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9');
+		}
+		// UTF-8 多字节字符中 除第一个字节之外的字节
+		static bool isContinuationByte(char c) {
+			return (c & 0xc0) == 0x80;
+		}
+
+		// 锚点 anchor 附近的摘要范围 [*begin, *end): 从锚点之前 SNIPPET_BEFORE 字节开始, 长度为 SNIPPET_LENGTH 字节
+		// 靠近内容末尾时 向前扩展, 保证摘要的长度. 边界不切断 UTF-8 字符, 也尽量不切断英文单词
+		static void snippetRange(ns_index::textRef content, std::size_t anchor, std::size_t* begin, std::size_t* end) {
+			const std::size_t size = content.size();
+			std::size_t b = anchor > SNIPPET_BEFORE ? anchor - SNIPPET_BEFORE : 0;
+			std::size_t e = std::min(size, b + SNIPPET_LENGTH);
+			if (e - b < SNIPPET_LENGTH)
+				b = e > SNIPPET_LENGTH ? e - SNIPPET_LENGTH : 0;
+
+			// 起始边界 向后移动到 字符 和单词的开头
+			if (b > 0) {
+				while (b < e && isContinuationByte(content[b]))
+					b++;
+				std::size_t word = b;
+				while (word < e && word - b < SNIPPET_MAX_SNAP && isWordByte(content[word - 1]) && isWordByte(content[word]))
+					word++;
+				if (word - b < SNIPPET_MAX_SNAP && word <= anchor)
+					b = word;
+			}
+			// 结束边界 向前移动到 字符 和单词的结尾
+			if (e < size) {
+				while (e > b && isContinuationByte(content[e]))
+					e--;
+				std::size_t word = e;
+				while (word > b && e - word < SNIPPET_MAX_SNAP && isWordByte(content[word - 1]) && isWordByte(content[word]))
+					word--;
+				if (e - word < SNIPPET_MAX_SNAP && word > anchor)
+					e = word;
+			}
+
+			*begin = b;
+			*end = e;
+		}
+
+		// 在 [from, to) 中 查找作为完整单词出现的关键词, 找不到时返回 npos
+		// 关键词的开头和结尾 都必须在单词的边界上, 这样 搜索 io 时 不会找到 ratio 中的 io
+		// 单词的边界 与分词时拆分子词的规则相同: 非字母数字(包括 '_' 和 ':') 以及 小写字母或数字之后的大写字母
+		// 所以 io_context 中的 context, 以及 去掉标签之后 连在一起的 memoryHome 中的 memory 也可以找到
+		std::size_t findWord(ns_index::textRef content, std::size_t from, std::size_t to, const char* keyword,
+							 std::size_t keywordLen) {
+			const char* text = content.data();
+			const char* textEnd = text + content.size();
+			const char* end = text + to;
+			const char* p = text + std::min(from, to);
+			while ((p = ns_util::stringUtil::findIgnoreCase(p, end, keyword, keywordLen)) != end) {
+				if ((p == text || isWordBoundary(p[-1], p[0])) &&
+					(p + keywordLen == textEnd || isWordBoundary(p[keywordLen - 1], p[keywordLen])))
+					return p - text;
+				p++;
+			}
+
+			return std::string::npos;
+		}
+
+		// 相邻的两个字节 prev next 之间 是否是单词的边界
+		static bool isWordBoundary(char prev, char next) {
+			if (!isWordByte(prev) || !isWordByte(next))
+				return true;
+			bool prevLowerOrDigit = ('a' <= prev && prev <= 'z') || ('0' <= prev && prev <= '9');
+			return prevLowerOrDigit && 'A' <= next && next <= 'Z';
+		}
+
+		// 从 from 开始 查找关键词在正文中 第一次出现的位置, 找不到时返回 npos
+		std::size_t findKeyword(ns_index::textRef content, const char* keyword, std::size_t keywordLen,
+								std::size_t from) {
+			// std::size_t pos = content.find(keyword);
+			// 直接这样处理, 会出现一个问题:
+			// keyword是有大小写的. 倒排索引中查找 我们实现的是忽略大小写, 所以可以找到文档
+			// 而 string::find() 是区分大小写的查找, 可能无法在内容中找到对应的关键词
+			// string容器也没有提供不区分大小写的查找方法
+			// 所以使用 stringUtil::findIgnoreCase(), 它用 SSE2 筛选候选位置, 比逐字节 tolower 比较快得多
+			// 而且 from 通常就在关键词之前不远处, 查找的长度 与摘要长度相当, 与文档长度无关
+			// from 之后找不到时(例如 from 不是由索引得到的), 再从头查找
+			const char* text = content.data();
+			const char* textEnd = text + content.size();
+			const char* found = ns_util::stringUtil::findIgnoreCase(text + std::min(from, content.size()), textEnd,
+																	keyword, keywordLen);
+			if (found == textEnd && from > 0)
+				found = ns_util::stringUtil::findIgnoreCase(text, textEnd, keyword, keywordLen);
+			if (found == textEnd)
+				return std::string::npos;
+
+			return found - text;
+		}
+
+		// 写入摘要 和高亮. 摘要直接从正文中转义后 写入 json, 不生成中间字符串
+		// 高亮写为 [[起始, 结束], ...], 是 desc 字符串中的 UTF-16 偏移, 前端可以直接用于截取 desc
+		void writeDesc(ns_index::textRef content, const searchResult_t& result,
+					   const std::vector<highlight_t>& highlights, resultWriter* writer) {
+			const std::size_t begin = result._descBegin;
+			const std::size_t end = result._descEnd;
+			writer->beginField("desc");
+			if (begin >= end) {
+				writer->appendEscaped("nothing!", 8);
+				writer->endField();
+				writer->beginRawField("highlights");
+				writer->appendRaw('[');
+				writer->appendRaw(']');
+				return;
+			}
+			if (begin > 0)
+				writer->appendEscaped("...", 3);
+			writer->appendEscaped(content.data() + begin, end - begin);
+			if (end < content.size())
+				writer->appendEscaped("...", 3);
+			writer->endField();
+
+			// 从摘要开头 向后统计 UTF-16 单元数: UTF-8 中 除后续字节外的每个字节 都是一个字符的开始
+			// 4字节的 UTF-8 字符 在 UTF-16 中是两个单元
+			std::size_t units = begin > 0 ? 3 : 0;
+			std::size_t pos = begin;
+			auto advance = [&content, &units, &pos](std::size_t to) {
+				for (; pos < to; pos++) {
+					unsigned char c = content[pos];
+					units += !isContinuationByte(c) + (c >= 0xf0);
+				}
+			};
+			writer->beginRawField("highlights");
+			writer->appendRaw('[');
+			for (std::size_t i = result._highlightBegin; i < result._highlightEnd; i++) {
+				advance(highlights[i]._begin);
+				if (i > result._highlightBegin)
+					writer->appendRaw(',');
+				writer->appendRaw('[');
+				writer->appendNumber(units);
+				advance(highlights[i]._end);
+				writer->appendRaw(',');
+				writer->appendNumber(units);
+				writer->appendRaw(']');
+			}
+			writer->appendRaw(']');
+		}
 	};
 } // namespace ns_searcher
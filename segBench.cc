@@ -0,0 +1,242 @@
+// 分词性能测试程序
+// 分词时 cppjieba 会对句子中的每个字, 在词典树中查找以它开头的所有词(Trie::Find), 这是分词中最频繁的操作
+// 本程序使用同一份词典 分别建立 基于哈希表节点的 Trie 和 双数组 DoubleArrayTrie
+// 对 data/output/raw 中的文档 分别用两者查找, 比较吞吐量, 并检查两者的查找结果完全相同
+// 存在编译词典(jiebaCompile 生成)时, 比较 加载文本词典与加载编译词典 的耗时, 并检查两者的查找结果相同
+// 最后测试 完整分词的吞吐量: 整个文档交给 jieba 的 CutForSearch, 与 jiebaUtil 的 ASCII 快速分词 比较, 并统计结果不同的文档数
+//
+// 用法: ./segBench [文档文件] [最多测试的文档数]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "cppjieba/DoubleArrayTrie.hpp"
+#include "cppjieba/SegmentBase.hpp"
+#include "util.hpp"
+
+typedef std::chrono::steady_clock benchClock;
+
+static double secondsSince(const benchClock::time_point& start) {
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// 按 DictTrie::LoadDict 的格式读取词典: 每行 "词 词频 词性"
+static bool loadDict(const std::string& path, std::vector<cppjieba::Unicode>* words,
+					 std::vector<cppjieba::DictUnit>* units) {
+	std::ifstream in(path);
+	if (!in.is_open()) {
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		std::size_t pos = line.find(' ');
+		cppjieba::Unicode word;
+		if (!cppjieba::DecodeRunesInString(line.substr(0, pos), word))
+			continue;
+		cppjieba::DictUnit unit;
+		unit.weight = pos == std::string::npos ? 0 : atof(line.c_str() + pos + 1);
+		unit.length = word.size();
+		unit.tag = 0;
+		words->push_back(word);
+		units->push_back(unit);
+	}
+
+	return !units->empty();
+}
+
+// 两次查找的结果是否完全相同
+static bool sameDags(const std::vector<cppjieba::Dag>& dags1, const std::vector<cppjieba::Dag>& dags2) {
+	if (dags1.size() != dags2.size())
+		return false;
+	for (std::size_t i = 0; i < dags1.size(); i++) {
+		if (dags1[i].nexts.size() != dags2[i].nexts.size())
+			return false;
+		for (std::size_t j = 0; j < dags1[i].nexts.size(); j++) {
+			if (dags1[i].nexts[j] != dags2[i].nexts[j])
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// 两个不同的 DictTrie 的查找结果是否相同: DictUnit 不是同一个对象, 所以比较内容
+static bool sameUnits(const cppjieba::DictTrie& trie1, const std::vector<cppjieba::Dag>& dags1,
+					  const cppjieba::DictTrie& trie2, const std::vector<cppjieba::Dag>& dags2) {
+	if (dags1.size() != dags2.size())
+		return false;
+	for (std::size_t i = 0; i < dags1.size(); i++) {
+		if (dags1[i].nexts.size() != dags2[i].nexts.size())
+			return false;
+		for (std::size_t j = 0; j < dags1[i].nexts.size(); j++) {
+			const cppjieba::DictUnit* unit1 = dags1[i].nexts[j].second;
+			const cppjieba::DictUnit* unit2 = dags2[i].nexts[j].second;
+			if (dags1[i].nexts[j].first != dags2[i].nexts[j].first || (unit1 == NULL) != (unit2 == NULL))
+				return false;
+			if (unit1 != NULL && (unit1->weight != unit2->weight || unit1->length != unit2->length ||
+								  strcmp(trie1.GetTag(*unit1), trie2.GetTag(*unit2)) != 0))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	const std::string input = argc > 1 ? argv[1] : "data/output/raw";
+	const std::size_t maxDocs = argc > 2 ? atol(argv[2]) : static_cast<std::size_t>(-1);
+
+	std::vector<cppjieba::Unicode> words;
+	std::vector<cppjieba::DictUnit> units;
+	if (!loadDict(ns_util::DICT_PATH, &words, &units))
+		return 1;
+	std::vector<const cppjieba::DictUnit*> values;
+	for (const cppjieba::DictUnit& unit : units) {
+		values.push_back(&unit);
+	}
+
+	benchClock::time_point start = benchClock::now();
+	cppjieba::Trie trie(words, values);
+	double trieBuild = secondsSince(start);
+	start = benchClock::now();
+	cppjieba::DoubleArrayTrie daTrie(words, units.data());
+	double daTrieBuild = secondsSince(start);
+	printf("dict words: %lu\n", units.size());
+	printf("build: Trie %.3f s, DoubleArrayTrie %.3f s (%lu nodes in %lu slots)\n", trieBuild, daTrieBuild,
+		   daTrie.NodeCount(), daTrie.ArraySize());
+
+	std::ifstream in(input);
+	if (!in.is_open()) {
+		std::cerr << "Failed to open " << input << std::endl;
+		return 1;
+	}
+
+	// 与分词时一样, 先按分隔符 将文档切分为句子, 再对每个句子查找
+	std::unordered_set<cppjieba::Rune> symbols;
+	cppjieba::RuneStrArray separators;
+	cppjieba::DecodeRunesInString(cppjieba::SPECIAL_SEPARATORS, separators);
+	for (const cppjieba::RuneStr& rune : separators) {
+		symbols.insert(rune.rune);
+	}
+
+	std::vector<std::string> docs;
+	std::size_t bytes = 0;
+	std::string line;
+	while (docs.size() < maxDocs && std::getline(in, line)) {
+		// 只测试 title 和 content, 去掉 url
+		std::size_t pos = line.rfind('\3');
+		docs.push_back(line.substr(0, pos));
+		bytes += docs.back().size();
+	}
+	printf("docs: %lu, %.1f MB\n", docs.size(), bytes / 1048576.0);
+
+	// 每个文档的所有句子 先用 Trie 查找一遍, 再用 DoubleArrayTrie 查找一遍, 分别计时
+	double trieTime = 0, daTrieTime = 0;
+	std::size_t sentences = 0, mismatches = 0;
+	std::vector<cppjieba::PreFilter::Range> ranges;
+	std::vector<std::vector<cppjieba::Dag>> dags1, dags2;
+	for (const std::string& doc : docs) {
+		cppjieba::PreFilter filter(symbols, doc);
+		ranges.clear();
+		while (filter.HasNext()) {
+			ranges.push_back(filter.Next());
+		}
+		dags1.assign(ranges.size(), std::vector<cppjieba::Dag>());
+		dags2.assign(ranges.size(), std::vector<cppjieba::Dag>());
+
+		start = benchClock::now();
+		for (std::size_t i = 0; i < ranges.size(); i++) {
+			trie.Find(ranges[i].begin, ranges[i].end, dags1[i]);
+		}
+		trieTime += secondsSince(start);
+
+		start = benchClock::now();
+		for (std::size_t i = 0; i < ranges.size(); i++) {
+			daTrie.Find(ranges[i].begin, ranges[i].end, dags2[i]);
+		}
+		daTrieTime += secondsSince(start);
+
+		sentences += ranges.size();
+		for (std::size_t i = 0; i < ranges.size(); i++) {
+			if (!sameDags(dags1[i], dags2[i]))
+				mismatches++;
+		}
+	}
+	printf("Find over %lu sentences: Trie %.3f s (%.1f MB/s), DoubleArrayTrie %.3f s (%.1f MB/s), speedup %.2fx\n",
+		   sentences, trieTime, bytes / 1048576.0 / trieTime, daTrieTime, bytes / 1048576.0 / daTrieTime,
+		   trieTime / daTrieTime);
+	printf("mismatched sentences: %lu\n", mismatches);
+
+	// 分别加载 文本词典 和 编译词典, 比较耗时和查找结果
+	start = benchClock::now();
+	cppjieba::DictTrie textTrie(ns_util::DICT_PATH, ns_util::USER_DICT_PATH);
+	double textLoad = secondsSince(start);
+	start = benchClock::now();
+	cppjieba::CompiledDict compiled;
+	if (compiled.Load(ns_util::COMPILED_DICT_PATH, 0)) {
+		cppjieba::DictTrie compiledTrie(compiled);
+		double compiledLoad = secondsSince(start);
+
+		std::size_t compiledMismatches = 0;
+		std::vector<cppjieba::Dag> textDags, compiledDags;
+		for (const std::string& doc : docs) {
+			cppjieba::PreFilter filter(symbols, doc);
+			while (filter.HasNext()) {
+				cppjieba::PreFilter::Range range = filter.Next();
+				textDags.clear();
+				compiledDags.clear();
+				textTrie.Find(range.begin, range.end, textDags);
+				compiledTrie.Find(range.begin, range.end, compiledDags);
+				if (!sameUnits(textTrie, textDags, compiledTrie, compiledDags))
+					compiledMismatches++;
+			}
+		}
+		printf("dict load: text %.3f s, compiled %.3f s\n", textLoad, compiledLoad);
+		printf("mismatched sentences (text vs compiled): %lu\n", compiledMismatches);
+		mismatches += compiledMismatches;
+	}
+	else {
+		printf("dict load: text %.3f s, no usable compiled dict at %s\n", textLoad, ns_util::COMPILED_DICT_PATH);
+	}
+
+	// 完整分词: 整个文档交给 jieba 的 CutForSearch, 与 jiebaUtil 只把非ASCII部分交给 jieba 比较
+	cppjieba::Jieba* fullJieba =
+		compiled.IsLoaded()
+			? new cppjieba::Jieba(compiled, ns_util::IDF_PATH, ns_util::STOP_WORD_PATH)
+			: new cppjieba::Jieba(ns_util::DICT_PATH, ns_util::HMM_PATH, ns_util::USER_DICT_PATH, ns_util::IDF_PATH,
+								  ns_util::STOP_WORD_PATH);
+	ns_util::jiebaUtil* jieba = ns_util::jiebaUtil::getInstance();
+	std::vector<std::vector<std::string>> fullResults(docs.size());
+	std::vector<std::string> result;
+	std::size_t wordCnt = 0, docMismatches = 0;
+	start = benchClock::now();
+	for (std::size_t i = 0; i < docs.size(); i++) {
+		fullJieba->CutForSearch(docs[i], fullResults[i]);
+		wordCnt += fullResults[i].size();
+	}
+	double fullTime = secondsSince(start);
+	printf("CutForSearch: %.3f s (%.1f MB/s), %lu words\n", fullTime, bytes / 1048576.0 / fullTime, wordCnt);
+
+	wordCnt = 0;
+	double cutTime = 0;
+	for (std::size_t i = 0; i < docs.size(); i++) {
+		start = benchClock::now();
+		jieba->cutString(docs[i], &result);
+		cutTime += secondsSince(start);
+		wordCnt += result.size();
+		if (result != fullResults[i])
+			docMismatches++;
+	}
+	printf("jiebaUtil::cutString: %.3f s (%.1f MB/s), %lu words, speedup %.2fx\n", cutTime,
+		   bytes / 1048576.0 / cutTime, wordCnt, fullTime / cutTime);
+	// 词典中有英文词时, CutForSearch 还会输出英文单词中 出现在词典里的2字、3字子串, cutString 不会, 所以结果可以不同
+	printf("mismatched docs (CutForSearch vs cutString): %lu\n", docMismatches);
+	delete fullJieba;
+
+	return mismatches == 0 ? 0 : 2;
+}
@@ -0,0 +1,84 @@
+// 本文件实现 相同请求的合并执行(single flight)
+
+// 缓存被清空 或 条目过期之后, 热门查询的大量并发请求 会同时发现缓存未命中
+// 如果每个请求都各自搜索一次, 这些请求会在同一时刻 重复做完全相同的工作
+// singleFlight 保证同一个键 同一时刻只有一个线程(领头者)在计算:
+//  其他线程 发现这个键正在计算时, 不再重复计算, 而是等待领头者完成, 直接共享它的结果
+//  计算完成后 这个键就从正在计算的表中删除, 之后的请求 应该先从缓存中获取结果
+// 结果以 shared_ptr<const V> 共享, 等待的线程之间 不需要复制结果
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ns_cache {
+	template <class V>
+	class singleFlight {
+	public:
+		typedef std::shared_ptr<const V> valuePtr;
+
+		singleFlight() {}
+		singleFlight(const singleFlight&) = delete;
+		singleFlight& operator=(const singleFlight&) = delete;
+
+		// 执行 key 对应的计算 fn, fn 返回 valuePtr
+		// 已经有线程在计算 key 时, 等待并返回它的结果, shared 被设置为 true
+		// 领头者的 fn 抛出异常时, 等待的线程得到空指针, 异常继续抛给领头者的调用者
+		template <class Fn>
+		valuePtr run(const std::string& key, Fn fn, bool* shared = nullptr) {
+			std::shared_ptr<call_t> call;
+			{
+				std::unique_lock<std::mutex> lock(_mtx);
+				auto it = _calls.find(key);
+				if (it != _calls.end()) {
+					call = it->second;
+					call->_cond.wait(lock, [&call]() { return call->_done; });
+					if (shared)
+						*shared = true;
+					return call->_value;
+				}
+				call = std::make_shared<call_t>();
+				_calls[key] = call;
+			}
+
+			if (shared)
+				*shared = false;
+			valuePtr value;
+			try {
+				value = fn();
+			}
+			catch (...) {
+				finish(key, call, nullptr);
+				throw;
+			}
+			finish(key, call, value);
+			return value;
+		}
+
+	private:
+		typedef struct call {
+			std::condition_variable _cond;
+			bool _done;
+			valuePtr _value;
+
+			call()
+				: _done(false) {}
+		} call_t;
+
+		// 记录结果 并唤醒所有等待的线程, 之后的请求 不再加入这次计算
+		void finish(const std::string& key, const std::shared_ptr<call_t>& call, valuePtr value) {
+			std::lock_guard<std::mutex> lock(_mtx);
+			call->_value = std::move(value);
+			call->_done = true;
+			_calls.erase(key);
+			call->_cond.notify_all();
+		}
+
+		std::mutex _mtx; // 保护 _calls, 等待的线程也在这把锁上等待
+		std::unordered_map<std::string, std::shared_ptr<call_t>> _calls;
+	};
+} // namespace ns_cache
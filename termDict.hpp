@@ -0,0 +1,185 @@
+// 本文件实现 倒排索引的词典
+
+// 倒排索引如果用 unordered_map<std::string, 倒排拉链> 存储, 每个关键字都是一个单独分配的 string,
+// 再加上哈希表节点本身, 几十万个关键字 就有几十万次内存分配, 每个关键字还要额外占用几十个字节
+// 所以 用词典为每个关键字分配一个 稠密的 termId, 倒排拉链存储在以 termId 为下标的 vector 中
+// 词典中:
+//  所有关键字 首尾相接存储在同一个字符串 _arena 中, 第i个关键字的范围是 [_offsets[i], _offsets[i + 1])
+//  用开放寻址的哈希表 通过关键字查找 termId, 哈希表的每个槽只存储一个 termId
+// 搜索时 只需要查找一次 termId, 之后都通过 termId 访问倒排拉链和关键字, 不需要再复制关键字
+// 从索引快照加载的词典 连同哈希表 都直接指向快照的映射, 不需要重新插入所有关键字. 添加关键字之前 才复制到自己的内存中
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "arrayRef.hpp"
+#include "util.hpp"
+
+namespace ns_index {
+	// 查找不到关键字时 返回的 termId
+	const std::uint32_t NO_TERM = std::numeric_limits<std::uint32_t>::max();
+
+	class termDict {
+	public:
+		termDict()
+			: _offsets(1, 0)
+			, _mask(0)
+			, _mapped(false) {}
+
+		// 关键字数, termId 的范围就是 [0, size())
+		std::size_t size() const { return offsets().size() - 1; }
+
+		// 查找关键字的 termId, 不存在时返回 NO_TERM
+		std::uint32_t find(const char* word, std::size_t len) const {
+			arrayRef<std::uint32_t> table = slots();
+			if (table.empty())
+				return NO_TERM;
+			for (std::size_t slot = hash(word, len) & _mask;; slot = (slot + 1) & _mask) {
+				std::uint32_t termId = table[slot];
+				if (termId == NO_TERM || equal(termId, word, len))
+					return termId;
+			}
+		}
+		std::uint32_t find(const std::string& word) const { return find(word.data(), word.size()); }
+
+		// 查找关键字的 termId, 不存在时 添加到词典中, 新的 termId 为 size()
+		std::uint32_t insert(const char* word, std::size_t len) {
+			own();
+			// 保持负载因子不超过 1/2
+			if ((size() + 1) * 2 > _slots.size())
+				rehash(std::max<std::size_t>(16, _slots.size() * 2));
+			std::size_t slot = hash(word, len) & _mask;
+			for (; _slots[slot] != NO_TERM; slot = (slot + 1) & _mask) {
+				if (equal(_slots[slot], word, len))
+					return _slots[slot];
+			}
+
+			std::uint32_t termId = size();
+			_arena.append(word, len);
+			_offsets.push_back(_arena.size());
+			_slots[slot] = termId;
+			return termId;
+		}
+		std::uint32_t insert(const std::string& word) { return insert(word.data(), word.size()); }
+
+		// termId 对应的关键字, 指向词典内部, 词典修改后失效
+		const char* term(std::uint32_t termId) const { return arena().data() + offsets()[termId]; }
+		std::size_t termLength(std::uint32_t termId) const {
+			arrayRef<std::uint32_t> table = offsets();
+			return table[termId + 1] - table[termId];
+		}
+		std::string termString(std::uint32_t termId) const { return std::string(term(termId), termLength(termId)); }
+
+		void clear() {
+			_arena.clear();
+			_offsets.assign(1, 0);
+			_slots.clear();
+			_mask = 0;
+			_mapped = false;
+			_mappedArena = textRef();
+			_mappedOffsets = arrayRef<std::uint32_t>();
+			_mappedSlots = arrayRef<std::uint32_t>();
+		}
+
+		// 建立完成之后, 释放多余的容量
+		void shrink() {
+			_arena.shrink_to_fit();
+			_offsets.shrink_to_fit();
+		}
+
+		// 以下接口用于 索引快照的保存与加载, 指向快照的映射 或 自己的内存
+		textRef arena() const { return _mapped ? _mappedArena : textRef(_arena); }
+		arrayRef<std::uint32_t> offsets() const {
+			return _mapped ? _mappedOffsets : arrayRef<std::uint32_t>(_offsets);
+		}
+		arrayRef<std::uint32_t> slots() const { return _mapped ? _mappedSlots : arrayRef<std::uint32_t>(_slots); }
+
+		// 直接使用快照映射中的 _arena _offsets 和哈希表, 不复制. 映射必须比词典存活得更久
+		// 检查偏移递增, 以及哈希表中 恰好有 size() 个有效的 termId, 保证查找一定会遇到空槽 而结束
+		// 不读取关键字本身, 关键字的内容 由快照的校验和保证. 数据无效时返回false
+		bool map(textRef arena, arrayRef<std::uint32_t> offsets, arrayRef<std::uint32_t> slots) {
+			if (offsets.empty() || offsets[0] != 0 || offsets.back() != arena.size())
+				return false;
+			for (std::size_t i = 1; i < offsets.size(); i++) {
+				if (offsets[i] < offsets[i - 1])
+					return false;
+			}
+			const std::size_t termCount = offsets.size() - 1;
+			if ((slots.size() & (slots.size() - 1)) != 0 || (termCount > 0 && slots.size() <= termCount))
+				return false;
+			std::size_t used = 0;
+			for (std::uint32_t termId : slots) {
+				if (termId == NO_TERM)
+					continue;
+				if (termId >= termCount)
+					return false;
+				used++;
+			}
+			if (used != termCount)
+				return false;
+
+			clear();
+			_mappedArena = arena;
+			_mappedOffsets = offsets;
+			_mappedSlots = slots;
+			_mask = slots.empty() ? 0 : slots.size() - 1;
+			_mapped = true;
+			return true;
+		}
+
+	private:
+		static std::size_t hash(const char* word, std::size_t len) {
+			std::uint64_t h = ns_util::hashUtil::hash64(word, len);
+			// hash64 的低位 主要由最后几个字节决定, 混合一下高位, 使槽位分布均匀
+			return static_cast<std::size_t>(h ^ (h >> 32));
+		}
+
+		bool equal(std::uint32_t termId, const char* word, std::size_t len) const {
+			return termLength(termId) == len && memcmp(term(termId), word, len) == 0;
+		}
+
+		// 写时复制: 数据来自快照映射时, 添加关键字之前 先复制到自己的内存中
+		void own() {
+			if (!_mapped)
+				return;
+			_arena.assign(_mappedArena.data(), _mappedArena.size());
+			_offsets.assign(_mappedOffsets.begin(), _mappedOffsets.end());
+			_slots.assign(_mappedSlots.begin(), _mappedSlots.end());
+			_mappedArena = textRef();
+			_mappedOffsets = arrayRef<std::uint32_t>();
+			_mappedSlots = arrayRef<std::uint32_t>();
+			_mapped = false;
+		}
+
+		// 扩大哈希表, 并重新放入所有的 termId. 发现重复的关键字时返回false
+		bool rehash(std::size_t slotCount) {
+			_slots.assign(slotCount, NO_TERM);
+			_mask = slotCount - 1;
+			for (std::uint32_t termId = 0; termId < size(); termId++) {
+				std::size_t slot = hash(term(termId), termLength(termId)) & _mask;
+				for (; _slots[slot] != NO_TERM; slot = (slot + 1) & _mask) {
+					if (equal(_slots[slot], term(termId), termLength(termId)))
+						return false;
+				}
+				_slots[slot] = termId;
+			}
+			return true;
+		}
+
+		std::string _arena;					  // 所有关键字 首尾相接
+		std::vector<std::uint32_t> _offsets; // 每个关键字在 _arena 中的起始偏移, 最后一个元素是 _arena 的长度
+		std::vector<std::uint32_t> _slots;	  // 开放寻址哈希表, 存储 termId, NO_TERM 表示空槽
+		std::size_t _mask;					  // 哈希表大小 - 1, 哈希表大小总是2的幂
+		// _mapped 为 true 时, 以上三项数据在快照的映射中, _arena _offsets _slots 不使用
+		bool _mapped;
+		textRef _mappedArena;
+		arrayRef<std::uint32_t> _mappedOffsets;
+		arrayRef<std::uint32_t> _mappedSlots;
+	};
+} // namespace ns_index
@@ -3,15 +3,22 @@
 #pragma once
 
 #include <boost/algorithm/string/case_conv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <mutex>
+#include <unistd.h>
 #include <boost/algorithm/string.hpp>
 #include "logMessage.hpp"
 #include "cppjieba/Jieba.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace ns_util {
 	class fileUtil {
@@ -74,6 +81,82 @@ namespace ns_util {
 
 			return true;
 		}
+
+		// 在 [begin, end) 中 不区分ASCII大小写地查找 [keyword, keyword + len), 返回第一次出现的位置, 找不到时返回 end
+		// 先用关键字的首尾两个字节 筛选候选位置, SSE2 一次检查16个位置, 只有首尾都相同的位置 才逐字节比较
+		// 字母的小写 与大写 只差 0x20 这一位, 所以 字母字节或上 0x20 再比较, 就可以同时匹配大小写
+		static const char* findIgnoreCase(const char* begin, const char* end, const char* keyword, std::size_t len) {
+			if (len == 0)
+				return begin;
+			if (static_cast<std::size_t>(end - begin) < len)
+				return end;
+
+			const char* last = end - len; // 最后一个可能的起始位置
+			const char first = lower(keyword[0]);
+			const char tail = lower(keyword[len - 1]);
+			const char* p = begin;
+#ifdef __SSE2__
+			const __m128i firstMask = _mm_set1_epi8(isLetter(first) ? 0x20 : 0);
+			const __m128i tailMask = _mm_set1_epi8(isLetter(tail) ? 0x20 : 0);
+			const __m128i firstBytes = _mm_set1_epi8(first);
+			const __m128i tailBytes = _mm_set1_epi8(tail);
+			for (; p + 16 <= last + 1; p += 16) {
+				__m128i head = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), firstMask);
+				__m128i back = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + len - 1)), tailMask);
+				int mask = _mm_movemask_epi8(
+					_mm_and_si128(_mm_cmpeq_epi8(head, firstBytes), _mm_cmpeq_epi8(back, tailBytes)));
+				while (mask != 0) {
+					const char* candidate = p + __builtin_ctz(mask);
+					if (equalIgnoreCase(candidate, keyword, len))
+						return candidate;
+					mask &= mask - 1;
+				}
+			}
+#endif
+			for (; p <= last; p++) {
+				if (lower(*p) == first && equalIgnoreCase(p, keyword, len))
+					return p;
+			}
+
+			return end;
+		}
+
+	private:
+		static bool isLetter(char c) {
+			return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+		}
+		static char lower(char c) {
+			return 'A' <= c && c <= 'Z' ? c + ('a' - 'A') : c;
+		}
+		static bool equalIgnoreCase(const char* s, const char* keyword, std::size_t len) {
+			for (std::size_t i = 0; i < len; i++) {
+				if (lower(s[i]) != lower(keyword[i]))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	class hashUtil {
+	public:
+		// 64位校验和, 每次处理8字节, 用于索引快照等大块数据的完整性校验
+		// 可以分段计算: 只要除最后一段外 每段长度都是8的倍数, 结果就与一次性计算相同
+		static std::uint64_t hash64(const char* data, std::size_t len, std::uint64_t seed = 0xcbf29ce484222325ULL) {
+			const std::uint64_t prime = 0x100000001b3ULL;
+			std::uint64_t h = seed;
+			std::size_t i = 0;
+			for (; i + 8 <= len; i += 8) {
+				std::uint64_t word;
+				memcpy(&word, data + i, sizeof(word));
+				h = (h ^ word) * prime;
+				h ^= h >> 29;
+			}
+			for (; i < len; i++) {
+				h = (h ^ static_cast<unsigned char>(data[i])) * prime;
+			}
+
+			return h;
+		}
 	};
 
 	const char* const DICT_PATH = "./cppjiebaDict/jieba.dict.utf8";
@@ -81,14 +164,47 @@ namespace ns_util {
 	const char* const USER_DICT_PATH = "./cppjiebaDict/user.dict.utf8";
 	const char* const IDF_PATH = "./cppjiebaDict/idf.utf8";
 	const char* const STOP_WORD_PATH = "./cppjiebaDict/stop_words.utf8";
+	// 由 jiebaCompile 根据 词典、用户词典、HMM模型 生成的编译词典
+	const char* const COMPILED_DICT_PATH = "./cppjiebaDict/jieba.dict.bin";
+
+	// 代码感知分词(jiebaUtil::analyze) 输出的词 按种类有不同的权重
+	// 建立索引时 词每出现一次, 就按它的权重累加词频. 用户搜索完整的名字时, 精确包含这个名字的文档 权重更高
+	const std::uint32_t SUBWORD_WEIGHT = 1;	   // 复合标识符按 下划线、大小写 拆出的子词, 如 io_context 中的 io
+	const std::uint32_t WORD_WEIGHT = 2;	   // 普通的词, 以及不可再拆分的标识符, 如 asio
+	const std::uint32_t IDENTIFIER_WEIGHT = 4; // 完整的复合标识符, 如 io_context shared_ptr basicStringView
+	const std::uint32_t MACRO_WEIGHT = 6;	   // 宏名: 全大写 且含有下划线的标识符, 如 BOOST_RV_REF
+	const std::uint32_t QUALIFIED_WEIGHT = 8;  // 限定名 及其后缀, 如 boost::asio::io_context asio::io_context
+
+	// 分析文本时 每隔这么多个位置 记录一次对应的字节偏移(见 jiebaUtil::analyze), 用于 通过词的位置 在文本中定位这个词
+	const std::uint32_t OFFSET_SAMPLE_INTERVAL = 32;
+
+	// 代码感知分词的结果中的一个词
+	typedef struct term {
+		std::string _word;	   // 词, 已转为小写
+		std::uint32_t _weight;	 // 词的种类对应的权重
+		std::uint32_t _position; // 词在文本中的位置, 用于短语查询
+
+		term(std::string word, std::uint32_t weight, std::uint32_t position)
+			: _word(std::move(word))
+			, _weight(weight)
+			, _position(position) {}
+	} term_t;
 
 	class jiebaUtil {
 	private:
-		cppjieba::Jieba _jieba;
+		// 加载了编译词典时, _jieba 直接使用编译词典映射的内存, 所以 _compiled 要在 _jieba 之前构造、之后析构
+		cppjieba::CompiledDict _compiled;
+		cppjieba::Jieba* _jieba;
 		std::unordered_map<std::string, bool> _stopKeywordMap;
 
 		jiebaUtil()
-			: _jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH) {}
+			: _jieba(nullptr) {
+			if (loadCompiledDict())
+				_jieba = new cppjieba::Jieba(_compiled, IDF_PATH, STOP_WORD_PATH);
+			else
+				_jieba = new cppjieba::Jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH);
+		}
+		~jiebaUtil() { delete _jieba; }
 
 		jiebaUtil(const jiebaUtil&) = delete;
 		jiebaUtil& operator=(const jiebaUtil&) = delete;
@@ -96,23 +212,291 @@ namespace ns_util {
 		static jiebaUtil* _instance;
 
 	private:
+		// 加载编译词典(格式见 cppjieba/CompiledDict.hpp)
+		// 编译词典只需要 mmap, 不需要解析文本词典、计算权重和建立词典树, 并且 多个进程共享同一份物理内存
+		// 编译词典不存在、无效, 或 文本词典在编译之后被修改过时 返回false, 此时使用文本词典
+		bool loadCompiledDict() {
+			if (access(COMPILED_DICT_PATH, F_OK) != 0)
+				return false;
+			// 文本词典不存在时, 无法判断编译词典是否过期, 直接使用编译词典
+			std::uint64_t sourceHash = 0;
+			cppjieba::CompiledDict::HashSources(DICT_PATH, USER_DICT_PATH, HMM_PATH, &sourceHash);
+			if (!_compiled.Load(COMPILED_DICT_PATH, sourceHash)) {
+				LOG(WARNING, "编译词典 %s 无效或已过期, 使用文本词典. 请重新运行 jiebaCompile", COMPILED_DICT_PATH);
+				return false;
+			}
+			LOG(NOTICE, "已加载编译词典: %s", COMPILED_DICT_PATH);
+
+			return true;
+		}
+
+		// ASCII 快速分词
+		// Boost 文档几乎都是英文和C++标识符, 如果整个交给 jieba, 每个字符都要 解码为Unicode、查找词典树、计算最大概率路径
+		// 而 jieba 对 ASCII 字符的切分规则是固定的(见 HMMSegment::Cut 与 PreFilter):
+		//  字母开头的 字母数字串 为一个词, 数字开头的 数字和'.'串 为一个词, 其他每个字符(包括空白)各为一个词
+		// 所以 分词时 先找出连续的ASCII字符, 直接按上面的规则切分, 只有非ASCII的部分 才交给 jieba
+		// 词典中没有包含ASCII字符的词时, 结果与整个交给 jieba 完全相同. 否则有两点不同:
+		//  1. jieba(QuerySegment) 还会输出英文单词中 出现在词典里的2字、3字子串, 如 Boost 中的 "os" "st", 对英文搜索只是噪音
+		//  2. 词典中 "T恤" "卡拉OK" 这类中英混合的词 会被拆开, 不过 Boost 文档中几乎不会出现
+		static bool isAsciiLetter(char c) {
+			return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+		}
+		static bool isAsciiDigit(char c) {
+			return '0' <= c && c <= '9';
+		}
+
+#ifdef __SSE2__
+		// 16个字节中 在 [lo, hi] 范围内的字节, 对应位为1
+		// 先平移, 使 lo 对应有符号数的最小值, 这样一次有符号比较 就可以判断范围, 非ASCII字节也不会误判
+		static int inRangeMask(__m128i bytes, char lo, char hi) {
+			__m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8(static_cast<char>(0x80 - lo)));
+			return _mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(0x80 + hi - lo + 1))));
+		}
+#endif
+
+		// 从 p 开始的 字母数字串 的结束位置
+		static const char* alnumEnd(const char* p, const char* end) {
+#ifdef __SSE2__
+			for (; p + 16 <= end; p += 16) {
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+				int mask = inRangeMask(bytes, 'a', 'z') | inRangeMask(bytes, 'A', 'Z') | inRangeMask(bytes, '0', '9');
+				if (mask != 0xffff)
+					return p + __builtin_ctz(~mask);
+			}
+#endif
+			while (p < end && (isAsciiLetter(*p) || isAsciiDigit(*p)))
+				p++;
+			return p;
+		}
+
+		// 从 p 开始的 数字和'.'串 的结束位置
+		static const char* numberEnd(const char* p, const char* end) {
+			while (p < end && (isAsciiDigit(*p) || *p == '.'))
+				p++;
+			return p;
+		}
+
+		// 从 p 开始的 非ASCII字节串 的结束位置
+		// UTF-8 多字节字符的每个字节都 >= 0x80, 所以不会把一个字符截断
+		static const char* nonAsciiEnd(const char* p, const char* end) {
+#ifdef __SSE2__
+			for (; p + 16 <= end; p += 16) {
+				int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+				if (mask != 0xffff)
+					return p + __builtin_ctz(~mask);
+			}
+#endif
+			while (p < end && (*p & 0x80))
+				p++;
+			return p;
+		}
+
+		void cutMixed(const std::string& src, std::vector<std::string>* out) {
+			out->clear();
+			// jieba 分词的结果 先存在这里, 再追加到 out 中. 多个线程会同时分词, 所以每个线程一个
+			static thread_local std::vector<std::string> jiebaWords;
+			const char* begin = src.data();
+			const char* end = begin + src.size();
+			for (const char* p = begin; p < end;) {
+				const char* wordEnd;
+				if (*p & 0x80) {
+					wordEnd = nonAsciiEnd(p, end);
+					_jieba->CutForSearch(std::string(p, wordEnd), jiebaWords);
+					for (std::string& word : jiebaWords) {
+						out->push_back(std::move(word));
+					}
+				}
+				else {
+					if (isAsciiLetter(*p))
+						wordEnd = alnumEnd(p + 1, end);
+					else if (isAsciiDigit(*p))
+						wordEnd = numberEnd(p + 1, end);
+					else
+						wordEnd = p + 1;
+					out->emplace_back(p, wordEnd);
+				}
+				p = wordEnd;
+			}
+		}
+
 		void noStopHelper(const std::string& src, std::vector<std::string>* out) {
-			_jieba.CutForSearch(src, *out);
-			// 遍历out 查询是否为停止词 是则删除
-			// 需要注意迭代器失效的问题
-			for (auto iter = out->begin(); iter != out->end();) {
-				std::string word = *iter;
-				boost::to_lower(word);
-				auto stopIt = _stopKeywordMap.find(word);
-				// auto stopIt = _stopKeywordMap.find(*iter);
-				if (stopIt != _stopKeywordMap.end()) {
-					// 注意接收erase的返回值 防止出现迭代器失效问题
-					iter = out->erase(iter);
+			cutMixed(src, out);
+			// 删除停止词. 逐个 erase 每次都要移动后面所有的元素, 所以用 remove_if 一次完成
+			std::string lower;
+			out->erase(std::remove_if(out->begin(), out->end(),
+									  [this, &lower](const std::string& word) {
+										  lower = word;
+										  boost::to_lower(lower);
+										  return _stopKeywordMap.find(lower) != _stopKeywordMap.end();
+									  }),
+					   out->end());
+		}
+
+		// 代码感知分词
+		// Boost 文档中的 C++ 名字, 按上面的ASCII规则会被切碎: boost::asio::io_context 会被切分为
+		//  boost : : asio : : io _ context, 用户搜索完整的名字时, 只能匹配到满篇都是 asio context 的文档
+		// 所以 分析时把 字母或'_'开头的 标识符, 以及用"::"连接的标识符序列 作为一个名字整体处理, 名字会输出:
+		//  1. 两段以上的限定名 输出 完整的限定名 和 它的每个后缀: boost::asio::io_context asio::io_context
+		//  2. 每一段标识符: 可以拆分的 (含有下划线 或 camelCase), 输出 完整的标识符(全大写的为宏名) 和 拆出的子词
+		//     io_context -> io_context io context, BOOST_RV_REF -> boost_rv_ref boost rv ref
+		//     basicStringView -> basicstringview basic string view, HTTPServer -> httpserver http server
+		//     不能拆分的标识符 如 asio, 与普通的词相同
+		// 模板参数的尖括号 与其他标点一样 每个字符为一个词, 模板名和参数中的名字 都按上面的规则分析
+		// 非ASCII部分 仍交给 jieba. 所有输出的词都已转为小写, 并带有其种类对应的权重
+		//
+		// 每个词还带有它在文本中的位置, 相邻的两个词 位置相差1, 短语查询据此判断词是否相邻:
+		//  普通的词 和 子词 各占一个位置, io_context 中 io 与 context 的位置相邻, 所以短语 "io context" 也可以匹配
+		//  完整的标识符 与它的第一个子词位置相同, 限定名 与它的第一段位置相同
+		//  停止词虽然不输出, 但仍然占一个位置. 空白和ASCII标点不占位置, 所以 "a, b" 和 "a  b" 中 a b 也是相邻的
+		static bool isNameStart(char c) {
+			return isAsciiLetter(c) || c == '_';
+		}
+		static bool isAsciiUpper(char c) {
+			return 'A' <= c && c <= 'Z';
+		}
+		static bool isAsciiLower(char c) {
+			return 'a' <= c && c <= 'z';
+		}
+
+		// 从 p 开始的 标识符(字母数字和'_') 的结束位置
+		static const char* identifierEnd(const char* p, const char* end) {
+			p = alnumEnd(p, end);
+			while (p < end && *p == '_')
+				p = alnumEnd(p + 1, end);
+			return p;
+		}
+
+		static std::string lowerCopy(const char* begin, const char* end) {
+			std::string word(begin, end);
+			for (char& c : word) {
+				if (isAsciiUpper(c))
+					c += 'a' - 'A';
+			}
+			return word;
+		}
+
+		void addTerm(std::string word, std::uint32_t weight, std::uint32_t position, bool noStop,
+					 std::vector<term_t>* out) {
+			if (noStop && _stopKeywordMap.find(word) != _stopKeywordMap.end())
+				return;
+			out->emplace_back(std::move(word), weight, position);
+		}
+
+		// 分析名字中的一段标识符 [begin, end), position 为下一个词的位置
+		void analyzeIdentifier(const char* begin, const char* end, std::uint32_t* position, bool noStop,
+							   std::vector<term_t>* out) {
+			// 子词的边界: 下划线, 小写或数字 之后的大写(ioContext), 连续大写中 后面跟小写的那个(HTTPServer)
+			static thread_local std::vector<std::pair<const char*, const char*>> subwords;
+			subwords.clear();
+			bool hasUnderscore = false, hasLower = false;
+			const char* subBegin = begin;
+			for (const char* p = begin; p < end; p++) {
+				if (*p == '_') {
+					hasUnderscore = true;
+					if (subBegin < p)
+						subwords.emplace_back(subBegin, p);
+					subBegin = p + 1;
+					continue;
+				}
+				if (isAsciiLower(*p)) {
+					hasLower = true;
+				}
+				else if (isAsciiUpper(*p) && subBegin < p) {
+					char prev = p[-1];
+					if (isAsciiLower(prev) || isAsciiDigit(prev) ||
+						(isAsciiUpper(prev) && p + 1 < end && isAsciiLower(p[1]))) {
+						subwords.emplace_back(subBegin, p);
+						subBegin = p;
+					}
+				}
+			}
+			if (subBegin < end)
+				subwords.emplace_back(subBegin, end);
+
+			// 只有下划线, 没有可以索引的内容
+			if (subwords.empty())
+				return;
+			if (subwords.size() == 1 && !hasUnderscore) {
+				addTerm(lowerCopy(begin, end), WORD_WEIGHT, (*position)++, noStop, out);
+				return;
+			}
+			out->emplace_back(lowerCopy(begin, end), hasUnderscore && !hasLower ? MACRO_WEIGHT : IDENTIFIER_WEIGHT,
+							  *position);
+			for (const std::pair<const char*, const char*>& subword : subwords) {
+				addTerm(lowerCopy(subword.first, subword.second), SUBWORD_WEIGHT, (*position)++, noStop, out);
+			}
+		}
+
+		// 分析从 p 开始的名字, 返回名字的结束位置
+		const char* analyzeName(const char* p, const char* end, std::uint32_t* position, bool noStop,
+								std::vector<term_t>* out) {
+			// 名字中每一段标识符的起始位置, 以及每一段的第一个词的位置
+			static thread_local std::vector<const char*> parts;
+			static thread_local std::vector<std::uint32_t> partPositions;
+			parts.clear();
+			partPositions.clear();
+			const char* nameEnd = p;
+			while (true) {
+				parts.push_back(nameEnd);
+				nameEnd = identifierEnd(nameEnd + 1, end);
+				if (end - nameEnd < 3 || nameEnd[0] != ':' || nameEnd[1] != ':' || !isNameStart(nameEnd[2]))
+					break;
+				nameEnd += 2;
+			}
+
+			// 限定名排在最前面, 搜索时 摘要优先使用限定名定位. 它们的位置要分析完每一段之后才知道
+			const std::size_t qualifiedBegin = out->size();
+			for (std::size_t i = 0; i + 1 < parts.size(); i++) {
+				out->emplace_back(lowerCopy(parts[i], nameEnd), QUALIFIED_WEIGHT, 0);
+			}
+			for (std::size_t i = 0; i < parts.size(); i++) {
+				partPositions.push_back(*position);
+				analyzeIdentifier(parts[i], i + 1 < parts.size() ? parts[i + 1] - 2 : nameEnd, position, noStop, out);
+			}
+			for (std::size_t i = 0; i + 1 < parts.size(); i++) {
+				(*out)[qualifiedBegin + i]._position = partPositions[i];
+			}
+
+			return nameEnd;
+		}
+
+		std::uint32_t analyzeHelper(const std::string& src, bool noStop, std::vector<term_t>* out,
+									std::vector<std::uint32_t>* offsets) {
+			out->clear();
+			if (offsets)
+				offsets->clear();
+			static thread_local std::vector<std::string> jiebaWords;
+			const char* begin = src.data();
+			const char* end = begin + src.size();
+			std::uint32_t position = 0;
+			for (const char* p = begin; p < end;) {
+				const char* wordEnd;
+				if (*p & 0x80) {
+					wordEnd = nonAsciiEnd(p, end);
+					_jieba->CutForSearch(std::string(p, wordEnd), jiebaWords);
+					for (std::string& word : jiebaWords) {
+						addTerm(std::move(word), WORD_WEIGHT, position++, noStop, out);
+					}
+				}
+				else if (isNameStart(*p)) {
+					wordEnd = analyzeName(p, end, &position, noStop, out);
+				}
+				else if (isAsciiDigit(*p)) {
+					wordEnd = numberEnd(p + 1, end);
+					addTerm(std::string(p, wordEnd), WORD_WEIGHT, position++, noStop, out);
 				}
 				else {
-					iter++;
+					wordEnd = p + 1;
+					addTerm(std::string(p, wordEnd), WORD_WEIGHT, position, noStop, out);
+				}
+				// 这一段文本 [p, wordEnd) 中的词 占用的位置里 需要采样的位置, 都记为这一段的起始偏移
+				while (offsets && offsets->size() * OFFSET_SAMPLE_INTERVAL < position) {
+					offsets->push_back(p - begin);
 				}
+				p = wordEnd;
 			}
+
+			return position;
 		}
 
 		// 主要是为了支持 消除停止词的分词
@@ -151,12 +535,20 @@ namespace ns_util {
 
 		// 分词: 不消除停止词的版本
 		void cutString(const std::string& src, std::vector<std::string>* out) {
-			_jieba.CutForSearch(src, *out);
+			cutMixed(src, out);
 		}
 		// 分词: 消除停止词的版本
 		void cutStringNoStop(const std::string& src, std::vector<std::string>* out) {
 			noStopHelper(src, out);
 		}
+		// 代码感知分词: 输出小写的词 及其权重和位置, noStop 为true时 消除停止词
+		// 返回文本占用的位置数, 即最后一个词的位置 + 1
+		// offsets 不为空时, (*offsets)[i] 为 位置 i * OFFSET_SAMPLE_INTERVAL 的词 所在的一段文本的起始字节偏移
+		//  一个词的字节偏移 不小于 它的位置对应的采样值, 从采样值开始查找 很快就能在文本中找到这个词
+		std::uint32_t analyze(const std::string& src, bool noStop, std::vector<term_t>* out,
+							  std::vector<std::uint32_t>* offsets = nullptr) {
+			return analyzeHelper(src, noStop, out, offsets);
+		}
 	};
 	jiebaUtil* jiebaUtil::_instance;
 	// cppjieba::Jieba jiebaUtil::jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH);